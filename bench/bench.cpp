@@ -0,0 +1,966 @@
+/*
+ * Benchmarks for the image processing parts of the screenshotter.
+ *
+ * Usage: shot_bench [png|conv|codecs|frames|compare|alloc|screenshot] [WIDTHxHEIGHT | FILE.bgrx]
+ *                   [--baseline FILE] [--save-baseline FILE]
+ *
+ * A raw capture (e.g. `shot --format raw` or `shot --client FILE.bgrx`) can be
+ * given instead of a size to measure on a real desktop instead of the synthetic image.
+ *
+ * `frames` stores a sequence of mostly identical frames, as separate images and in a FrameStore,
+ * and exits with an error if a frame read back from the FrameStore differs from its input.
+ *
+ * `compare` measures ImageDiff on two images that differ in a few small areas.
+ *
+ * `alloc` allocates and touches frame buffers with new[] and with FramePool, and counts the page faults.
+ *
+ * `screenshot` needs an X server, see xvfb_bench.sh.
+ *
+ * `--save-baseline` stores the ns/pixel of every result, `--baseline` prints the
+ * change relative to a stored run next to each result.
+ */
+
+#include "PngEncoder.h"
+#include "Codec.h"
+#include "PixelConv.h"
+#include "ImageConv.h"
+#include "ImageView.h"
+#include "Screenshot.h"
+#include "ShmImage.h"
+#include "FrameStore.h"
+#include "ImageDiff.h"
+#include "ImageLoader.h"
+#include "FramePool.h"
+#include <X11/Xlib.h>
+#include <X11/Xutil.h>
+#include <sys/resource.h>
+#include <libpng/png.h>
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <fstream>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cassert>
+#include <atomic>
+#include <map>
+#include <new>
+
+static constexpr const char* tmpFilePath = "/tmp/shot_bench.png";
+static constexpr const char* tmpFrameStorePath = "/tmp/shot_bench.frames";
+
+// Used by ShmImage
+bool g_isDisplayOpen = false;
+
+// --- Allocation counting ---
+// Only counts C++ allocations, zlib and Xlib use malloc directly
+
+static std::atomic<size_t> s_allocCount{};
+static std::atomic<size_t> s_allocBytes{};
+
+// Not inlined, otherwise GCC warns about deleting the result of malloc() and vice versa
+__attribute__((noinline)) void* operator new(size_t size)
+{
+    ++s_allocCount;
+    s_allocBytes += size;
+    if (void* ptr = std::malloc(size ? size : 1))
+        return ptr;
+    throw std::bad_alloc{};
+}
+
+__attribute__((noinline)) void operator delete(void* ptr) noexcept
+{
+    std::free(ptr);
+}
+
+__attribute__((noinline)) void operator delete(void* ptr, size_t) noexcept
+{
+    std::free(ptr);
+}
+
+// --- Results ---
+
+// Allocations and page faults of the last run of `timeBest()`
+static size_t s_lastRunAllocCount{};
+static size_t s_lastRunAllocBytes{};
+static long s_lastRunFaults{};
+
+// The results are keyed by the section and the name
+static std::string s_section;
+// ns/pixel by result key
+static std::map<std::string, double> s_results;
+static std::map<std::string, double> s_baseline;
+
+/*
+ * Generates something that compresses like a desktop screenshot:
+ * flat window backgrounds, gradients and noisy "text" rows.
+ */
+static std::vector<uint8_t> genTestImage(int width, int height)
+{
+    std::vector<uint8_t> data((size_t)width*height*4);
+    uint32_t rand = 12345;
+    for (int y{}; y < height; ++y)
+    {
+        for (int x{}; x < width; ++x)
+        {
+            uint8_t* pxl = data.data()+((size_t)y*width+x)*4;
+            const int region = (x/400+y/300)%4;
+            if (region == 0) // Flat background
+            {
+                pxl[0] = 0x30; pxl[1] = 0x30; pxl[2] = 0x30;
+            }
+            else if (region == 1) // Gradient
+            {
+                pxl[0] = x; pxl[1] = y; pxl[2] = x+y;
+            }
+            else if (region == 2 && y%16 < 10) // Text-like noise
+            {
+                rand = rand*1103515245+12345;
+                const uint8_t val = (rand>>16)&1 ? 0xff : 0x20;
+                pxl[0] = val; pxl[1] = val; pxl[2] = val;
+            }
+            else
+            {
+                pxl[0] = 0xee; pxl[1] = 0xee; pxl[2] = 0xee;
+            }
+            pxl[3] = 255;
+        }
+    }
+    return data;
+}
+
+// Loads a raw BGRX dump, see `RAW_MAGIC`
+static std::vector<uint8_t> readRawFile(const std::string& filename, int* width, int* height)
+{
+    std::ifstream file{filename, std::ios_base::binary};
+    uint8_t header[RAW_HEADER_SIZE]{};
+    if (!file.read((char*)header, sizeof(header)) || std::memcmp(header, RAW_MAGIC, 8) != 0)
+    {
+        std::cerr << "Not a raw capture: " << filename << '\n';
+        std::exit(1);
+    }
+    *width = 0;
+    *height = 0;
+    for (int i{}; i < 4; ++i)
+    {
+        *width |= header[8+i] << (i*8);
+        *height |= header[12+i] << (i*8);
+    }
+    std::vector<uint8_t> data((size_t)*width**height*4);
+    if (!file.read((char*)data.data(), data.size()))
+    {
+        std::cerr << "Truncated raw capture: " << filename << '\n';
+        std::exit(1);
+    }
+    return data;
+}
+
+// The original single-threaded libpng writer, used as the baseline
+static void writePngLibpng(const ImageView& img, const std::string& filename)
+{
+    FILE* fp = fopen(filename.c_str(), "wb");
+    assert(fp);
+
+    png_structp pngPtr = png_create_write_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr);
+    assert(pngPtr);
+    png_infop infoPtr = png_create_info_struct(pngPtr);
+    assert(infoPtr);
+
+    int ret = setjmp(png_jmpbuf(pngPtr));
+    assert(ret == 0);
+    (void)ret;
+
+    png_init_io(pngPtr, fp);
+    png_set_IHDR(pngPtr, infoPtr, img.width, img.height, 8,
+            PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_BASE,
+            PNG_FILTER_TYPE_BASE);
+    png_write_info(pngPtr, infoPtr);
+
+    std::vector<uint8_t> row(img.width*3);
+    for (int y{}; y < img.height; ++y)
+    {
+        const uint8_t* src = img.getRow(y);
+        for (int x{}; x < img.width; ++x)
+        {
+            row[x*3+0] = src[x*4+2];
+            row[x*3+1] = src[x*4+1];
+            row[x*3+2] = src[x*4+0];
+        }
+        png_write_row(pngPtr, row.data());
+    }
+
+    png_write_end(pngPtr, infoPtr);
+    png_destroy_write_struct(&pngPtr, &infoPtr);
+    fclose(fp);
+}
+
+// Minor page faults of the process so far, each first touch of a page is one
+static long getPageFaults()
+{
+    rusage usage{};
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_minflt+usage.ru_majflt;
+}
+
+static long getFileSize(const std::string& filename)
+{
+    FILE* fp = fopen(filename.c_str(), "rb");
+    if (!fp)
+        return -1;
+    fseek(fp, 0, SEEK_END);
+    const long size = ftell(fp);
+    fclose(fp);
+    return size;
+}
+
+// Runs `setup` (not measured) then `fun` a few times and returns the best time of `fun` in seconds
+static double timeBest(const std::function<void()>& setup, const std::function<void()>& fun, int runs=3)
+{
+    double best = 1e30;
+    for (int i{}; i < runs; ++i)
+    {
+        if (setup)
+            setup();
+        const size_t allocCountBefore = s_allocCount;
+        const size_t allocBytesBefore = s_allocBytes;
+        const long faultsBefore = getPageFaults();
+        const auto start = std::chrono::steady_clock::now();
+        fun();
+        const auto end = std::chrono::steady_clock::now();
+        s_lastRunAllocCount = s_allocCount-allocCountBefore;
+        s_lastRunAllocBytes = s_allocBytes-allocBytesBefore;
+        s_lastRunFaults = getPageFaults()-faultsBefore;
+        best = std::min(best, std::chrono::duration<double>(end-start).count());
+    }
+    return best;
+}
+
+static double timeBest(const std::function<void()>& fun, int runs=3)
+{
+    return timeBest(nullptr, fun, runs);
+}
+
+static void printSection(const std::string& name, int width, int height)
+{
+    s_section = name+" "+std::to_string(width)+"x"+std::to_string(height);
+    std::cout << "--- " << name << ", " << width << 'x' << height << " ---\n";
+}
+
+// `inputBytes` is the size of the BGRX input, the allocations and page faults are the ones of the last run
+static void printResult(const std::string& name, double secs, size_t inputBytes, long outputBytes)
+{
+    const double nsPerPixel = secs*1e9/(inputBytes/4);
+    const std::string key = s_section+": "+name;
+    s_results[key] = nsPerPixel;
+
+    std::cout << std::left << std::setw(36) << name
+        << std::right << std::fixed << std::setprecision(1)
+        << std::setw(9) << secs*1000 << " ms"
+        << std::setprecision(2) << std::setw(8) << nsPerPixel << " ns/px"
+        << std::setprecision(1) << std::setw(9) << inputBytes/secs/1e6 << " MB/s"
+        << std::setw(7) << s_lastRunAllocCount << " allocs"
+        << std::setw(8) << s_lastRunAllocBytes/1e6 << " MB"
+        << std::setw(8) << s_lastRunFaults << " faults";
+    if (outputBytes >= 0)
+        std::cout << std::setw(12) << outputBytes << " bytes";
+
+    auto it = s_baseline.find(key);
+    if (it != s_baseline.end())
+        std::cout << std::showpos << std::setw(9) << (nsPerPixel/it->second-1)*100 << "%" << std::noshowpos;
+    std::cout << '\n';
+}
+
+// One result per line: name, tab, ns/pixel
+static void loadBaseline(const std::string& filename)
+{
+    std::ifstream file{filename};
+    if (!file)
+    {
+        std::cerr << "Failed to open baseline: " << filename << '\n';
+        std::exit(1);
+    }
+    std::string line;
+    while (std::getline(file, line))
+    {
+        const size_t tabPos = line.rfind('\t');
+        if (tabPos != std::string::npos)
+            s_baseline[line.substr(0, tabPos)] = std::stod(line.substr(tabPos+1));
+    }
+}
+
+static void saveBaseline(const std::string& filename)
+{
+    std::ofstream file{filename};
+    for (const auto& result : s_results)
+        file << result.first << '\t' << result.second << '\n';
+    if (!file)
+    {
+        std::cerr << "Failed to write baseline: " << filename << '\n';
+        std::exit(1);
+    }
+    std::cout << "Saved baseline to " << filename << '\n';
+}
+
+static void benchPng(int width, int height)
+{
+    printSection("PNG encoding", width, height);
+    const std::vector<uint8_t> data = genTestImage(width, height);
+    const ImageView img{data.data(), width, height, width*4};
+    const size_t inputBytes = data.size();
+
+    const double libpngSecs = timeBest([&](){ writePngLibpng(img, tmpFilePath); });
+    printResult("libpng (baseline)", libpngSecs, inputBytes, getFileSize(tmpFilePath));
+
+    struct Config
+    {
+        const char* name;
+        PngEncoder::Options opts;
+    };
+    const Config configs[] = {
+        {"PngEncoder level=6 adaptive",       {6, PngEncoder::Filter::Adaptive, 0}},
+        {"PngEncoder level=6 adaptive 1 thr", {6, PngEncoder::Filter::Adaptive, 1}},
+        {"PngEncoder level=1 up",             {1, PngEncoder::Filter::Up,       0}},
+        {"PngEncoder level=1 none",           {1, PngEncoder::Filter::NoFilter, 0}},
+        {"PngEncoder level=9 paeth",          {9, PngEncoder::Filter::Paeth,    0}},
+    };
+    for (const Config& config : configs)
+    {
+        PngEncoder encoder{config.opts};
+        const double secs = timeBest([&](){ encoder.encodeToFile(img, tmpFilePath); });
+        printResult(config.name, secs, inputBytes, getFileSize(tmpFilePath));
+    }
+
+    std::remove(tmpFilePath);
+}
+
+// Exits if the streamed output of `format` is not the same as the buffered one
+static LoadedImage decodeOutput(const EncodedBuffer& encoded)
+{
+    writeBufferToFile(encoded, tmpFilePath);
+    LoadedImage decoded{tmpFilePath};
+    std::remove(tmpFilePath);
+    return decoded;
+}
+
+// Compares the color bytes only, the X byte is undefined in captures
+static bool isSameColors(const ImageView& a, const ImageView& b)
+{
+    if (a.width != b.width || a.height != b.height)
+        return false;
+    for (int y{}; y < a.height; ++y)
+    {
+        const uint8_t* rowA = a.getRow(y);
+        const uint8_t* rowB = b.getRow(y);
+        for (int x{}; x < a.width*4; x += 4)
+        {
+            if (rowA[x] != rowB[x] || rowA[x+1] != rowB[x+1] || rowA[x+2] != rowB[x+2])
+                return false;
+        }
+    }
+    return true;
+}
+
+static void checkOutput(const ImageView& img, Codec::Format format, const Codec::Options& opts)
+{
+    // The padding bytes must not leak into the output of either
+    std::vector<uint8_t> data((size_t)img.width*img.height*4);
+    for (int y{}; y < img.height; ++y)
+        std::memcpy(data.data()+(size_t)y*img.width*4, img.getRow(y), (size_t)img.width*4);
+    for (size_t i{}; i < data.size(); i += 4)
+        data[i+3] = i/4*37;
+    const ImageView scrambled{data.data(), img.width, img.height, img.width*4};
+
+    const EncodedBuffer buffered = Codec::encode(scrambled, format, opts);
+    if (!isSameColors(decodeOutput(buffered).getView(), scrambled))
+    {
+        std::cerr << "ERR: Decoded " << Codec::getFormatName(format) << " output differs from the source image\n";
+        std::exit(1);
+    }
+
+    auto streamed = std::make_shared<std::vector<uint8_t>>();
+    Codec::encodeToStream(scrambled, format, [&](const uint8_t* piece, size_t size){
+        streamed->insert(streamed->end(), piece, piece+size);
+    }, opts);
+
+    bool isSame = *streamed == *buffered;
+    // Streamed PNGs are compressed in smaller stripes, only the pixels must match
+    if (!isSame && format == Codec::Format::PNG)
+        isSame = isSameColors(decodeOutput(streamed).getView(), scrambled);
+    if (!isSame)
+    {
+        std::cerr << "ERR: Streamed " << Codec::getFormatName(format) << " output differs from the buffered one\n";
+        std::exit(1);
+    }
+}
+
+static void benchCodecs(const std::vector<uint8_t>& data, int width, int height)
+{
+    printSection("Output codecs", width, height);
+    const ImageView img{data.data(), width, height, width*4};
+
+    struct Config
+    {
+        const char* name;
+        Codec::Format format;
+        Codec::Options opts;
+    };
+    const Config configs[] = {
+        {"PNG level=6",         Codec::Format::PNG,  {6, 0}},
+        {"PNG level=1",         Codec::Format::PNG,  {1, 0}},
+        {"QOI",                 Codec::Format::QOI,  {}},
+        {"zstd level=1",        Codec::Format::Zstd, {1, 0}},
+        {"zstd level=3",        Codec::Format::Zstd, {3, 0}},
+        {"zstd level=3 1 thr",  Codec::Format::Zstd, {3, 1}},
+        {"zstd level=9",        Codec::Format::Zstd, {9, 0}},
+        {"raw",                 Codec::Format::Raw,  {}},
+        {"PPM",                 Codec::Format::PPM,  {}},
+        {"PAM",                 Codec::Format::PAM,  {}},
+        {"BMP",                 Codec::Format::BMP,  {}},
+    };
+    for (const Config& config : configs)
+    {
+        if (!Codec::isFormatAvailable(config.format))
+        {
+            std::cout << config.name << ": not available in this build\n";
+            continue;
+        }
+        EncodedBuffer encoded;
+        const double secs = timeBest([&](){ encoded = Codec::encode(img, config.format, config.opts); });
+        printResult(config.name, secs, data.size(), encoded->size());
+
+        // Like writing to a pipe, the allocations show the memory needed
+        size_t streamedBytes{};
+        const double streamSecs = timeBest([&](){
+            streamedBytes = 0;
+            Codec::encodeToStream(img, config.format, [&](const uint8_t*, size_t size){ streamedBytes += size; }, config.opts);
+        });
+        printResult(std::string(config.name)+" streamed", streamSecs, data.size(), streamedBytes);
+
+        checkOutput(img, config.format, config.opts);
+    }
+}
+
+// Exits with an error if the frames read back from a frame store differ from the stored ones
+static void checkFrameStore(const std::vector<std::vector<uint8_t>>& frames, int width, int height,
+        const FrameStoreWriter::Options& opts)
+{
+    {
+        FrameStoreWriter writer{tmpFrameStorePath, width, height, opts};
+        for (size_t i{}; i < frames.size(); ++i)
+            writer.addFrame({frames[i].data(), width, height, width*4}, i);
+    }
+
+    FrameStoreReader reader{tmpFrameStorePath};
+    bool isSame = reader.getFrameCount() == (int)frames.size();
+    for (int i{}; isSame && i < reader.getFrameCount(); ++i)
+    {
+        const ImageView frame = reader.readFrame(i);
+        isSame = reader.getFrameId(i) == (uint32_t)i && frame.width == width && frame.height == height;
+        for (int y{}; isSame && y < height; ++y)
+            isSame = std::memcmp(frame.getRow(y), frames[i].data()+(size_t)y*width*4, (size_t)width*4) == 0;
+        if (!isSame)
+            std::cerr << "ERR: Frame " << i << " read from the frame store differs from the stored one\n";
+    }
+    std::remove(tmpFrameStorePath);
+    if (!isSame)
+        std::exit(1);
+}
+
+// Like repeated captures of a mostly static UI: each frame differs from the first one in a small area
+static void benchFrames(const std::vector<uint8_t>& data, int width, int height)
+{
+    printSection("Frame sequence", width, height);
+    const int frameCount = 30;
+    std::vector<std::vector<uint8_t>> frames;
+    for (int i{}; i < frameCount; ++i)
+    {
+        std::vector<uint8_t> frame = data;
+        const int x = (i*97)%std::max(width-200, 1);
+        const int y = (i*53)%std::max(height-30, 1);
+        for (int row{y}; row < std::min(y+30, height); ++row)
+        {
+            for (int col{x}; col < std::min(x+200, width); ++col)
+                frame[((size_t)row*width+col)*4] ^= 0xff;
+        }
+        frames.push_back(std::move(frame));
+    }
+    const size_t inputBytes = data.size()*frameCount;
+
+    const std::pair<const char*, Codec::Format> formats[] = {
+        {"PNG level=1 per frame", Codec::Format::PNG},
+        {"QOI per frame",         Codec::Format::QOI},
+    };
+    for (const auto& format : formats)
+    {
+        size_t outputBytes{};
+        const double secs = timeBest([&](){
+            outputBytes = 0;
+            for (const std::vector<uint8_t>& frame : frames)
+                outputBytes += Codec::encode({frame.data(), width, height, width*4}, format.second, {1, 0})->size();
+        });
+        printResult(format.first, secs, inputBytes, outputBytes);
+    }
+
+    uint64_t storeBytes{};
+    const double secs = timeBest([&](){
+        FrameStoreWriter writer{tmpFrameStorePath, width, height, FrameStoreWriter::Options{}};
+        for (int i{}; i < frameCount; ++i)
+            writer.addFrame({frames[i].data(), width, height, width*4}, i);
+        storeBytes = writer.getFileSize();
+    });
+    printResult("FrameStore", secs, inputBytes, storeBytes);
+
+    FrameStoreReader reader{tmpFrameStorePath};
+    const double readSecs = timeBest([&](){
+        for (int i{}; i < frameCount; ++i)
+            reader.readFrame(i);
+    });
+    printResult("FrameStore read all", readSecs, inputBytes, -1);
+    std::remove(tmpFrameStorePath);
+
+    // Also through keyframes stored by interval and after a change of the whole image
+    checkFrameStore(frames, width, height, FrameStoreWriter::Options{});
+    std::vector<uint8_t> inverted = data;
+    for (size_t i{}; i < inverted.size(); i += 4)
+        inverted[i+1] ^= 0xff;
+    frames.insert(frames.begin()+frameCount/2, std::move(inverted));
+    FrameStoreWriter::Options opts;
+    opts.keyframeInterval = 7;
+    checkFrameStore(frames, width, height, opts);
+}
+
+// Draws the synthetic image on the root window, so the captures are not blank
+static void paintRootWindow(Display* disp, int width, int height)
+{
+    std::vector<uint8_t> data = genTestImage(width, height);
+    const int screen = XDefaultScreen(disp);
+    XImage* img = XCreateImage(disp, XDefaultVisual(disp, screen), XDefaultDepth(disp, screen),
+            ZPixmap, 0, (char*)data.data(), width, height, 32, width*4);
+    assert(img);
+    // Large images are split into multiple requests by Xlib
+    XPutImage(disp, XDefaultRootWindow(disp), XDefaultGC(disp, screen), img, 0, 0, 0, 0, width, height);
+    XSync(disp, false);
+    img->data = nullptr; // Owned by the vector
+    XDestroyImage(img);
+}
+
+static void benchScreenshot(Display* disp, int width, int height)
+{
+    printSection("Screenshot", width, height);
+    const WinGeometry geom{0, 0, width, height};
+    const size_t inputBytes = (size_t)width*height*4;
+
+    // Like the overlay does: new shared memory segment, capture, alpha fill
+    double secs = timeBest([&](){ Screenshot sshot{disp, geom}; });
+    printResult("capture (new segment)", secs, inputBytes, -1);
+
+    // Like the daemon does
+    ShmPool pool{disp, width, height, 1};
+    secs = timeBest([&](){ Screenshot sshot{disp, &pool, geom}; });
+    printResult("capture (pooled segment)", secs, inputBytes, -1);
+
+    std::unique_ptr<Screenshot> sshot;
+    auto recapture = [&](){
+        sshot.reset();
+        sshot = std::make_unique<Screenshot>(disp, geom);
+    };
+    secs = timeBest(recapture, [&](){ sshot->crop(width/4, height/4, width/2, height/2); });
+    printResult("crop to the center quarter", secs, inputBytes, -1);
+    secs = timeBest(recapture, [&](){ sshot->compact(); });
+    printResult("compact (copy out of shm)", secs, inputBytes, -1);
+
+    recapture();
+    const std::string outPath = "/tmp/shot_bench_out";
+    secs = timeBest([&](){ sshot->writeToPNGFile(outPath); });
+    printResult("writeToPNGFile", secs, inputBytes, getFileSize(outPath));
+    secs = timeBest([&](){ sshot->writeToPPMFile(outPath); });
+    printResult("writeToPPMFile", secs, inputBytes, getFileSize(outPath));
+    secs = timeBest([&](){ sshot->writeToPAMFile(outPath); });
+    printResult("writeToPAMFile", secs, inputBytes, getFileSize(outPath));
+    secs = timeBest([&](){ sshot->writeToRawFile(outPath); });
+    printResult("writeToRawFile", secs, inputBytes, getFileSize(outPath));
+    std::remove(outPath.c_str());
+
+    // What the clipboard holder serves for each target
+    for (Codec::Format format : {Codec::Format::PNG, Codec::Format::BMP, Codec::Format::PPM})
+    {
+        EncodedBuffer encoded;
+        secs = timeBest([&](){ encoded = sshot->encode(format); });
+        printResult(std::string("clipboard ")+Codec::getFormatName(format), secs, inputBytes, encoded->size());
+    }
+}
+
+static void benchScreenshots(int width, int height)
+{
+    Display* disp = XOpenDisplay(nullptr);
+    if (!disp)
+    {
+        std::cerr << "Failed to open display, run under Xvfb (see xvfb_bench.sh)\n";
+        std::exit(1);
+    }
+    g_isDisplayOpen = true;
+
+    XWindowAttributes attrs{};
+    XGetWindowAttributes(disp, XDefaultRootWindow(disp), &attrs);
+    std::cout << "Root window: " << attrs.width << 'x' << attrs.height << '\n';
+    paintRootWindow(disp, attrs.width, attrs.height);
+
+    struct Size
+    {
+        int width;
+        int height;
+    };
+    std::vector<Size> sizes;
+    if (width)
+        sizes.push_back({width, height});
+    else
+        sizes = {{1920, 1080}, {3840, 2160}, {3*3840, 2160}};
+
+    for (const Size& size : sizes)
+    {
+        if (size.width > attrs.width || size.height > attrs.height)
+        {
+            std::cout << "Skipping " << size.width << 'x' << size.height << ", larger than the screen\n";
+            continue;
+        }
+        benchScreenshot(disp, size.width, size.height);
+    }
+
+    XCloseDisplay(disp);
+    g_isDisplayOpen = false;
+}
+
+// Keeps the compiler from removing writes to memory that is not read afterwards
+static void escape(void* ptr)
+{
+    asm volatile("" : : "r"(ptr) : "memory");
+}
+
+static void benchConv(const std::string& name, int width, int height, int dstBpp,
+        const std::function<void(const uint8_t*, uint8_t*, int)>& legacy,
+        const std::function<void(const uint8_t*, uint8_t*, int)>& kernel)
+{
+    const std::vector<uint8_t> src = genTestImage(width, height);
+    std::vector<uint8_t> dst((size_t)width*height*dstBpp);
+    const int count = width*height;
+
+    if (legacy)
+    {
+        const double secs = timeBest([&](){ legacy(src.data(), dst.data(), count); }, 5);
+        printResult(name+" (legacy loop)", secs, src.size(), -1);
+    }
+    for (PixelConv::Isa isa : {PixelConv::Isa::Scalar, PixelConv::Isa::SSE2, PixelConv::Isa::SSSE3, PixelConv::Isa::AVX2})
+    {
+        if (!PixelConv::setIsa(isa))
+            continue;
+        const double secs = timeBest([&](){ kernel(src.data(), dst.data(), count); }, 5);
+        printResult(name+" ("+PixelConv::getIsaName(isa)+")", secs, src.size(), -1);
+    }
+}
+
+static void benchConvs(int width, int height)
+{
+    printSection("Pixel conversion", width, height);
+
+    // The loop that was in the Screenshot constructor
+    auto legacyAlpha = [](const uint8_t*, uint8_t* data, int count){
+        for (int i{}; i < count; ++i)
+            data[i*4+3] = 255;
+    };
+    benchConv("alpha fill", width, height, 4, legacyAlpha,
+            [](const uint8_t*, uint8_t* data, int count){ PixelConv::fillAlpha(data, count); });
+
+    // The loop that was in the PNG writer
+    auto legacyRgb = [width](const uint8_t* src, uint8_t* dst, int count){
+        for (int y{}; y < count/width; ++y)
+        {
+            for (int x{}; x < width; ++x)
+            {
+                dst[(y*width+x)*3+0] = src[(y*width+x)*4+2];
+                dst[(y*width+x)*3+1] = src[(y*width+x)*4+1];
+                dst[(y*width+x)*3+2] = src[(y*width+x)*4+0];
+            }
+        }
+    };
+    benchConv("BGRX->RGB", width, height, 3, legacyRgb, PixelConv::bgrxToRgb);
+
+    // The loop that was in the PPM writer, writing to /dev/null
+    std::ofstream devNull{"/dev/null", std::ios_base::binary};
+    auto legacyPpm = [&devNull](const uint8_t* src, uint8_t*, int count){
+        for (int i{}; i < count; ++i)
+        {
+            devNull.put(src[i*4+2]);
+            devNull.put(src[i*4+1]);
+            devNull.put(src[i*4+0]);
+        }
+    };
+    benchConv("PPM rows", width, height, 3, legacyPpm,
+            [&devNull, width](const uint8_t* src, uint8_t* dst, int count){
+                for (int y{}; y < count/width; ++y)
+                {
+                    PixelConv::bgrxToRgb(src+(size_t)y*width*4, dst, width);
+                    devNull.write((const char*)dst, width*3);
+                }
+            });
+
+    benchConv("BGRX->RGBA", width, height, 4, nullptr, PixelConv::bgrxToRgba);
+    benchConv("BGRX->BGR", width, height, 3, nullptr, PixelConv::bgrxToBgr);
+
+    // What `Screenshot::compact()` did before the copy and the alpha fill were one pass
+    auto legacyCopyAlpha = [](const uint8_t* src, uint8_t* dst, int count){
+        std::memcpy(dst, src, (size_t)count*4);
+        PixelConv::fillAlpha(dst, count);
+    };
+    benchConv("copy + alpha fill", width, height, 4, legacyCopyAlpha, PixelConv::bgrxToBgra);
+
+    // The 4-lane scalar hash that was in the frame store
+    auto legacyHash = [](const uint8_t* src, uint8_t*, int count){
+        uint64_t lanes[4]{};
+        int i{};
+        for (; i+8 <= count; i += 8)
+        {
+            uint64_t words[4];
+            std::memcpy(words, src+i*4, 32);
+            for (int j{}; j < 4; ++j)
+            {
+                const uint64_t acc = lanes[j]+words[j]*0xc2b2ae3d27d4eb4fULL;
+                lanes[j] = (acc << 31 | acc >> 33)*0x9e3779b185ebca87ULL;
+            }
+        }
+        escape(lanes);
+    };
+    benchConv("tile hash", width, height, 0, legacyHash,
+            [](const uint8_t* src, uint8_t*, int count){
+                uint64_t lanes[PixelConv::HASH_LANE_COUNT]{};
+                PixelConv::hashPixels(src, count, lanes, 0);
+                escape(lanes);
+            });
+
+    // The same on whole images, split into stripes, with the best kernels (the last ones set above)
+    const std::vector<uint8_t> src = genTestImage(width, height);
+    std::vector<uint8_t> dst(src.size());
+    const ImageView view{src.data(), width, height, width*4};
+    for (int threadCount : {1, 0})
+    {
+        const std::string suffix = threadCount ? " 1 thr" : "";
+        double secs = timeBest([&](){
+            ImageConv::convert(view, dst.data(), width*4, ImageConv::Format::BGRX, threadCount); }, 5);
+        printResult("ImageConv copy + alpha fill"+suffix, secs, src.size(), -1);
+        secs = timeBest([&](){
+            ImageConv::fillAlpha(dst.data(), width, height, width*4, threadCount); }, 5);
+        printResult("ImageConv alpha fill"+suffix, secs, src.size(), -1);
+    }
+}
+
+// A frame-sized buffer allocated and filled, like `Screenshot::compact()` and the QOI and zstd encoders do
+static void benchFrameAlloc(int width, int height)
+{
+    printSection("Frame buffers", width, height);
+    const std::vector<uint8_t> src = genTestImage(width, height);
+
+    const double newSecs = timeBest([&](){
+        uint8_t* buff = new uint8_t[src.size()];
+        std::memcpy(buff, src.data(), src.size());
+        escape(buff);
+        delete[] buff;
+    });
+    printResult("new[] + copy", newSecs, src.size(), -1);
+
+    struct Config
+    {
+        const char* name;
+        FramePool::Options opts;
+    };
+    const Config configs[] = {
+        {"FramePool no reuse, 4K pages",  {false, false, 0}},
+        {"FramePool no reuse, THP",       {true, false, 0}},
+        {"FramePool no reuse, hugetlbfs", {false, true, 0}},
+        {"FramePool recycled",            {true, false, 2}},
+    };
+    for (const Config& config : configs)
+    {
+        FramePool pool{config.opts};
+        const double secs = timeBest([&](){
+            uint8_t* buff = pool.acquire(src.size());
+            std::memcpy(buff, src.data(), src.size());
+            escape(buff);
+            pool.release(buff);
+        });
+        printResult(config.name, secs, src.size(), -1);
+    }
+}
+
+static void benchCompare(int width, int height)
+{
+    printSection("Image compare", width, height);
+    const std::vector<uint8_t> imgA = genTestImage(width, height);
+    std::vector<uint8_t> imgB = imgA;
+    for (int i{}; i < 10; ++i)
+    {
+        const int x = (i*397)%std::max(width-50, 1);
+        const int y = (i*251)%std::max(height-20, 1);
+        for (int row{y}; row < std::min(y+20, height); ++row)
+        {
+            for (int col{x}; col < std::min(x+50, width); ++col)
+                imgB[((size_t)row*width+col)*4+1] ^= 0x40;
+        }
+    }
+    const ImageView a{imgA.data(), width, height, width*4};
+    const ImageView b{imgB.data(), width, height, width*4};
+
+    // The straightforward loop an external tool would run
+    const double naiveSecs = timeBest([&](){
+        size_t diffCount{};
+        for (size_t i{}; i < imgA.size(); i += 4)
+        {
+            diffCount += std::abs(imgA[i]-imgB[i]) > 2 || std::abs(imgA[i+1]-imgB[i+1]) > 2
+                || std::abs(imgA[i+2]-imgB[i+2]) > 2;
+        }
+        assert(diffCount);
+    });
+    printResult("per-pixel loop", naiveSecs, imgA.size(), -1);
+
+    for (PixelConv::Isa isa : {PixelConv::Isa::Scalar, PixelConv::Isa::SSE2, PixelConv::Isa::AVX2})
+    {
+        if (!PixelConv::setIsa(isa))
+            continue;
+        for (int threadCount : {1, 0})
+        {
+            ImageDiff::Options opts;
+            opts.toleranceR = opts.toleranceG = opts.toleranceB = 2;
+            opts.threadCount = threadCount;
+            ImageDiff::Result result;
+            const double secs = timeBest([&](){ result = ImageDiff::compare(a, b, opts); });
+            printResult(std::string("ImageDiff ")+PixelConv::getIsaName(isa)+(threadCount ? " 1 thr" : ""),
+                    secs, imgA.size(), -1);
+        }
+    }
+
+    ImageDiff::Options opts;
+    std::vector<uint8_t> diffImage;
+    const double secs = timeBest([&](){ ImageDiff::compare(a, b, opts, &diffImage); });
+    printResult("ImageDiff with diff image", secs, imgA.size(), -1);
+}
+
+int main(int argc, char** argv)
+{
+    std::string what = "png";
+    std::string inputFilename;
+    std::string saveBaselineFilename;
+    int width = 0;
+    int height = 0;
+    for (int i{1}; i < argc; ++i)
+    {
+        if (std::sscanf(argv[i], "%dx%d", &width, &height) == 2)
+            continue;
+        if (std::string(argv[i]) == "--baseline" && i+1 < argc)
+        {
+            loadBaseline(argv[++i]);
+            continue;
+        }
+        if (std::string(argv[i]) == "--save-baseline" && i+1 < argc)
+        {
+            saveBaselineFilename = argv[++i];
+            continue;
+        }
+        if (Codec::getFormatFromFilename(argv[i], Codec::Format::PNG) == Codec::Format::Raw)
+        {
+            inputFilename = argv[i];
+            continue;
+        }
+        what = argv[i];
+    }
+
+    if (what == "png")
+    {
+        benchPng(width ? width : 3840, height ? height : 2160);
+    }
+    else if (what == "conv")
+    {
+        if (width)
+        {
+            benchConvs(width, height);
+        }
+        else
+        {
+            // 1080p, 4K, 8K
+            benchConvs(1920, 1080);
+            benchConvs(3840, 2160);
+            benchConvs(7680, 4320);
+        }
+    }
+    else if (what == "codecs")
+    {
+        if (!inputFilename.empty())
+        {
+            const std::vector<uint8_t> data = readRawFile(inputFilename, &width, &height);
+            benchCodecs(data, width, height);
+        }
+        else
+        {
+            if (!width)
+            {
+                width = 3840;
+                height = 2160;
+            }
+            benchCodecs(genTestImage(width, height), width, height);
+        }
+    }
+    else if (what == "frames")
+    {
+        if (!inputFilename.empty())
+        {
+            const std::vector<uint8_t> data = readRawFile(inputFilename, &width, &height);
+            benchFrames(data, width, height);
+        }
+        else
+        {
+            // Not multiples of the tile size, so the partial tiles at the edges are covered too
+            if (!width)
+            {
+                width = 1900;
+                height = 1060;
+            }
+            benchFrames(genTestImage(width, height), width, height);
+        }
+    }
+    else if (what == "alloc")
+    {
+        std::ifstream thpSetting{"/sys/kernel/mm/transparent_hugepage/enabled"};
+        std::string thp;
+        std::getline(thpSetting, thp);
+        std::cout << "Transparent huge pages: " << (thp.empty() ? "unknown" : thp) << '\n';
+        if (width)
+        {
+            benchFrameAlloc(width, height);
+        }
+        else
+        {
+            benchFrameAlloc(1920, 1080);
+            benchFrameAlloc(3840, 2160);
+            benchFrameAlloc(7680, 4320);
+        }
+    }
+    else if (what == "compare")
+    {
+        benchCompare(width ? width : 3840, height ? height : 2160);
+    }
+    else if (what == "screenshot")
+    {
+        benchScreenshots(width, height);
+    }
+    else
+    {
+        std::cerr << "Unknown benchmark: " << what << '\n';
+        return 1;
+    }
+
+    if (!saveBaselineFilename.empty())
+        saveBaseline(saveBaselineFilename);
+    return 0;
+}
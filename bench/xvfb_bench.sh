@@ -0,0 +1,16 @@
+#!/bin/sh
+# Runs the screenshot benchmarks on a virtual 3x4K desktop (1080p and 4K are captured from its corner).
+# Usage: xvfb_bench.sh PATH/TO/shot_bench [ARGS...]
+# e.g.   xvfb_bench.sh build/shot_bench --save-baseline before.txt
+#        xvfb_bench.sh build/shot_bench --baseline before.txt
+
+set -e
+
+if [ $# -lt 1 ]; then
+    echo "Usage: $0 PATH/TO/shot_bench [ARGS...]" >&2
+    exit 1
+fi
+
+bench="$1"
+shift
+exec xvfb-run -a -s "-screen 0 11520x2160x24" "$bench" screenshot "$@"
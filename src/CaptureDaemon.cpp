@@ -0,0 +1,365 @@
+#include "CaptureDaemon.h"
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <signal.h>
+#include <iostream>
+#include <sstream>
+#include <filesystem>
+#include <stdexcept>
+#include <cstring>
+#include <cerrno>
+#include <cassert>
+
+// How long a client has to send its request
+#define CLIENT_TIMEOUT_SECS 5
+
+static volatile sig_atomic_t s_stopRequested = 0;
+
+static void stopSignalHandler(int)
+{
+    s_stopRequested = 1;
+}
+
+static double msSince(CaptureDaemon::clock_t::time_point start)
+{
+    return std::chrono::duration<double, std::milli>(CaptureDaemon::clock_t::now()-start).count();
+}
+
+static sockaddr_un makeSockAddr(const std::string& path)
+{
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    if (path.length() >= sizeof(addr.sun_path))
+        throw std::runtime_error{"Socket path is too long: \""+path+"\""};
+    std::strcpy(addr.sun_path, path.c_str());
+    return addr;
+}
+
+static void writeAll(int fd, const std::string& str)
+{
+    size_t written{};
+    while (written < str.length())
+    {
+        const ssize_t ret = write(fd, str.c_str()+written, str.length()-written);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            return; // The client went away, nothing to do
+        written += ret;
+    }
+}
+
+// Reads until a newline or EOF, the newline is not included. Fails on errors and timeouts.
+static bool readLine(int fd, std::string* out)
+{
+    out->clear();
+    char chr;
+    while (true)
+    {
+        const ssize_t ret = read(fd, &chr, 1);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret < 0)
+            return false;
+        if (ret == 0)
+            return !out->empty();
+        if (chr == '\n')
+            return true;
+        out->push_back(chr);
+        if (out->length() > 4096)
+            return false;
+    }
+}
+
+/*
+ * Creates the directory of the socket if needed. Other users must not be able to replace
+ * the socket, so the directory must belong to us or root and must not be writable by
+ * others, unless it has the sticky bit (like /tmp).
+ */
+static void prepareSocketDir(const std::string& socketPath)
+{
+    const size_t slashPos = socketPath.rfind('/');
+    const std::string dir = slashPos == std::string::npos ? "." : slashPos == 0 ? "/" : socketPath.substr(0, slashPos);
+    if (mkdir(dir.c_str(), 0700) == -1 && errno != EEXIST)
+        throw std::runtime_error{"Failed to create socket directory \""+dir+"\": "+std::strerror(errno)};
+
+    struct stat st{};
+    if (lstat(dir.c_str(), &st) == -1)
+        throw std::runtime_error{"Failed to check socket directory \""+dir+"\": "+std::strerror(errno)};
+    if (!S_ISDIR(st.st_mode)
+     || (st.st_uid != getuid() && st.st_uid != 0)
+     || ((st.st_mode & (S_IWGRP|S_IWOTH)) && !(st.st_mode & S_ISVTX)))
+        throw std::runtime_error{"Unsafe socket directory: \""+dir+"\""};
+}
+
+/*
+ * Output paths must be absolute (the client has a different working directory),
+ * without `..` components and with the extension of an image format,
+ * so a request can't overwrite arbitrary files.
+ */
+static bool isValidOutputPath(const std::string& path)
+{
+    const std::filesystem::path fsPath{path};
+    if (!fsPath.is_absolute() || !fsPath.has_filename())
+        return false;
+    for (const std::filesystem::path& component : fsPath)
+    {
+        if (component == "..")
+            return false;
+    }
+
+    const std::string extension = fsPath.extension().string();
+    Codec::Format format;
+    return extension.length() > 1 && Codec::parseFormat(extension.substr(1), &format);
+}
+
+static PngEncoder::Options getPngOptions(const Codec::Options& codecOpts)
+{
+    PngEncoder::Options pngOpts;
+    // Levels PNG doesn't have are rejected for each PNG capture, see encoderLoop()
+    if (codecOpts.level >= 0 && codecOpts.level <= 9)
+        pngOpts.compLevel = codecOpts.level;
+    pngOpts.threadCount = codecOpts.threadCount;
+    return pngOpts;
+}
+
+CaptureDaemon::CaptureDaemon(Display* disp, const std::string& socketPath, const Codec::Options& codecOpts, int bufferCount)
+    : m_disp{disp}, m_bufferCount{bufferCount}, m_socketPath{socketPath},
+    m_codecOpts{codecOpts}, m_encoder{getPngOptions(codecOpts)}
+{
+    updatePool();
+
+    m_listenFd = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+    if (m_listenFd == -1)
+        throw std::runtime_error{std::string("Failed to create socket: ")+std::strerror(errno)};
+
+    const sockaddr_un addr = makeSockAddr(socketPath);
+    try
+    {
+        prepareSocketDir(socketPath);
+    }
+    catch (...)
+    {
+        close(m_listenFd);
+        throw;
+    }
+    unlink(socketPath.c_str()); // Remove the socket of a previous instance
+    // Only our user may connect, the socket is created with mode 0600
+    const mode_t oldUmask = umask(0177);
+    const bool isBound = bind(m_listenFd, (const sockaddr*)&addr, sizeof(addr)) == 0;
+    const int bindErrno = errno;
+    umask(oldUmask);
+    if (!isBound || listen(m_listenFd, 16) == -1)
+    {
+        const int err = isBound ? errno : bindErrno;
+        close(m_listenFd);
+        throw std::runtime_error{"Failed to listen on \""+socketPath+"\": "+std::strerror(err)};
+    }
+
+    m_encoderThread = std::thread{&CaptureDaemon::encoderLoop, this};
+}
+
+void CaptureDaemon::updatePool()
+{
+    XWindowAttributes attrs{};
+    Status rets = XGetWindowAttributes(m_disp, XDefaultRootWindow(m_disp), &attrs);
+    assert(rets);
+    (void)rets;
+    if (m_pool && attrs.width == m_poolWidth && attrs.height == m_poolHeight)
+        return;
+
+    if (m_pool)
+    {
+        std::cout << "Root window resized to " << attrs.width << 'x' << attrs.height << ", recreating buffers\n";
+        // The queued captures still use the old buffers
+        m_pool->waitForAll();
+        m_pool.reset();
+    }
+    m_pool = std::make_unique<ShmPool>(m_disp, attrs.width, attrs.height, m_bufferCount);
+    m_poolWidth = attrs.width;
+    m_poolHeight = attrs.height;
+}
+
+void CaptureDaemon::encoderLoop()
+{
+    while (true)
+    {
+        Job job;
+        {
+            std::unique_lock<std::mutex> lock{m_jobMutex};
+            m_jobCond.wait(lock, [this](){ return m_isStopping || !m_jobs.empty(); });
+            if (m_jobs.empty())
+                return; // Stopping and no more work
+            job = std::move(m_jobs.front());
+            m_jobs.pop_front();
+        }
+
+        const clock_t::time_point encodeStart = clock_t::now();
+        std::string reply;
+        try
+        {
+            const Codec::Format format = Codec::getFormatFromFilename(job.filename, Codec::Format::PNG);
+            Codec::checkLevel(format, m_codecOpts.level);
+            if (format == Codec::Format::PNG)
+                m_encoder.encodeToFile(job.sshot->getView(), job.filename);
+            else
+                job.sshot->writeToFile(job.filename, format, m_codecOpts);
+            job.sshot.reset(); // Give the buffer back to the pool as soon as possible
+            const double encodeMs = msSince(encodeStart);
+            const double totalMs = msSince(job.startTime);
+
+            std::cout << "Captured \"" << job.filename << "\": capture: " << job.captureMs
+                << " ms, encode: " << encodeMs << " ms, total: " << totalMs << " ms\n";
+            std::ostringstream ss;
+            ss << "ok " << job.captureMs << ' ' << encodeMs << ' ' << totalMs << '\n';
+            reply = ss.str();
+        }
+        catch (const std::exception& e)
+        {
+            std::cerr << "ERR: " << e.what() << '\n';
+            reply = std::string("err ")+e.what()+'\n';
+        }
+        writeAll(job.clientFd, reply);
+        close(job.clientFd);
+    }
+}
+
+bool CaptureDaemon::handleClient(int fd)
+{
+    const clock_t::time_point startTime = clock_t::now();
+
+    std::string line;
+    if (!readLine(fd, &line))
+    {
+        close(fd);
+        return true;
+    }
+
+    std::istringstream ss{line};
+    std::string command;
+    ss >> command;
+
+    if (command == "quit")
+    {
+        writeAll(fd, "ok\n");
+        close(fd);
+        return false;
+    }
+
+    int x{}, y{}, w{}, h{};
+    const bool hasRect = command == "capture-rect";
+    if (hasRect)
+        ss >> x >> y >> w >> h;
+    std::string filename;
+    std::getline(ss >> std::ws, filename);
+
+    if ((command != "capture" && !hasRect) || filename.empty())
+    {
+        writeAll(fd, "err invalid request\n");
+        close(fd);
+        return true;
+    }
+    if (!isValidOutputPath(filename))
+    {
+        writeAll(fd, "err output path must be absolute and end with an image extension\n");
+        close(fd);
+        return true;
+    }
+
+    // Blocks while all the buffers are being encoded
+    std::unique_ptr<Screenshot> sshot;
+    try
+    {
+        updatePool();
+        if (hasRect)
+            sshot = std::make_unique<Screenshot>(m_disp, m_pool.get(), WinGeometry{x, y, w, h});
+        else
+            sshot = std::make_unique<Screenshot>(m_disp, m_pool.get());
+    }
+    catch (const std::exception& e)
+    {
+        writeAll(fd, std::string("err ")+e.what()+'\n');
+        close(fd);
+        return true;
+    }
+    const double captureMs = msSince(startTime);
+
+    {
+        std::lock_guard<std::mutex> lock{m_jobMutex};
+        m_jobs.push_back({std::move(sshot), filename, fd, startTime, captureMs});
+    }
+    m_jobCond.notify_one();
+    return true;
+}
+
+void CaptureDaemon::run()
+{
+    // No SA_RESTART, so `accept()` returns when a signal arrives
+    struct sigaction action{};
+    action.sa_handler = stopSignalHandler;
+    sigaction(SIGINT, &action, nullptr);
+    sigaction(SIGTERM, &action, nullptr);
+    signal(SIGPIPE, SIG_IGN);
+
+    std::cout << "Listening on \"" << m_socketPath << "\"\n";
+    while (!s_stopRequested)
+    {
+        const int clientFd = accept4(m_listenFd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (clientFd == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            std::cerr << "ERR: accept() failed: " << std::strerror(errno) << '\n';
+            break;
+        }
+        // Clients are served one at a time, one that sends nothing must not block the others
+        const timeval timeout{CLIENT_TIMEOUT_SECS, 0};
+        setsockopt(clientFd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        if (!handleClient(clientFd))
+            break;
+    }
+    std::cout << "Stopping daemon\n";
+}
+
+CaptureDaemon::~CaptureDaemon()
+{
+    {
+        std::lock_guard<std::mutex> lock{m_jobMutex};
+        m_isStopping = true;
+    }
+    m_jobCond.notify_one();
+    m_encoderThread.join();
+
+    close(m_listenFd);
+    unlink(m_socketPath.c_str());
+}
+
+std::string CaptureDaemon::getDefaultSocketPath()
+{
+    if (const char* runtimeDir = getenv("XDG_RUNTIME_DIR"))
+        return std::string(runtimeDir)+"/shot.sock";
+    // A directory only we can access, see `prepareSocketDir()`
+    return "/tmp/shot-"+std::to_string(getuid())+"/shot.sock";
+}
+
+std::string CaptureDaemon::sendRequest(const std::string& socketPath, const std::string& request)
+{
+    const int fd = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+    if (fd == -1)
+        throw std::runtime_error{std::string("Failed to create socket: ")+std::strerror(errno)};
+
+    const sockaddr_un addr = makeSockAddr(socketPath);
+    if (connect(fd, (const sockaddr*)&addr, sizeof(addr)) == -1)
+    {
+        close(fd);
+        throw std::runtime_error{"Failed to connect to daemon at \""+socketPath+"\": "+std::strerror(errno)};
+    }
+
+    writeAll(fd, request+'\n');
+    std::string reply;
+    readLine(fd, &reply);
+    close(fd);
+    return reply;
+}
@@ -0,0 +1,85 @@
+#pragma once
+
+#include "Screenshot.h"
+#include "ShmImage.h"
+#include "PngEncoder.h"
+#include "Codec.h"
+#include <X11/Xlib.h>
+#include <string>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+
+/*
+ * Long-running capture server.
+ *
+ * Keeps the display connection, a ring of attached shared memory buffers
+ * and the PNG encoder alive between captures. Clients connect to a UNIX socket
+ * and send one request per connection:
+ *
+ *     capture FILE\n
+ *     capture-rect X Y W H FILE\n
+ *     quit\n
+ *
+ * FILE must be an absolute path with the extension of a known format, which selects the format.
+ * The socket is only accessible by the user running the daemon.
+ * The reply is `ok CAPTURE_MS ENCODE_MS TOTAL_MS\n` or `err MESSAGE\n`.
+ */
+class CaptureDaemon
+{
+public:
+    using clock_t = std::chrono::steady_clock;
+
+private:
+    struct Job
+    {
+        std::unique_ptr<Screenshot> sshot;
+        std::string filename;
+        int clientFd{-1};
+        clock_t::time_point startTime;
+        double captureMs{};
+    };
+
+    Display* m_disp{};
+    std::unique_ptr<ShmPool> m_pool;
+    int m_bufferCount{};
+    // Size of the root window the pool was created for
+    int m_poolWidth{};
+    int m_poolHeight{};
+    std::string m_socketPath;
+    int m_listenFd{-1};
+    Codec::Options m_codecOpts;
+
+    // Captures are encoded on a separate thread, so the next capture
+    // can go into another buffer of the pool while one is being encoded
+    PngEncoder m_encoder;
+    std::thread m_encoderThread;
+    std::deque<Job> m_jobs;
+    std::mutex m_jobMutex;
+    std::condition_variable m_jobCond;
+    bool m_isStopping{};
+
+    // Recreates the pool if the root window was resized (e.g. with RandR)
+    void updatePool();
+    void encoderLoop();
+    // Returns false if the daemon should stop
+    bool handleClient(int fd);
+
+public:
+    // `codecOpts` is used for every capture, whatever its format
+    CaptureDaemon(Display* disp, const std::string& socketPath, const Codec::Options& codecOpts={}, int bufferCount=3);
+    CaptureDaemon(const CaptureDaemon&) = delete;
+    CaptureDaemon& operator=(const CaptureDaemon&) = delete;
+
+    // Serves requests until SIGINT/SIGTERM or a `quit` request
+    void run();
+
+    ~CaptureDaemon();
+
+    static std::string getDefaultSocketPath();
+    // Sends `request` to a running daemon and returns the reply line
+    static std::string sendRequest(const std::string& socketPath, const std::string& request);
+};
@@ -0,0 +1,392 @@
+#include "Clipboard.h"
+#include "Codec.h"
+#include "Output.h"
+#include <X11/Xatom.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <iostream>
+#include <string>
+#include <stdexcept>
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
+#include <cerrno>
+#include <cassert>
+
+// The instance running in the holder process, used by the X error handler
+static ClipboardOwner* s_owner = nullptr;
+
+static int clipboardXErrHandler(Display* disp, XErrorEvent* event)
+{
+    // The requestor window can be destroyed during a transfer, that must not kill the holder
+    if (event->error_code == BadWindow && s_owner)
+        s_owner->onWindowGone(event->resourceid);
+
+    char buff[1024]{};
+    XGetErrorText(disp, event->error_code, buff, sizeof(buff));
+    std::cerr << "Clipboard: X Error: " << buff << '\n';
+    return 0;
+}
+
+// Closes every fd above stderr except the given ones, e.g. the parent's X connection
+static void closeInheritedFds(const std::vector<int>& keep)
+{
+    DIR* dir = opendir("/proc/self/fd");
+    if (!dir)
+        return;
+
+    // Closing while reading the directory would change it, collect the fds first
+    std::vector<int> fds;
+    while (const dirent* entry = readdir(dir))
+    {
+        const int fd = std::atoi(entry->d_name);
+        if (fd > STDERR_FILENO && fd != dirfd(dir) && std::find(keep.begin(), keep.end(), fd) == keep.end())
+            fds.push_back(fd);
+    }
+    closedir(dir);
+
+    for (int fd : fds)
+        close(fd);
+}
+
+// --- PendingClipboardPng ---
+
+void PendingClipboardPng::provide(const std::vector<uint8_t>& png)
+{
+    assert(m_dataFd != -1);
+
+    OutputFile{m_dataFd, "clipboard PNG"}.write(png.data(), png.size());
+    // The holder may be gone already, that must not raise SIGPIPE
+    const char ready = 1;
+    if (send(m_readyFd, &ready, 1, MSG_NOSIGNAL) != 1 && errno != EPIPE)
+        throw std::runtime_error{std::string("Failed to pass PNG to clipboard process: ")+std::strerror(errno)};
+    close();
+}
+
+void PendingClipboardPng::close()
+{
+    if (m_dataFd != -1)
+        ::close(m_dataFd);
+    if (m_readyFd != -1)
+        ::close(m_readyFd);
+    m_dataFd = -1;
+    m_readyFd = -1;
+}
+
+PendingClipboardPng::~PendingClipboardPng()
+{
+    close();
+}
+
+// --- ClipboardOwner ---
+
+ClipboardOwner::ClipboardOwner(const ImageView& img)
+    : m_img{img}
+{
+    m_disp = XOpenDisplay(nullptr);
+    if (!m_disp)
+        throw std::runtime_error{"Failed to open display"};
+
+    m_win = XCreateSimpleWindow(m_disp, XDefaultRootWindow(m_disp), 0, 0, 1, 1, 0, 0, 0);
+    XSelectInput(m_disp, m_win, PropertyChangeMask);
+
+    m_atoms.clipboard = XInternAtom(m_disp, "CLIPBOARD", False);
+    m_atoms.targets = XInternAtom(m_disp, "TARGETS", False);
+    m_atoms.timestamp = XInternAtom(m_disp, "TIMESTAMP", False);
+    m_atoms.incr = XInternAtom(m_disp, "INCR", False);
+    m_atoms.png = XInternAtom(m_disp, "image/png", False);
+    m_atoms.bmp = XInternAtom(m_disp, "image/bmp", False);
+    m_atoms.ppm = XInternAtom(m_disp, "image/x-portable-pixmap", False);
+
+    // Leave some room for the request header
+    long maxRequestSize = XExtendedMaxRequestSize(m_disp);
+    if (maxRequestSize == 0)
+        maxRequestSize = XMaxRequestSize(m_disp);
+    m_maxChunkSize = std::min<size_t>(maxRequestSize*4-256, 256*1024);
+}
+
+Time ClipboardOwner::getServerTime()
+{
+    // Get a timestamp from the server by making a zero-length property change
+    XChangeProperty(m_disp, m_win, m_atoms.timestamp, XA_INTEGER, 32, PropModeAppend, nullptr, 0);
+    XEvent event;
+    XWindowEvent(m_disp, m_win, PropertyChangeMask, &event);
+    return event.xproperty.time;
+}
+
+bool ClipboardOwner::takeOwnership()
+{
+    m_ownershipTime = getServerTime();
+    XSetSelectionOwner(m_disp, m_atoms.clipboard, m_win, m_ownershipTime);
+    return XGetSelectionOwner(m_disp, m_atoms.clipboard) == m_win;
+}
+
+EncodedBuffer ClipboardOwner::readPendingPng()
+{
+    if (m_pendingPngFd == -1)
+        return nullptr;
+
+    // Blocks until the parent has encoded the image, the socket is closed without the byte if it did not
+    char ready{};
+    ssize_t ret;
+    do
+        ret = read(m_pngReadyFd, &ready, 1);
+    while (ret == -1 && errno == EINTR);
+
+    EncodedBuffer png;
+    struct stat st{};
+    if (ret == 1 && fstat(m_pendingPngFd, &st) == 0)
+    {
+        auto data = std::make_shared<std::vector<uint8_t>>(st.st_size);
+        if (pread(m_pendingPngFd, data->data(), data->size(), 0) == (ssize_t)data->size())
+            png = data;
+    }
+
+    close(m_pendingPngFd);
+    close(m_pngReadyFd);
+    m_pendingPngFd = -1;
+    m_pngReadyFd = -1;
+    return png;
+}
+
+const std::vector<uint8_t>& ClipboardOwner::getEncoded(Atom target)
+{
+    auto it = m_cache.find(target);
+    if (it != m_cache.end())
+        return *it->second;
+
+    EncodedBuffer& buffer = m_cache[target];
+    if (target == m_atoms.png)
+    {
+        buffer = readPendingPng();
+        if (!buffer)
+            buffer = Codec::encode(m_img, Codec::Format::PNG);
+    }
+    else if (target == m_atoms.bmp)
+    {
+        buffer = Codec::encode(m_img, Codec::Format::BMP);
+    }
+    else
+    {
+        assert(target == m_atoms.ppm);
+        buffer = Codec::encode(m_img, Codec::Format::PPM);
+    }
+    return *buffer;
+}
+
+void ClipboardOwner::handleRequest(const XSelectionRequestEvent& req)
+{
+    XSelectionEvent notify{};
+    notify.type = SelectionNotify;
+    notify.requestor = req.requestor;
+    notify.selection = req.selection;
+    notify.target = req.target;
+    notify.time = req.time;
+    // Obsolete clients don't set the property
+    notify.property = req.property == None ? req.target : req.property;
+
+    if (req.selection != m_atoms.clipboard
+     || (req.time != CurrentTime && req.time < m_ownershipTime))
+    {
+        notify.property = None; // Refuse
+    }
+    else if (req.target == m_atoms.targets)
+    {
+        const Atom targets[] = {m_atoms.targets, m_atoms.timestamp, m_atoms.png, m_atoms.bmp, m_atoms.ppm};
+        XChangeProperty(m_disp, req.requestor, notify.property, XA_ATOM, 32, PropModeReplace,
+                (const unsigned char*)targets, sizeof(targets)/sizeof(targets[0]));
+    }
+    else if (req.target == m_atoms.timestamp)
+    {
+        const long time = m_ownershipTime; // Format 32 data is passed as longs
+        XChangeProperty(m_disp, req.requestor, notify.property, XA_INTEGER, 32, PropModeReplace,
+                (const unsigned char*)&time, 1);
+    }
+    else if (req.target == m_atoms.png || req.target == m_atoms.bmp || req.target == m_atoms.ppm)
+    {
+        const std::vector<uint8_t>& data = getEncoded(req.target);
+        if (data.size() > m_maxChunkSize)
+        {
+            // Too large for one request, send the data in chunks when the requestor deletes the property
+            XSelectInput(m_disp, req.requestor, PropertyChangeMask);
+            const long size = data.size();
+            XChangeProperty(m_disp, req.requestor, notify.property, m_atoms.incr, 32, PropModeReplace,
+                    (const unsigned char*)&size, 1);
+            m_transfers.push_back({req.requestor, notify.property, req.target, 0});
+        }
+        else
+        {
+            XChangeProperty(m_disp, req.requestor, notify.property, req.target, 8, PropModeReplace,
+                    data.data(), data.size());
+        }
+    }
+    else
+    {
+        notify.property = None; // Unsupported target
+    }
+
+    XSendEvent(m_disp, req.requestor, False, NoEventMask, (XEvent*)&notify);
+    XFlush(m_disp);
+}
+
+void ClipboardOwner::continueTransfer(Window requestor, Atom property)
+{
+    auto it = std::find_if(m_transfers.begin(), m_transfers.end(), [&](const Transfer& transfer){
+        return transfer.requestor == requestor && transfer.property == property;
+    });
+    if (it == m_transfers.end())
+        return;
+
+    const std::vector<uint8_t>& data = *m_cache[it->target];
+    const size_t chunkSize = std::min(m_maxChunkSize, data.size()-it->offset);
+    XChangeProperty(m_disp, requestor, property, it->target, 8, PropModeReplace,
+            data.data()+it->offset, chunkSize);
+    it->offset += chunkSize;
+
+    // A zero-length chunk ends the transfer
+    if (chunkSize == 0)
+    {
+        XSelectInput(m_disp, requestor, NoEventMask);
+        m_transfers.erase(it);
+    }
+    XFlush(m_disp);
+}
+
+void ClipboardOwner::onWindowGone(Window win)
+{
+    // Called from the error handler, which can run in the middle of an Xlib call,
+    // so the transfers are dropped later in `run()`
+    m_goneWindows.push_back(win);
+}
+
+void ClipboardOwner::run()
+{
+    while (!m_hasLostOwnership || !m_transfers.empty())
+    {
+        XEvent event;
+        XNextEvent(m_disp, &event);
+        switch (event.type)
+        {
+        case SelectionRequest:
+            handleRequest(event.xselectionrequest);
+            break;
+
+        case SelectionClear:
+            // Someone else copied something, finish the running transfers and quit
+            m_hasLostOwnership = true;
+            break;
+
+        case PropertyNotify:
+            if (event.xproperty.state == PropertyDelete)
+                continueTransfer(event.xproperty.window, event.xproperty.atom);
+            break;
+        }
+
+        for (Window win : m_goneWindows)
+        {
+            m_transfers.erase(std::remove_if(m_transfers.begin(), m_transfers.end(), [win](const Transfer& transfer){
+                return transfer.requestor == win;
+            }), m_transfers.end());
+        }
+        m_goneWindows.clear();
+    }
+}
+
+ClipboardOwner::~ClipboardOwner()
+{
+    if (m_pendingPngFd != -1)
+        close(m_pendingPngFd);
+    if (m_pngReadyFd != -1)
+        close(m_pngReadyFd);
+    XDestroyWindow(m_disp, m_win);
+    XCloseDisplay(m_disp);
+}
+
+void ClipboardOwner::serveInBackground(const ImageView& img, PendingClipboardPng* pendingPng)
+{
+    int dataFd = -1;
+    int readyFds[2]{-1, -1};
+    if (pendingPng)
+    {
+        assert(pendingPng->m_dataFd == -1);
+        dataFd = memfd_create("shot-clipboard-png", MFD_CLOEXEC);
+        if (dataFd == -1 || socketpair(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0, readyFds) == -1)
+        {
+            const int err = errno;
+            if (dataFd != -1)
+                close(dataFd);
+            throw std::runtime_error{std::string("Failed to create clipboard PNG buffer: ")+std::strerror(err)};
+        }
+    }
+
+    const pid_t pid = fork();
+    if (pid == -1)
+    {
+        const int err = errno;
+        if (pendingPng)
+        {
+            close(dataFd);
+            close(readyFds[0]);
+            close(readyFds[1]);
+        }
+        throw std::runtime_error{std::string("Failed to start clipboard process: ")+std::strerror(err)};
+    }
+    if (pid != 0)
+    {
+        // Parent
+        if (pendingPng)
+        {
+            close(readyFds[0]);
+            pendingPng->m_dataFd = dataFd;
+            pendingPng->m_readyFd = readyFds[1];
+        }
+        return;
+    }
+
+    // --- Child ---
+
+    // Only the parent writes, its end must be closed here to see it closed when it exits.
+    // The parent's X connection must go too: while it is open, the server keeps that client
+    // and its resources (e.g. the attached XShm segment) alive after the parent exits.
+    closeInheritedFds(pendingPng ? std::vector<int>{dataFd, readyFds[0]} : std::vector<int>{});
+
+    // Don't keep the terminal or a pipe reading our output open
+    setsid();
+    const int devNull = open("/dev/null", O_RDWR);
+    if (devNull != -1)
+    {
+        dup2(devNull, STDIN_FILENO);
+        dup2(devNull, STDOUT_FILENO);
+        dup2(devNull, STDERR_FILENO);
+        close(devNull);
+    }
+
+    int ret = 0;
+    try
+    {
+        XSetErrorHandler(clipboardXErrHandler);
+        ClipboardOwner owner{img};
+        if (pendingPng)
+        {
+            owner.m_pendingPngFd = dataFd;
+            owner.m_pngReadyFd = readyFds[0];
+        }
+        s_owner = &owner;
+        if (owner.takeOwnership())
+            owner.run();
+        else
+            ret = 1;
+        s_owner = nullptr;
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << "Clipboard: " << e.what() << '\n';
+        ret = 1;
+    }
+    // Don't run the parent's cleanup (e.g. detaching its shared memory from its X connection)
+    _exit(ret);
+}
@@ -0,0 +1,116 @@
+#pragma once
+
+#include "ImageView.h"
+#include "Output.h"
+#include <X11/Xlib.h>
+#include <cstdint>
+#include <vector>
+#include <map>
+
+/*
+ * The parent's side of a PNG passed to the clipboard holder process after it is forked,
+ * so the image that is encoded for the file is not encoded again for the clipboard.
+ *
+ * The data goes into a memfd, then a byte on a socket tells the holder that it is complete.
+ * The holder waits for it when a client first asks for a PNG, and encodes the image itself
+ * if the socket is closed without it.
+ */
+class PendingClipboardPng
+{
+private:
+    int m_dataFd{-1};
+    int m_readyFd{-1};
+
+    friend class ClipboardOwner;
+
+public:
+    PendingClipboardPng() = default;
+    PendingClipboardPng(const PendingClipboardPng&) = delete;
+    PendingClipboardPng& operator=(const PendingClipboardPng&) = delete;
+
+    // Passes `png` to the holder, throws on errors
+    void provide(const std::vector<uint8_t>& png);
+    // The holder encodes the PNG itself if it is needed
+    void close();
+
+    ~PendingClipboardPng();
+};
+
+/*
+ * Owns the CLIPBOARD selection and serves an image to other clients.
+ *
+ * The image is offered as PNG, BMP and PPM. Each format is encoded only when a
+ * client first asks for it (unless the PNG is passed in by the parent process), then it
+ * is cached. Data that does not fit into one request is sent with the INCR protocol.
+ */
+class ClipboardOwner
+{
+private:
+    // Uses its own connection, so it can keep running after the rest of the program exits
+    Display* m_disp{};
+    Window m_win{};
+    Time m_ownershipTime{};
+    ImageView m_img;
+    size_t m_maxChunkSize{};
+    bool m_hasLostOwnership{};
+
+    struct Atoms
+    {
+        Atom clipboard;
+        Atom targets;
+        Atom timestamp;
+        Atom incr;
+        Atom png;
+        Atom bmp;
+        Atom ppm;
+    } m_atoms{};
+
+    // An INCR transfer in progress
+    struct Transfer
+    {
+        Window requestor{};
+        Atom property{};
+        Atom target{};
+        size_t offset{};
+    };
+    std::vector<Transfer> m_transfers;
+    // Requestor windows that were destroyed, see `onWindowGone()`
+    std::vector<Window> m_goneWindows;
+
+    // Encoded data by target
+    std::map<Atom, EncodedBuffer> m_cache;
+
+    // The fds of a `PendingClipboardPng` in the holder process
+    int m_pendingPngFd{-1};
+    int m_pngReadyFd{-1};
+
+    Time getServerTime();
+    EncodedBuffer readPendingPng();
+    const std::vector<uint8_t>& getEncoded(Atom target);
+    void handleRequest(const XSelectionRequestEvent& req);
+    void continueTransfer(Window requestor, Atom property);
+
+public:
+    ClipboardOwner(const ImageView& img);
+    ClipboardOwner(const ClipboardOwner&) = delete;
+    ClipboardOwner& operator=(const ClipboardOwner&) = delete;
+
+    // Returns false if another client got the ownership
+    bool takeOwnership();
+    // Serves requests until another client takes the ownership and all transfers are finished
+    void run();
+
+    // Drops the transfers to a destroyed window
+    void onWindowGone(Window win);
+
+    ~ClipboardOwner();
+
+    /*
+     * Forks a process which takes the clipboard ownership and serves `img`
+     * until another client takes it over. Returns in the parent.
+     * If `pendingPng` is given, the PNG encoded later by the parent can be passed through it.
+     * Must be called when no other threads are running, e.g. before the first notification
+     * (libnotify starts GLib threads). The holder only uses Xlib and the encoders, never GLib.
+     */
+    static void serveInBackground(const ImageView& img, PendingClipboardPng* pendingPng=nullptr);
+};
@@ -0,0 +1,324 @@
+#include "Codec.h"
+#include "PngEncoder.h"
+#include "QoiEncoder.h"
+#include "ZstdEncoder.h"
+#include "PixelConv.h"
+#include "ImageConv.h"
+#include <vector>
+#include <memory>
+#include <thread>
+#include <stdexcept>
+#include <algorithm>
+#include <cstring>
+#include <cctype>
+#include <cassert>
+
+namespace Codec
+{
+
+// Size of the pieces the streaming encoders write at once
+#define STREAM_CHUNK_SIZE (1024*1024)
+// Raw RGB bytes per stripe when streaming PNG
+#define PNG_STREAM_STRIPE_SIZE (1024*1024)
+
+// --- Encoders ---
+
+static EncodedBuffer encodeAsPng(const ImageView& img, const Options& opts)
+{
+    PngEncoder encoder{{opts.level < 0 ? 6 : opts.level, PngEncoder::Filter::Adaptive, opts.threadCount}};
+    return encoder.encodeToBuffer(img);
+}
+
+static EncodedBuffer encodeAsQoi(const ImageView& img, const Options&)
+{
+    return encodeQoi(img);
+}
+
+static EncodedBuffer encodeAsZstd(const ImageView& img, const Options& opts)
+{
+    const int threadCount = opts.threadCount ? opts.threadCount : std::thread::hardware_concurrency();
+    // With one thread it is faster to compress on the calling thread than on one worker
+    ZstdEncoder encoder{{opts.level < 0 ? 3 : opts.level, threadCount > 1 ? threadCount : 0}};
+    return encoder.encodeToBuffer(img);
+}
+
+// `header`, then the pixels converted to `format`
+static EncodedBuffer encodeConverted(const ImageView& img, const std::string& header,
+        ImageConv::Format format, const Options& opts)
+{
+    const size_t rowLen = (size_t)img.width*ImageConv::getBytesPerPixel(format);
+    auto out = std::make_shared<std::vector<uint8_t>>(header.size()+rowLen*img.height);
+    std::memcpy(out->data(), header.data(), header.size());
+    ImageConv::convert(img, out->data()+header.size(), rowLen, format, opts.threadCount);
+    return out;
+}
+
+static EncodedBuffer encodeAsPpm(const ImageView& img, const Options& opts)
+{
+    return encodeConverted(img, getPpmHeader(img.width, img.height), ImageConv::Format::RGB, opts);
+}
+
+static EncodedBuffer encodeAsPam(const ImageView& img, const Options& opts)
+{
+    return encodeConverted(img, getPamHeader(img.width, img.height), ImageConv::Format::RGBA, opts);
+}
+
+static EncodedBuffer encodeAsRaw(const ImageView& img, const Options& opts)
+{
+    uint8_t header[RAW_HEADER_SIZE]{};
+    fillRawHeader(img.width, img.height, header);
+    return encodeConverted(img, std::string((const char*)header, sizeof(header)), ImageConv::Format::BGRX, opts);
+}
+
+static void putU16LE(std::vector<uint8_t>* out, uint16_t val)
+{
+    out->push_back(val);
+    out->push_back(val >> 8);
+}
+
+static void putU32LE(std::vector<uint8_t>* out, uint32_t val)
+{
+    for (int i{}; i < 4; ++i)
+        out->push_back(val >> (i*8));
+}
+
+// 32-bit BI_RGB bitmap, which has the same byte order as the screenshot
+static void putBmpHeader(const ImageView& img, std::vector<uint8_t>* out)
+{
+    const uint32_t rowLen = img.width*4;
+    const uint32_t dataOffs = 14+40;
+
+    // BITMAPFILEHEADER
+    out->push_back('B');
+    out->push_back('M');
+    putU32LE(out, dataOffs+rowLen*img.height); // File size
+    putU32LE(out, 0); // Reserved
+    putU32LE(out, dataOffs);
+
+    // BITMAPINFOHEADER
+    putU32LE(out, 40); // Header size
+    putU32LE(out, img.width);
+    putU32LE(out, img.height); // Positive: rows are stored bottom-up
+    putU16LE(out, 1); // Planes
+    putU16LE(out, 32); // Bits per pixel
+    putU32LE(out, 0); // BI_RGB
+    putU32LE(out, rowLen*img.height);
+    putU32LE(out, 2835); // 72 DPI
+    putU32LE(out, 2835);
+    putU32LE(out, 0); // Palette size
+    putU32LE(out, 0); // Important colors
+}
+
+static EncodedBuffer encodeAsBmp(const ImageView& img, const Options&)
+{
+    auto out = std::make_shared<std::vector<uint8_t>>();
+    const size_t rowLen = (size_t)img.width*4;
+    out->reserve(14+40+rowLen*img.height);
+    putBmpHeader(img, out.get());
+
+    // Bottom-up, with the alpha set like `streamAsBmp()` does
+    const size_t headerSize = out->size();
+    out->resize(headerSize+rowLen*img.height);
+    for (int y{}; y < img.height; ++y)
+        PixelConv::bgrxToBgra(img.getRow(img.height-1-y), out->data()+headerSize+y*rowLen, img.width);
+    return out;
+}
+
+// --- Streaming encoders ---
+
+static void streamAsPng(const ImageView& img, const Options& opts, const writeFun_t& write)
+{
+    // Small stripes, only `threadCount` of them are in memory at a time
+    const int stripeHeight = std::max(1, (int)(PNG_STREAM_STRIPE_SIZE/((size_t)img.width*3)));
+    PngEncoder encoder{{opts.level < 0 ? 6 : opts.level, PngEncoder::Filter::Adaptive, opts.threadCount, stripeHeight}};
+    encoder.encode(img, write);
+}
+
+static void streamAsQoi(const ImageView& img, const Options&, const writeFun_t& write)
+{
+    encodeQoi(img, write);
+}
+
+static void streamAsZstd(const ImageView& img, const Options& opts, const writeFun_t& write)
+{
+    const int threadCount = opts.threadCount ? opts.threadCount : std::thread::hardware_concurrency();
+    ZstdEncoder encoder{{opts.level < 0 ? 3 : opts.level, threadCount > 1 ? threadCount : 0}};
+    encoder.encode(img, write);
+}
+
+/*
+ * Writes `header`, then the rows converted by `convertRow` to `bpp` bytes per pixel,
+ * many rows at a time. BMP stores the rows bottom-up.
+ */
+static void streamConverted(const ImageView& img, const uint8_t* header, size_t headerSize,
+        int bpp, void (*convertRow)(const uint8_t*, uint8_t*, int), bool isBottomUp, const writeFun_t& write)
+{
+    write(header, headerSize);
+
+    const size_t rowLen = (size_t)img.width*bpp;
+    const int rowsPerChunk = std::max<int>(1, STREAM_CHUNK_SIZE/rowLen);
+    std::vector<uint8_t> chunk(rowsPerChunk*rowLen);
+    for (int y{}; y < img.height; y += rowsPerChunk)
+    {
+        const int rowCount = std::min(rowsPerChunk, img.height-y);
+        for (int i{}; i < rowCount; ++i)
+        {
+            const int srcY = isBottomUp ? img.height-1-(y+i) : y+i;
+            convertRow(img.getRow(srcY), chunk.data()+i*rowLen, img.width);
+        }
+        write(chunk.data(), rowCount*rowLen);
+    }
+}
+
+static void streamAsPpm(const ImageView& img, const Options&, const writeFun_t& write)
+{
+    const std::string header = getPpmHeader(img.width, img.height);
+    streamConverted(img, (const uint8_t*)header.data(), header.size(), 3, PixelConv::bgrxToRgb, false, write);
+}
+
+static void streamAsPam(const ImageView& img, const Options&, const writeFun_t& write)
+{
+    const std::string header = getPamHeader(img.width, img.height);
+    streamConverted(img, (const uint8_t*)header.data(), header.size(), 4, PixelConv::bgrxToRgba, false, write);
+}
+
+static void streamAsRaw(const ImageView& img, const Options&, const writeFun_t& write)
+{
+    uint8_t header[RAW_HEADER_SIZE]{};
+    fillRawHeader(img.width, img.height, header);
+    streamConverted(img, header, sizeof(header), 4, PixelConv::bgrxToBgra, false, write);
+}
+
+static void streamAsBmp(const ImageView& img, const Options&, const writeFun_t& write)
+{
+    std::vector<uint8_t> header;
+    putBmpHeader(img, &header);
+    streamConverted(img, header.data(), header.size(), 4, PixelConv::bgrxToBgra, true, write);
+}
+
+// --- Format table ---
+
+struct FormatInfo
+{
+    Format format;
+    const char* name;
+    const char* extension;
+    EncodedBuffer (*encode)(const ImageView&, const Options&);
+    void (*encodeToStream)(const ImageView&, const Options&, const writeFun_t&);
+    // Range of `Options::level`, -1 if the format has no levels
+    int minLevel;
+    int maxLevel;
+};
+
+static const FormatInfo formats[] = {
+    {Format::PNG,  "png",  "png",  encodeAsPng,  streamAsPng,   0,  9},
+    {Format::QOI,  "qoi",  "qoi",  encodeAsQoi,  streamAsQoi,  -1, -1},
+    {Format::Zstd, "zstd", "zst",  encodeAsZstd, streamAsZstd,  1, 19},
+    {Format::PPM,  "ppm",  "ppm",  encodeAsPpm,  streamAsPpm,  -1, -1},
+    {Format::PAM,  "pam",  "pam",  encodeAsPam,  streamAsPam,  -1, -1},
+    {Format::Raw,  "raw",  "bgrx", encodeAsRaw,  streamAsRaw,  -1, -1},
+    {Format::BMP,  "bmp",  "bmp",  encodeAsBmp,  streamAsBmp,  -1, -1},
+};
+
+static const FormatInfo& getInfo(Format format)
+{
+    for (const FormatInfo& info : formats)
+    {
+        if (info.format == format)
+            return info;
+    }
+    assert(false);
+    return formats[0];
+}
+
+static std::string toLower(std::string str)
+{
+    std::transform(str.begin(), str.end(), str.begin(), [](unsigned char c){ return std::tolower(c); });
+    return str;
+}
+
+// --- Public functions ---
+
+std::string getPpmHeader(int width, int height)
+{
+    // Magic bytes, size, max component value
+    return "P6\n"+std::to_string(width)+"\n"+std::to_string(height)+"\n255\n";
+}
+
+std::string getPamHeader(int width, int height)
+{
+    return "P7\n"
+        "WIDTH "+std::to_string(width)+"\n"
+        "HEIGHT "+std::to_string(height)+"\n"
+        "DEPTH 4\n"
+        "MAXVAL 255\n"
+        "TUPLTYPE RGB_ALPHA\n"
+        "ENDHDR\n";
+}
+
+const char* getFormatName(Format format)
+{
+    return getInfo(format).name;
+}
+
+const char* getFormatExtension(Format format)
+{
+    return getInfo(format).extension;
+}
+
+bool parseFormat(const std::string& str, Format* format)
+{
+    const std::string lower = toLower(str);
+    for (const FormatInfo& info : formats)
+    {
+        if (lower == info.name || lower == info.extension)
+        {
+            *format = info.format;
+            return true;
+        }
+    }
+    return false;
+}
+
+Format getFormatFromFilename(const std::string& filename, Format fallback)
+{
+    const size_t dotPos = filename.rfind('.');
+    if (dotPos == std::string::npos || filename.find('/', dotPos) != std::string::npos)
+        return fallback;
+
+    Format format;
+    return parseFormat(filename.substr(dotPos+1), &format) ? format : fallback;
+}
+
+bool isFormatAvailable(Format format)
+{
+    return format != Format::Zstd || ZstdEncoder::isAvailable();
+}
+
+void checkLevel(Format format, int level)
+{
+    const FormatInfo& info = getInfo(format);
+    if (level >= 0 && info.maxLevel != -1 && (level < info.minLevel || level > info.maxLevel))
+    {
+        throw std::runtime_error{"Invalid "+std::string(info.name)+" compression level: "+std::to_string(level)
+            +", expected "+std::to_string(info.minLevel)+"-"+std::to_string(info.maxLevel)};
+    }
+}
+
+EncodedBuffer encode(const ImageView& img, Format format, const Options& opts)
+{
+    if (!isFormatAvailable(format))
+        throw std::runtime_error{std::string("Format not available in this build: ")+getFormatName(format)};
+    checkLevel(format, opts.level);
+    return getInfo(format).encode(img, opts);
+}
+
+void encodeToStream(const ImageView& img, Format format, const writeFun_t& write, const Options& opts)
+{
+    if (!isFormatAvailable(format))
+        throw std::runtime_error{std::string("Format not available in this build: ")+getFormatName(format)};
+    checkLevel(format, opts.level);
+    getInfo(format).encodeToStream(img, opts, write);
+}
+
+} // namespace Codec
@@ -0,0 +1,59 @@
+#pragma once
+
+#include "ImageView.h"
+#include "Output.h"
+#include <string>
+
+/*
+ * Output formats and their encoders.
+ *
+ * Adding a format means adding it to `Format` and to the table in Codec.cpp.
+ */
+namespace Codec
+{
+
+enum class Format
+{
+    PNG,
+    QOI,
+    Zstd, // Raw frame compressed with zstd, see ZstdEncoder
+    PPM,
+    PAM,
+    Raw,
+    BMP,
+};
+
+struct Options
+{
+    // Compression level, negative means the default of the format.
+    // Ignored by the formats that have no levels.
+    int level{-1};
+    // Number of threads, 0 means one per CPU core
+    int threadCount{};
+};
+
+const char* getFormatName(Format format);
+// Without the dot
+const char* getFormatExtension(Format format);
+// Accepts a format name or an extension, returns false if not known
+bool parseFormat(const std::string& str, Format* format);
+// Returns `fallback` if the file has no known extension
+Format getFormatFromFilename(const std::string& filename, Format fallback);
+// False if the encoder was not compiled in
+bool isFormatAvailable(Format format);
+// Throws if `level` is out of the range of the format, e.g. 0-9 for PNG
+void checkLevel(Format format, int level);
+
+std::string getPpmHeader(int width, int height);
+std::string getPamHeader(int width, int height);
+
+// Throws if the format is not available
+EncodedBuffer encode(const ImageView& img, Format format, const Options& opts={});
+/*
+ * Encodes while writing: `write` is called with consecutive pieces of the file as soon as they
+ * are ready, and the memory used does not grow with the size of the image.
+ * PNG is encoded in small stripes, so the file is a bit larger than the one of `encode()`.
+ */
+void encodeToStream(const ImageView& img, Format format, const writeFun_t& write, const Options& opts={});
+
+} // namespace Codec
@@ -0,0 +1,125 @@
+#include "FramePool.h"
+#include <sys/mman.h>
+#include <unistd.h>
+#include <stdexcept>
+#include <algorithm>
+#include <string>
+#include <cstring>
+#include <cerrno>
+#include <cassert>
+
+#define HUGE_PAGE_SIZE (2*1024*1024)
+
+static size_t roundUp(size_t size, size_t alignment)
+{
+    return (size+alignment-1)/alignment*alignment;
+}
+
+FramePool::FramePool(const Options& opts)
+    : m_opts{opts}
+{
+}
+
+FramePool& FramePool::getDefault()
+{
+    static FramePool pool{Options{}};
+    return pool;
+}
+
+FramePool::Mapping FramePool::map(size_t size) const
+{
+    const bool isHuge = size >= HUGE_PAGE_SIZE && (m_opts.useHugePages || m_opts.useHugeTlb);
+
+#ifdef MAP_HUGETLB
+    if (isHuge && m_opts.useHugeTlb)
+    {
+        const size_t hugeSize = roundUp(size, HUGE_PAGE_SIZE);
+        void* data = mmap(nullptr, hugeSize, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+        if (data != MAP_FAILED)
+            return {(uint8_t*)data, hugeSize};
+        // No reserved huge pages, fall back to normal pages
+    }
+#endif
+
+    if (!isHuge)
+    {
+        const size_t mapSize = roundUp(size, sysconf(_SC_PAGESIZE));
+        void* data = mmap(nullptr, mapSize, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+        if (data == MAP_FAILED)
+            throw std::runtime_error{"Failed to map frame buffer: "+std::string(std::strerror(errno))};
+        return {(uint8_t*)data, mapSize};
+    }
+
+    // Huge pages are only used for 2 MiB aligned ranges, so map more and cut off the unaligned ends
+    const size_t mapSize = roundUp(size, HUGE_PAGE_SIZE);
+    void* raw = mmap(nullptr, mapSize+HUGE_PAGE_SIZE, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (raw == MAP_FAILED)
+        throw std::runtime_error{"Failed to map frame buffer: "+std::string(std::strerror(errno))};
+    uint8_t* data = (uint8_t*)roundUp((uintptr_t)raw, HUGE_PAGE_SIZE);
+    const size_t headSize = data-(uint8_t*)raw;
+    if (headSize)
+        munmap(raw, headSize);
+    munmap(data+mapSize, HUGE_PAGE_SIZE-headSize);
+
+#ifdef MADV_HUGEPAGE
+    if (m_opts.useHugePages)
+        madvise(data, mapSize, MADV_HUGEPAGE); // Only a hint, fails if THP is disabled
+#endif
+    return {data, mapSize};
+}
+
+uint8_t* FramePool::acquire(size_t size)
+{
+    assert(size > 0);
+    std::lock_guard<std::mutex> lock{m_mutex};
+
+    // The smallest free buffer that fits
+    auto best = m_freeBuffers.end();
+    for (auto it = m_freeBuffers.begin(); it != m_freeBuffers.end(); ++it)
+    {
+        if (it->size >= size && (best == m_freeBuffers.end() || it->size < best->size))
+            best = it;
+    }
+
+    Mapping mapping;
+    if (best != m_freeBuffers.end())
+    {
+        mapping = *best;
+        m_freeBuffers.erase(best);
+    }
+    else
+    {
+        mapping = map(size);
+    }
+    m_usedBuffers[mapping.data] = mapping.size;
+    return mapping.data;
+}
+
+void FramePool::release(uint8_t* data)
+{
+    if (!data)
+        return;
+    std::lock_guard<std::mutex> lock{m_mutex};
+
+    auto it = m_usedBuffers.find(data);
+    assert(it != m_usedBuffers.end());
+    m_freeBuffers.push_back({data, it->second});
+    m_usedBuffers.erase(it);
+
+    // Keep the largest ones, they fit any smaller frame
+    std::sort(m_freeBuffers.begin(), m_freeBuffers.end(), [](const Mapping& a, const Mapping& b){
+        return a.size > b.size;
+    });
+    while ((int)m_freeBuffers.size() > m_opts.maxFreeBuffers)
+    {
+        munmap(m_freeBuffers.back().data, m_freeBuffers.back().size);
+        m_freeBuffers.pop_back();
+    }
+}
+
+FramePool::~FramePool()
+{
+    for (const Mapping& mapping : m_freeBuffers)
+        munmap(mapping.data, mapping.size);
+    // The used ones may still be referenced (e.g. by a Screenshot in a static object), leave them
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include <memory>
+#include <unordered_map>
+#include <mutex>
+
+/*
+ * Heap frame buffers, recycled between captures.
+ *
+ * Buffers are anonymous mappings, page-aligned (so also aligned for the SIMD kernels).
+ * Large ones are aligned to 2 MiB and marked for transparent huge pages, which makes the first
+ * touch fault 512 times less often. Released buffers are kept and given out again, so a
+ * long-running process reuses the same pages instead of faulting in new ones for every frame.
+ * Thread-safe.
+ */
+class FramePool
+{
+public:
+    struct Options
+    {
+        // Transparent huge pages (MADV_HUGEPAGE) for buffers of at least 2 MiB
+        bool useHugePages{true};
+        // Try the reserved huge pages (MAP_HUGETLB) first, most systems have none
+        bool useHugeTlb{};
+        // Released buffers kept for reuse, the others are unmapped
+        int maxFreeBuffers{2};
+    };
+
+private:
+    struct Mapping
+    {
+        uint8_t* data{};
+        size_t size{};
+    };
+
+    Options m_opts;
+    std::mutex m_mutex;
+    std::vector<Mapping> m_freeBuffers;
+    // Given out, by their address
+    std::unordered_map<uint8_t*, size_t> m_usedBuffers;
+
+    Mapping map(size_t size) const;
+
+public:
+    FramePool(const Options& opts);
+    FramePool(const FramePool&) = delete;
+    FramePool& operator=(const FramePool&) = delete;
+
+    // Used by Screenshot and the encoders
+    static FramePool& getDefault();
+
+    // At least `size` bytes, throws if out of memory. The contents are undefined.
+    uint8_t* acquire(size_t size);
+    void release(uint8_t* data);
+
+    ~FramePool();
+};
+
+// Gives a buffer back to `FramePool::getDefault()`
+struct FramePoolDeleter
+{
+    void operator()(uint8_t* data) const { FramePool::getDefault().release(data); }
+};
+
+// A buffer from `FramePool::getDefault()`, for per-frame scratch memory
+using PooledBuffer = std::unique_ptr<uint8_t[], FramePoolDeleter>;
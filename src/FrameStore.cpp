@@ -0,0 +1,398 @@
+#include "FrameStore.h"
+#include "PixelConv.h"
+#include "Trace.h"
+#include <zlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <stdexcept>
+#include <cstring>
+#include <cerrno>
+#include <algorithm>
+#include <cassert>
+
+#ifdef SHOT_HAVE_ZSTD
+#   include <zstd.h>
+#endif
+
+#define FRAME_STORE_VERSION 1
+#define FILE_HEADER_SIZE 24
+#define FRAME_HEADER_SIZE 20
+
+#define FRAME_TYPE_KEY 'K'
+#define FRAME_TYPE_DELTA 'D'
+
+#define COMPRESSION_ZLIB 1
+#define COMPRESSION_ZSTD 2
+
+static inline void putU32LE(uint8_t* out, uint32_t val)
+{
+    for (int i{}; i < 4; ++i)
+        out[i] = val >> (i*8);
+}
+
+static inline uint32_t getU32LE(const uint8_t* in)
+{
+    return in[0] | in[1] << 8 | in[2] << 16 | (uint32_t)in[3] << 24;
+}
+
+// --- Tile hash ---
+// The rows are accumulated by the `PixelConv::hashPixels()` kernels, the lanes are mixed at the end
+
+#define HASH_PRIME1 0x9e3779b185ebca87ULL
+#define HASH_PRIME2 0xc2b2ae3d27d4eb4fULL
+#define HASH_PRIME3 0x165667b19e3779f9ULL
+
+static inline uint64_t rotl64(uint64_t val, int bits)
+{
+    return val << bits | val >> (64-bits);
+}
+
+static inline uint64_t hashRound(uint64_t acc, uint64_t val)
+{
+    return rotl64(acc+val*HASH_PRIME2, 31)*HASH_PRIME1;
+}
+
+static uint64_t hashTile(const ImageView& tile)
+{
+    uint64_t lanes[PixelConv::HASH_LANE_COUNT]{};
+    uint64_t tail = HASH_PRIME3;
+    const int blocksPerRow = tile.width/16;
+    for (int y{}; y < tile.height; ++y)
+    {
+        const uint8_t* row = tile.getRow(y);
+        PixelConv::hashPixels(row, tile.width, lanes, (uint64_t)y*blocksPerRow);
+        // Tiles at the right edge can have any width
+        for (int x = blocksPerRow*16; x < tile.width; ++x)
+        {
+            uint32_t word;
+            std::memcpy(&word, row+x*4, 4);
+            tail = rotl64(tail^(word*HASH_PRIME1), 23)*HASH_PRIME2+HASH_PRIME3;
+        }
+    }
+
+    uint64_t hash = HASH_PRIME1;
+    for (uint64_t lane : lanes)
+        hash = hashRound(hash, lane);
+    hash ^= tail;
+    hash ^= hash >> 33;
+    hash *= HASH_PRIME2;
+    hash ^= hash >> 29;
+    hash *= HASH_PRIME3;
+    hash ^= hash >> 32;
+    return hash;
+}
+
+// Tile `index` of an image split into `tileSize` tiles, `tilesX` per row
+static ImageView getTile(const ImageView& img, int tileSize, int tilesX, int index)
+{
+    const int x = index%tilesX*tileSize;
+    const int y = index/tilesX*tileSize;
+    return img.getSubView(x, y, std::min(tileSize, img.width-x), std::min(tileSize, img.height-y));
+}
+
+// --- Writer ---
+
+FrameStoreWriter::FrameStoreWriter(const std::string& filename, int width, int height, const Options& opts)
+    : m_file{filename}, m_opts{opts}, m_width{width}, m_height{height}
+{
+    assert(width > 0 && height > 0 && opts.tileSize > 0);
+    m_tilesX = (width+opts.tileSize-1)/opts.tileSize;
+    m_tilesY = (height+opts.tileSize-1)/opts.tileSize;
+    m_keyHashes.resize(m_tilesX*m_tilesY);
+    m_hashes.resize(m_tilesX*m_tilesY);
+
+#ifdef SHOT_HAVE_ZSTD
+    m_cctx = ZSTD_createCCtx();
+    if (!m_cctx)
+        throw std::runtime_error{"zstd: Failed to create context"};
+#endif
+
+    uint8_t header[FILE_HEADER_SIZE]{};
+    std::memcpy(header, FRAME_STORE_MAGIC, 8);
+    putU32LE(header+8, FRAME_STORE_VERSION);
+    putU32LE(header+12, width);
+    putU32LE(header+16, height);
+    putU32LE(header+20, opts.tileSize);
+    m_file.write(header, sizeof(header));
+    m_fileSize = sizeof(header);
+}
+
+int FrameStoreWriter::addFrame(const ImageView& img, uint32_t id)
+{
+    TRACE_SCOPE("frame_store_add");
+    assert(img.width == m_width && img.height == m_height);
+
+    const int tileCount = m_tilesX*m_tilesY;
+    for (int i{}; i < tileCount; ++i)
+        m_hashes[i] = hashTile(getTile(img, m_opts.tileSize, m_tilesX, i));
+
+    std::vector<uint32_t> tiles;
+    bool isKeyframe = m_frameCount == 0 || m_framesSinceKeyframe >= m_opts.keyframeInterval;
+    if (!isKeyframe)
+    {
+        for (int i{}; i < tileCount; ++i)
+        {
+            if (m_hashes[i] != m_keyHashes[i])
+                tiles.push_back(i);
+        }
+        isKeyframe = tiles.size()*100 > (size_t)tileCount*m_opts.maxChangedPercent;
+    }
+    if (isKeyframe)
+    {
+        tiles.resize(tileCount);
+        for (int i{}; i < tileCount; ++i)
+            tiles[i] = i;
+        m_keyHashes.swap(m_hashes);
+        m_framesSinceKeyframe = 0;
+        ++m_keyframeCount;
+    }
+
+    writeFrame(isKeyframe ? FRAME_TYPE_KEY : FRAME_TYPE_DELTA, id, tiles, img);
+    ++m_framesSinceKeyframe;
+    ++m_frameCount;
+    m_storedTileCount += tiles.size();
+    return tiles.size();
+}
+
+void FrameStoreWriter::writeFrame(char type, uint32_t id, const std::vector<uint32_t>& tiles, const ImageView& img)
+{
+    size_t rawSize = tiles.size()*4;
+    for (uint32_t index : tiles)
+    {
+        const ImageView tile = getTile(img, m_opts.tileSize, m_tilesX, index);
+        rawSize += (size_t)tile.width*tile.height*4;
+    }
+    m_payload.resize(rawSize);
+
+    uint8_t* p = m_payload.data();
+    for (uint32_t index : tiles)
+    {
+        putU32LE(p, index);
+        p += 4;
+    }
+    for (uint32_t index : tiles)
+    {
+        const ImageView tile = getTile(img, m_opts.tileSize, m_tilesX, index);
+        for (int y{}; y < tile.height; ++y)
+        {
+            std::memcpy(p, tile.getRow(y), tile.width*4);
+            p += tile.width*4;
+        }
+    }
+    assert(p == m_payload.data()+rawSize);
+
+    uint8_t compression;
+    size_t compressedSize;
+#ifdef SHOT_HAVE_ZSTD
+    compression = COMPRESSION_ZSTD;
+    m_compressed.resize(ZSTD_compressBound(rawSize));
+    compressedSize = ZSTD_compressCCtx(m_cctx, m_compressed.data(), m_compressed.size(), m_payload.data(), rawSize, 1);
+    if (ZSTD_isError(compressedSize))
+        throw std::runtime_error{std::string("zstd: Compression failed: ")+ZSTD_getErrorName(compressedSize)};
+#else
+    compression = COMPRESSION_ZLIB;
+    uLongf zlibSize = compressBound(rawSize);
+    m_compressed.resize(zlibSize);
+    if (compress2(m_compressed.data(), &zlibSize, m_payload.data(), rawSize, 1) != Z_OK)
+        throw std::runtime_error{"zlib: Compression failed"};
+    compressedSize = zlibSize;
+#endif
+
+    uint8_t header[FRAME_HEADER_SIZE]{};
+    header[0] = type;
+    header[1] = compression;
+    putU32LE(header+4, id);
+    putU32LE(header+8, tiles.size());
+    putU32LE(header+12, rawSize);
+    putU32LE(header+16, compressedSize);
+
+    const iovec iov[] = {
+        {header, sizeof(header)},
+        {m_compressed.data(), compressedSize},
+    };
+    m_file.writev(iov, 2);
+    m_fileSize += sizeof(header)+compressedSize;
+}
+
+FrameStoreWriter::~FrameStoreWriter()
+{
+#ifdef SHOT_HAVE_ZSTD
+    ZSTD_freeCCtx(m_cctx);
+#endif
+}
+
+// --- Reader ---
+
+FrameStoreReader::FrameStoreReader(const std::string& filename)
+    : m_filename{filename}
+{
+    m_fd = open(filename.c_str(), O_RDONLY|O_CLOEXEC);
+    if (m_fd == -1)
+        throw std::runtime_error{"Failed to open \""+filename+"\": "+std::strerror(errno)};
+
+    struct stat st{};
+    if (fstat(m_fd, &st) == -1)
+    {
+        close(m_fd);
+        throw std::runtime_error{"Failed to open \""+filename+"\": "+std::strerror(errno)};
+    }
+    const uint64_t fileSize = st.st_size;
+
+    try
+    {
+        uint8_t header[FILE_HEADER_SIZE];
+        if (fileSize < sizeof(header))
+            throwInvalid("too short");
+        readAt(0, header, sizeof(header));
+        if (std::memcmp(header, FRAME_STORE_MAGIC, 8) != 0)
+            throwInvalid("not a frame store");
+        if (getU32LE(header+8) != FRAME_STORE_VERSION)
+            throwInvalid("unsupported version "+std::to_string(getU32LE(header+8)));
+        m_width = getU32LE(header+12);
+        m_height = getU32LE(header+16);
+        m_tileSize = getU32LE(header+20);
+        if (m_width <= 0 || m_height <= 0 || m_tileSize <= 0)
+            throwInvalid("invalid size");
+
+        // Only the frame headers are read here, the payloads when a frame is needed
+        uint64_t offs = sizeof(header);
+        int keyframeIndex = -1;
+        while (offs+FRAME_HEADER_SIZE <= fileSize)
+        {
+            uint8_t frameHeader[FRAME_HEADER_SIZE];
+            readAt(offs, frameHeader, sizeof(frameHeader));
+            FrameRecord frame;
+            frame.payloadOffs = offs+sizeof(frameHeader);
+            frame.compression = frameHeader[1];
+            frame.id = getU32LE(frameHeader+4);
+            frame.tileCount = getU32LE(frameHeader+8);
+            frame.rawSize = getU32LE(frameHeader+12);
+            frame.compressedSize = getU32LE(frameHeader+16);
+            if (frame.payloadOffs+frame.compressedSize > fileSize)
+                break; // Cut off while writing, the frames before it are fine
+
+            if (frameHeader[0] == FRAME_TYPE_KEY)
+                keyframeIndex = m_frames.size();
+            else if (frameHeader[0] != FRAME_TYPE_DELTA || keyframeIndex == -1)
+                throwInvalid("invalid frame at offset "+std::to_string(offs));
+            frame.keyframeIndex = keyframeIndex;
+            m_frames.push_back(frame);
+            offs = frame.payloadOffs+frame.compressedSize;
+        }
+    }
+    catch (...)
+    {
+        close(m_fd);
+        throw;
+    }
+}
+
+void FrameStoreReader::throwInvalid(const std::string& what) const
+{
+    throw std::runtime_error{"Invalid frame store \""+m_filename+"\": "+what};
+}
+
+void FrameStoreReader::readAt(uint64_t offs, void* dst, size_t size) const
+{
+    size_t done{};
+    while (done < size)
+    {
+        const ssize_t ret = pread(m_fd, (uint8_t*)dst+done, size-done, offs+done);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret < 0)
+            throw std::runtime_error{"Failed to read \""+m_filename+"\": "+std::strerror(errno)};
+        if (ret == 0)
+            throwInvalid("unexpected end of file");
+        done += ret;
+    }
+}
+
+void FrameStoreReader::applyFrame(int index, uint8_t* dst)
+{
+    const FrameRecord& frame = m_frames[index];
+    m_compressed.resize(frame.compressedSize);
+    readAt(frame.payloadOffs, m_compressed.data(), frame.compressedSize);
+
+    m_payload.resize(frame.rawSize);
+    switch (frame.compression)
+    {
+    case COMPRESSION_ZLIB:
+    {
+        uLongf size = frame.rawSize;
+        if (uncompress(m_payload.data(), &size, m_compressed.data(), m_compressed.size()) != Z_OK
+         || size != frame.rawSize)
+            throwInvalid("corrupt frame "+std::to_string(index));
+        break;
+    }
+
+    case COMPRESSION_ZSTD:
+    {
+#ifdef SHOT_HAVE_ZSTD
+        const size_t size = ZSTD_decompress(m_payload.data(), frame.rawSize, m_compressed.data(), m_compressed.size());
+        if (ZSTD_isError(size) || size != frame.rawSize)
+            throwInvalid("corrupt frame "+std::to_string(index));
+        break;
+#else
+        throw std::runtime_error{"zstd support is not compiled in, cannot read \""+m_filename+"\""};
+#endif
+    }
+
+    default:
+        throwInvalid("unknown compression "+std::to_string(frame.compression));
+    }
+
+    const int tilesX = (m_width+m_tileSize-1)/m_tileSize;
+    const int tileCount = tilesX*((m_height+m_tileSize-1)/m_tileSize);
+    const size_t stride = (size_t)m_width*4;
+    if ((size_t)frame.tileCount*4 > frame.rawSize)
+        throwInvalid("corrupt frame "+std::to_string(index));
+    const uint8_t* src = m_payload.data()+(size_t)frame.tileCount*4;
+    const uint8_t* const end = m_payload.data()+frame.rawSize;
+    for (uint32_t i{}; i < frame.tileCount; ++i)
+    {
+        const uint32_t tileIndex = getU32LE(m_payload.data()+i*4);
+        if (tileIndex >= (uint32_t)tileCount)
+            throwInvalid("corrupt frame "+std::to_string(index));
+        const int x = tileIndex%tilesX*m_tileSize;
+        const int y = tileIndex/tilesX*m_tileSize;
+        const int w = std::min(m_tileSize, m_width-x);
+        const int h = std::min(m_tileSize, m_height-y);
+        if (src+(size_t)w*h*4 > end)
+            throwInvalid("corrupt frame "+std::to_string(index));
+
+        for (int row{}; row < h; ++row)
+        {
+            std::memcpy(dst+(y+row)*stride+x*4, src, w*4);
+            src += w*4;
+        }
+    }
+}
+
+ImageView FrameStoreReader::readFrame(int index)
+{
+    TRACE_SCOPE("frame_store_read");
+    assert(index >= 0 && index < (int)m_frames.size());
+
+    const size_t frameSize = (size_t)m_width*m_height*4;
+    const int keyframeIndex = m_frames[index].keyframeIndex;
+    if (keyframeIndex != m_decodedKeyframe)
+    {
+        m_keyframe.resize(frameSize);
+        m_decodedKeyframe = -1; // In case it throws
+        applyFrame(keyframeIndex, m_keyframe.data());
+        m_decodedKeyframe = keyframeIndex;
+    }
+    if (index == keyframeIndex)
+        return {m_keyframe.data(), m_width, m_height, m_width*4};
+
+    m_frame = m_keyframe;
+    applyFrame(index, m_frame.data());
+    return {m_frame.data(), m_width, m_height, m_width*4};
+}
+
+FrameStoreReader::~FrameStoreReader()
+{
+    close(m_fd);
+}
@@ -0,0 +1,137 @@
+#pragma once
+
+#include "ImageView.h"
+#include "Output.h"
+#include <cstdint>
+#include <string>
+#include <vector>
+#include <memory>
+
+struct ZSTD_CCtx_s;
+
+/*
+ * Archive of many captures of the same screen area in one file.
+ *
+ * Frames are split into square tiles. A keyframe stores all of its tiles, the frames after it
+ * only store the tiles that differ from the keyframe, found by comparing 64-bit tile hashes.
+ * Any frame can be rebuilt from its keyframe and its own tiles, without the frames in between.
+ *
+ * File layout (little endian):
+ *   header:  "SHOTTILE", u32 version, u32 width, u32 height, u32 tile size
+ *   frames:  u8 type ('K' or 'D'), u8 compression, u16 reserved, u32 id,
+ *            u32 tile count, u32 uncompressed size, u32 compressed size, compressed payload
+ *   payload: u32 tile index for each stored tile, then the BGRX rows of each tile without padding
+ *
+ * The payload is compressed with zstd if the program was built with it, otherwise with zlib.
+ * Frames are appended as they come, so an interrupted recording is still readable.
+ */
+#define FRAME_STORE_MAGIC "SHOTTILE"
+// Recognized by the recorder and `--extract`
+#define FRAME_STORE_EXTENSION ".frames"
+
+class FrameStoreWriter
+{
+public:
+    struct Options
+    {
+        int tileSize{64};
+        // A keyframe is stored at least this often
+        int keyframeInterval{300};
+        // A keyframe is also stored if more than this percent of the tiles changed since the last one
+        int maxChangedPercent{50};
+    };
+
+private:
+    OutputFile m_file;
+    Options m_opts;
+    int m_width{};
+    int m_height{};
+    int m_tilesX{};
+    int m_tilesY{};
+
+    // Tile hashes of the last keyframe
+    std::vector<uint64_t> m_keyHashes;
+    std::vector<uint64_t> m_hashes;
+    int m_framesSinceKeyframe{};
+
+    std::vector<uint8_t> m_payload;
+    std::vector<uint8_t> m_compressed;
+    ZSTD_CCtx_s* m_cctx{};
+
+    int m_frameCount{};
+    int m_keyframeCount{};
+    size_t m_storedTileCount{};
+    uint64_t m_fileSize{};
+
+    void writeFrame(char type, uint32_t id, const std::vector<uint32_t>& tiles, const ImageView& img);
+
+public:
+    FrameStoreWriter(const std::string& filename, int width, int height, const Options& opts);
+    FrameStoreWriter(const FrameStoreWriter&) = delete;
+    FrameStoreWriter& operator=(const FrameStoreWriter&) = delete;
+
+    /*
+     * `img` must have the size given to the constructor. `id` is stored with the frame
+     * for the reader, e.g. the time slot of a recording. Returns the number of tiles stored.
+     */
+    int addFrame(const ImageView& img, uint32_t id);
+
+    inline int getFrameCount() const { return m_frameCount; }
+    inline int getKeyframeCount() const { return m_keyframeCount; }
+    inline size_t getStoredTileCount() const { return m_storedTileCount; }
+    inline uint64_t getFileSize() const { return m_fileSize; }
+
+    ~FrameStoreWriter();
+};
+
+class FrameStoreReader
+{
+private:
+    struct FrameRecord
+    {
+        uint64_t payloadOffs{};
+        uint32_t id{};
+        uint32_t tileCount{};
+        uint32_t rawSize{};
+        uint32_t compressedSize{};
+        uint8_t compression{};
+        // Index of the keyframe the frame is based on
+        int keyframeIndex{};
+    };
+
+    std::string m_filename;
+    int m_fd{-1};
+    int m_width{};
+    int m_height{};
+    int m_tileSize{};
+    std::vector<FrameRecord> m_frames;
+
+    // The last decoded keyframe is kept, frames are usually read in order
+    std::vector<uint8_t> m_keyframe;
+    int m_decodedKeyframe{-1};
+    std::vector<uint8_t> m_frame;
+    std::vector<uint8_t> m_compressed;
+    std::vector<uint8_t> m_payload;
+
+    [[noreturn]] void throwInvalid(const std::string& what) const;
+    void readAt(uint64_t offs, void* dst, size_t size) const;
+    // Copies the tiles of frame `index` into `dst`
+    void applyFrame(int index, uint8_t* dst);
+
+public:
+    // Throws if the file is not a frame store
+    FrameStoreReader(const std::string& filename);
+    FrameStoreReader(const FrameStoreReader&) = delete;
+    FrameStoreReader& operator=(const FrameStoreReader&) = delete;
+
+    inline int getWidth() const { return m_width; }
+    inline int getHeight() const { return m_height; }
+    inline int getFrameCount() const { return m_frames.size(); }
+    inline uint32_t getFrameId(int index) const { return m_frames[index].id; }
+    inline bool isKeyframe(int index) const { return m_frames[index].keyframeIndex == index; }
+
+    // The view is valid until the next call
+    ImageView readFrame(int index);
+
+    ~FrameStoreReader();
+};
@@ -0,0 +1,359 @@
+#include "Headless.h"
+#include "WinUtils.h"
+#include "Output.h"
+#include "Trace.h"
+#include "Recorder.h"
+#include "ImageLoader.h"
+#include <unistd.h>
+#include <iostream>
+#include <iomanip>
+#include <stdexcept>
+#include <memory>
+#include <thread>
+#include <algorithm>
+#include <exception>
+#include <system_error>
+#include <cstring>
+#include <cassert>
+
+extern bool g_isDisplayOpen;
+
+using Clock = std::chrono::steady_clock;
+
+static double msBetween(Clock::time_point from, Clock::time_point to)
+{
+    return std::chrono::duration<double, std::milli>(to-from).count();
+}
+
+static WinGeometry getTargetGeom(Display* disp, const HeadlessOptions& opts)
+{
+    switch (opts.target)
+    {
+    case HeadlessOptions::Target::FocusedWindow:
+    {
+        const WinGeometry geom = getFocusedWinGeom(disp);
+        if (geom.w == 0 || geom.h == 0)
+            throw std::runtime_error{"Failed to get the focused window"};
+        return geom;
+    }
+
+    case HeadlessOptions::Target::Monitor:
+    {
+        const std::vector<MonitorInfo> monitors = getMonitors(disp);
+        if (opts.monitorIndex < 0 || opts.monitorIndex >= (int)monitors.size())
+        {
+            throw std::runtime_error{"Invalid monitor index: "+std::to_string(opts.monitorIndex)
+                +", there are "+std::to_string(monitors.size())+" monitors"};
+        }
+        return monitors[opts.monitorIndex].geom;
+    }
+
+    case HeadlessOptions::Target::Rect:
+        return opts.rect;
+
+    case HeadlessOptions::Target::FullScreen:
+    case HeadlessOptions::Target::AllMonitors:
+    {
+        XWindowAttributes attrs{};
+        Status rets = XGetWindowAttributes(disp, XDefaultRootWindow(disp), &attrs);
+        assert(rets);
+        (void)rets;
+        return {0, 0, attrs.width, attrs.height};
+    }
+    }
+    assert(false);
+    return {};
+}
+
+// Encodes and writes at the same time, so a pipe gets the first bytes early. Returns the size.
+static size_t streamToFd(const ImageView& img, Codec::Format format, const Codec::Options& codecOpts, int fd)
+{
+    TRACE_SCOPE("encode_stream");
+    OutputFile out{fd, fd == STDOUT_FILENO ? "stdout" : "fd "+std::to_string(fd)};
+    size_t size{};
+    Codec::encodeToStream(img, format, [&](const uint8_t* data, size_t len){
+        out.write(data, len);
+        size += len;
+    }, codecOpts);
+    out.close();
+    return size;
+}
+
+static void record(Display* disp, const HeadlessOptions& opts)
+{
+    Recorder::Options recOpts;
+    recOpts.area = clipToRootWin(disp, getTargetGeom(disp, opts));
+    recOpts.fps = opts.fps;
+    recOpts.durationSecs = opts.durationSecs;
+    recOpts.outputDir = opts.recordDir;
+    // QOI by default, it is fast enough to keep up with the frame rate
+    if (opts.hasFormat)
+        recOpts.format = opts.format;
+    recOpts.codecOpts = opts.codecOpts;
+
+    Recorder recorder{disp, recOpts};
+    recorder.run();
+}
+
+// The capture is compared in memory, it is never written to a file
+static int compareWithCapture(Display* disp, const HeadlessOptions& opts)
+{
+    std::unique_ptr<Screenshot> sshot;
+    if (opts.target == HeadlessOptions::Target::FullScreen)
+        sshot = std::make_unique<Screenshot>(disp);
+    else
+        sshot = std::make_unique<Screenshot>(disp, getTargetGeom(disp, opts));
+
+    const LoadedImage reference{opts.compareWith};
+    return ImageDiff::compareAndReport(sshot->getView(), reference.getView(), opts.diffOpts, opts.diffOutput);
+}
+
+// "dir/shot.png" -> "dir/shot-DP-1.png"
+static std::string getMonitorFilename(const std::string& filename, std::string monitorName)
+{
+    std::replace(monitorName.begin(), monitorName.end(), '/', '_');
+    const size_t slashPos = filename.rfind('/');
+    const size_t dotPos = filename.rfind('.');
+    if (dotPos == std::string::npos || (slashPos != std::string::npos && dotPos < slashPos))
+        return filename+"-"+monitorName;
+    return filename.substr(0, dotPos)+"-"+monitorName+filename.substr(dotPos);
+}
+
+static bool isSameContent(const ImageView& a, const ImageView& b)
+{
+    if (a.width != b.width || a.height != b.height)
+        return false;
+    for (int y{}; y < a.height; ++y)
+    {
+        if (std::memcmp(a.getRow(y), b.getRow(y), (size_t)a.width*4) != 0)
+            return false;
+    }
+    return true;
+}
+
+/*
+ * Captures the whole screen once and saves each monitor to its own file, encoded in parallel.
+ * Monitors showing the same pixels (mirrored outputs) are encoded once and written to each file.
+ */
+static void captureMonitors(Display* disp, const HeadlessOptions& opts, Codec::Format format, const std::string& filename)
+{
+    if (opts.output == "-" || opts.outputFd != -1)
+        throw std::runtime_error{"Every monitor goes to its own file, they cannot be written to stdout or a file descriptor"};
+    const std::vector<MonitorInfo> monitors = getMonitors(disp);
+    if (monitors.empty())
+        throw std::runtime_error{"No monitors found"};
+
+    const Clock::time_point startTime = Clock::now();
+    const Screenshot sshot{disp};
+    const Clock::time_point capturedTime = Clock::now();
+    const ImageView screen = sshot.getView();
+
+    struct MonitorOutput
+    {
+        std::string name;
+        std::string filename;
+        ImageView view;
+        // Index of the output with the same content, -1 if this one is encoded
+        int sameAs{-1};
+        EncodedBuffer encoded;
+        double encodeMs{};
+        std::exception_ptr error;
+    };
+    std::vector<MonitorOutput> outputs;
+    int encodedCount{};
+    for (size_t i{}; i < monitors.size(); ++i)
+    {
+        const WinGeometry& geom = monitors[i].geom;
+        const int x1 = std::max(geom.x, 0);
+        const int y1 = std::max(geom.y, 0);
+        const int x2 = std::min(geom.x+geom.w, screen.width);
+        const int y2 = std::min(geom.y+geom.h, screen.height);
+        const std::string name = monitors[i].name.empty() ? std::to_string(i) : monitors[i].name;
+        if (x2 <= x1 || y2 <= y1)
+        {
+            std::cerr << "Monitor " << name << " is outside of the screen, skipping it\n";
+            continue;
+        }
+
+        MonitorOutput output;
+        output.name = name;
+        output.filename = getMonitorFilename(filename, name);
+        output.view = screen.getSubView(x1, y1, x2-x1, y2-y1);
+        for (size_t j{}; j < outputs.size(); ++j)
+        {
+            if (outputs[j].sameAs == -1 && isSameContent(outputs[j].view, output.view))
+            {
+                output.sameAs = j;
+                break;
+            }
+        }
+        encodedCount += output.sameAs == -1;
+        outputs.push_back(std::move(output));
+    }
+
+    // One thread per monitor, the cores (or `--threads`) are shared between their encoders
+    Codec::Options codecOpts = opts.codecOpts;
+    const int threadCount = codecOpts.threadCount > 0 ? codecOpts.threadCount : std::thread::hardware_concurrency();
+    codecOpts.threadCount = std::max(1, threadCount/std::max(encodedCount, 1));
+    auto encodeOutput = [&](MonitorOutput* output){
+        try
+        {
+            const Clock::time_point encodeStart = Clock::now();
+            output->encoded = Codec::encode(output->view, format, codecOpts);
+            writeBufferToFile(output->encoded, output->filename);
+            output->encodeMs = msBetween(encodeStart, Clock::now());
+        }
+        catch (...)
+        {
+            output->error = std::current_exception();
+        }
+    };
+    std::vector<std::thread> threads;
+    threads.reserve(encodedCount);
+    for (MonitorOutput& output : outputs)
+    {
+        if (output.sameAs != -1)
+            continue;
+        try
+        {
+            threads.emplace_back(encodeOutput, &output);
+        }
+        catch (const std::system_error&)
+        {
+            // Encode it here if its thread can't be started, the started ones are joined below
+            encodeOutput(&output);
+        }
+    }
+    for (auto& thread : threads)
+        thread.join();
+    for (const MonitorOutput& output : outputs)
+    {
+        if (output.error)
+            std::rethrow_exception(output.error);
+    }
+    for (MonitorOutput& output : outputs)
+    {
+        if (output.sameAs != -1)
+            writeBufferToFile(outputs[output.sameAs].encoded, output.filename);
+    }
+    const Clock::time_point writtenTime = Clock::now();
+
+    for (const MonitorOutput& output : outputs)
+    {
+        std::cerr << "Saved monitor " << output.name << " (" << output.view.width << 'x' << output.view.height
+            << ") to \"" << output.filename << '"';
+        if (output.sameAs != -1)
+            std::cerr << ", same as " << outputs[output.sameAs].name;
+        else if (opts.printTimings)
+            std::cerr << std::fixed << std::setprecision(2) << ", encode+write: " << output.encodeMs << " ms";
+        std::cerr << '\n';
+    }
+    if (opts.printTimings)
+    {
+        std::cerr << std::fixed << std::setprecision(2)
+            << "timings: capture: " << msBetween(startTime, capturedTime)
+            << " ms, encode+write: " << msBetween(capturedTime, writtenTime)
+            << " ms, total: " << msBetween(opts.startTime, writtenTime)
+            << " ms (" << outputs.size() << " monitors, " << encodedCount << " encoded)\n";
+    }
+}
+
+int runHeadless(const HeadlessOptions& opts)
+{
+    // Nothing else may go to stdout, it can be the image
+    const bool isStdout = opts.output == "-";
+    const int streamFd = isStdout ? STDOUT_FILENO : opts.outputFd;
+    Codec::Format format = opts.format;
+    if (!opts.hasFormat && !isStdout && !opts.output.empty())
+        format = Codec::getFormatFromFilename(opts.output, Codec::Format::PNG);
+    const std::string filename = opts.output.empty() ? genDefaultFilename(Codec::getFormatExtension(format)) : opts.output;
+
+    Trace::Scope displayOpenScope{"display_open"};
+    Display* disp = XOpenDisplay(nullptr);
+    displayOpenScope.end();
+    if (!disp)
+    {
+        std::cerr << "ERR: Failed to open display\n";
+        return opts.compareWith.empty() ? 1 : 2;
+    }
+    g_isDisplayOpen = true;
+    const Clock::time_point connectedTime = Clock::now();
+
+    int ret = 0;
+    try
+    {
+        if (!opts.recordDir.empty())
+        {
+            record(disp, opts);
+        }
+        else if (!opts.compareWith.empty())
+        {
+            ret = compareWithCapture(disp, opts);
+        }
+        else if (opts.target == HeadlessOptions::Target::AllMonitors)
+        {
+            Codec::checkLevel(format, opts.codecOpts.level);
+            captureMonitors(disp, opts, format, filename);
+        }
+        else
+        {
+            // Fail before capturing
+            Codec::checkLevel(format, opts.codecOpts.level);
+
+            // Only the needed area is transferred from the server
+            std::unique_ptr<Screenshot> sshot;
+            if (opts.target == HeadlessOptions::Target::FullScreen)
+                sshot = std::make_unique<Screenshot>(disp);
+            else
+                sshot = std::make_unique<Screenshot>(disp, getTargetGeom(disp, opts));
+            const Clock::time_point capturedTime = Clock::now();
+
+            if (streamFd != -1)
+            {
+                const size_t size = streamToFd(sshot->getView(), format, opts.codecOpts, streamFd);
+                const Clock::time_point writtenTime = Clock::now();
+
+                if (opts.printTimings)
+                {
+                    std::cerr << std::fixed << std::setprecision(2)
+                        << "timings: connect: " << msBetween(opts.startTime, connectedTime)
+                        << " ms, capture: " << msBetween(connectedTime, capturedTime)
+                        << " ms, encode+write: " << msBetween(capturedTime, writtenTime)
+                        << " ms, total: " << msBetween(opts.startTime, writtenTime)
+                        << " ms (" << sshot->getWidth() << 'x' << sshot->getHeight()
+                        << ", " << Codec::getFormatName(format) << ", " << size << " bytes, streamed)\n";
+                }
+            }
+            else
+            {
+                const EncodedBuffer encoded = sshot->encode(format, opts.codecOpts);
+                const Clock::time_point encodedTime = Clock::now();
+
+                writeBufferToFile(encoded, filename);
+                const Clock::time_point writtenTime = Clock::now();
+
+                if (opts.printTimings)
+                {
+                    std::cerr << std::fixed << std::setprecision(2)
+                        << "timings: connect: " << msBetween(opts.startTime, connectedTime)
+                        << " ms, capture: " << msBetween(connectedTime, capturedTime)
+                        << " ms, encode: " << msBetween(capturedTime, encodedTime)
+                        << " ms, write: " << msBetween(encodedTime, writtenTime)
+                        << " ms, total: " << msBetween(opts.startTime, writtenTime)
+                        << " ms (" << sshot->getWidth() << 'x' << sshot->getHeight()
+                        << ", " << Codec::getFormatName(format) << ", " << encoded->size() << " bytes)\n";
+                }
+                std::cerr << "Saved screenshot to \"" << filename << "\"\n";
+            }
+        }
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << "ERR: " << e.what() << '\n';
+        ret = opts.compareWith.empty() ? 1 : 2;
+    }
+
+    XCloseDisplay(disp);
+    g_isDisplayOpen = false;
+    return ret;
+}
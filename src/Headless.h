@@ -0,0 +1,55 @@
+#pragma once
+
+#include "Screenshot.h"
+#include "Codec.h"
+#include "ImageDiff.h"
+#include <string>
+#include <chrono>
+
+/*
+ * Non-interactive capture for scripts: no GLX window, no GL context,
+ * the selected area is captured, encoded and written right away.
+ */
+struct HeadlessOptions
+{
+    enum class Target
+    {
+        FullScreen,
+        FocusedWindow,
+        Monitor,
+        Rect,
+        // Every monitor to its own file, see `--all-monitors`
+        AllMonitors,
+    };
+
+    Target target{Target::FullScreen};
+    // Used if `target` is `Target::Monitor`
+    int monitorIndex{};
+    // Used if `target` is `Target::Rect`
+    WinGeometry rect;
+    // "-" means stdout, empty means the default file in ~/Pictures
+    std::string output;
+    // If not -1, the image is written to this file descriptor instead of `output`
+    int outputFd{-1};
+    // Set if the format was given explicitly, otherwise it comes from the file extension
+    bool hasFormat{};
+    Codec::Format format{Codec::Format::PNG};
+    // Compression level and encoder threads, see `--level` and `--threads`
+    Codec::Options codecOpts;
+    bool printTimings{};
+    // If set, record to this directory instead of taking one screenshot, see Recorder
+    std::string recordDir;
+    double fps{30};
+    // 0 means until interrupted
+    double durationSecs{};
+    // If set, compare the capture with this image file instead of saving it, see ImageDiff
+    std::string compareWith;
+    ImageDiff::Options diffOpts;
+    // Where to save the diff image, if not empty
+    std::string diffOutput;
+    // When the program started, for the total latency
+    std::chrono::steady_clock::time_point startTime;
+};
+
+// Returns the exit code, for comparisons the one of `ImageDiff::compareAndReport()` or 2 on errors
+int runHeadless(const HeadlessOptions& opts);
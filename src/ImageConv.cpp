@@ -0,0 +1,91 @@
+#include "ImageConv.h"
+#include "PixelConv.h"
+#include <thread>
+#include <system_error>
+#include <vector>
+#include <algorithm>
+#include <cassert>
+
+// Below this, starting a thread costs more than it saves
+#define MIN_PIXELS_PER_THREAD (256*1024)
+
+namespace ImageConv
+{
+
+int getBytesPerPixel(Format format)
+{
+    switch (format)
+    {
+    case Format::BGRX: return 4;
+    case Format::BGR:  return 3;
+    case Format::RGB:  return 3;
+    case Format::RGBA: return 4;
+    }
+    assert(false);
+    return 4;
+}
+
+void convert(const ImageView& src, uint8_t* dst, int dstBytesPerLine, Format format, int threadCount)
+{
+    assert(src.data && dst);
+    assert(dstBytesPerLine >= src.width*getBytesPerPixel(format));
+
+    const bool isInPlace = dst == src.data;
+    assert(!isInPlace || (format == Format::BGRX && dstBytesPerLine == src.bytesPerLine));
+    void (*convertRow)(const uint8_t*, uint8_t*, int){};
+    switch (format)
+    {
+    case Format::BGRX: convertRow = PixelConv::bgrxToBgra; break;
+    case Format::BGR:  convertRow = PixelConv::bgrxToBgr;  break;
+    case Format::RGB:  convertRow = PixelConv::bgrxToRgb;  break;
+    case Format::RGBA: convertRow = PixelConv::bgrxToRgba; break;
+    }
+
+    auto runStripe = [&](int fromY, int toY){
+        for (int y{fromY}; y < toY; ++y)
+        {
+            uint8_t* dstRow = dst+(size_t)y*dstBytesPerLine;
+            if (isInPlace)
+                PixelConv::fillAlpha(dstRow, src.width);
+            else
+                convertRow(src.getRow(y), dstRow, src.width);
+        }
+    };
+
+    if (threadCount <= 0)
+        threadCount = std::max(1u, std::thread::hardware_concurrency());
+    const int64_t pixelCount = (int64_t)src.width*src.height;
+    const int stripeCount = (int)std::max<int64_t>(1, std::min<int64_t>({threadCount, src.height, pixelCount/MIN_PIXELS_PER_THREAD}));
+
+    auto getStripeStart = [&](int i){ return (int)((int64_t)src.height*i/stripeCount); };
+
+    // The kernels cannot throw, so there are no errors to pass back from the threads
+    std::vector<std::thread> threads;
+    threads.reserve(stripeCount-1);
+    // If a thread can't be started, the calling thread does the stripes from there on
+    int inlineFrom = stripeCount;
+    for (int i{1}; i < stripeCount; ++i)
+    {
+        try
+        {
+            threads.emplace_back(runStripe, getStripeStart(i), getStripeStart(i+1));
+        }
+        catch (const std::system_error&)
+        {
+            inlineFrom = i;
+            break;
+        }
+    }
+    runStripe(0, getStripeStart(1)); // Use the calling thread too
+    if (inlineFrom < stripeCount)
+        runStripe(getStripeStart(inlineFrom), src.height);
+    for (auto& thread : threads)
+        thread.join();
+}
+
+void fillAlpha(uint8_t* data, int width, int height, int bytesPerLine, int threadCount)
+{
+    convert({data, width, height, bytesPerLine}, data, bytesPerLine, Format::BGRX, threadCount);
+}
+
+} // namespace ImageConv
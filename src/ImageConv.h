@@ -0,0 +1,35 @@
+#pragma once
+
+#include "ImageView.h"
+#include <cstdint>
+
+/*
+ * Whole-image pixel processing after a capture, built on the PixelConv kernels.
+ *
+ * The copy, the alpha fix and the conversion for an encoder are one pass over each row,
+ * and the rows are split into stripes processed on multiple threads.
+ */
+namespace ImageConv
+{
+
+enum class Format
+{
+    BGRX, // With the X byte set to 255, the format of the screenshots
+    BGR,
+    RGB,
+    RGBA,
+};
+
+int getBytesPerPixel(Format format);
+
+/*
+ * Converts `src` to `format` into `dst`, with rows `dstBytesPerLine` apart.
+ * For `Format::BGRX` with the same stride `dst` can be `src.data`, then only the alpha is fixed.
+ * `threadCount` 0 means one per CPU core, small images are processed on the calling thread.
+ */
+void convert(const ImageView& src, uint8_t* dst, int dstBytesPerLine, Format format, int threadCount=0);
+
+// Sets the X byte of a BGRX image to 255 in place
+void fillAlpha(uint8_t* data, int width, int height, int bytesPerLine, int threadCount=0);
+
+} // namespace ImageConv
@@ -0,0 +1,244 @@
+#include "ImageDiff.h"
+#include "PixelConv.h"
+#include "Codec.h"
+#include "Output.h"
+#include "Trace.h"
+#include <iostream>
+#include <iomanip>
+#include <thread>
+#include <algorithm>
+#include <stdexcept>
+#include <exception>
+#include <system_error>
+#include <climits>
+#include <cstdio>
+#include <cassert>
+
+namespace ImageDiff
+{
+
+// Bounding box of the differing pixels in a cell
+struct Cell
+{
+    int minX{INT_MAX};
+    int minY{INT_MAX};
+    int maxX{-1};
+    int maxY{-1};
+
+    inline bool isEmpty() const { return maxX == -1; }
+};
+
+// Differing pixels are red, the others are a lighter gray version of `a`
+static void renderDiffRow(const uint8_t* a, const uint8_t* mask, uint8_t* dst, int width)
+{
+    for (int x{}; x < width; ++x)
+    {
+        if (mask[x])
+        {
+            dst[x*4+0] = 0;
+            dst[x*4+1] = 0;
+            dst[x*4+2] = 255;
+        }
+        else
+        {
+            const uint8_t gray = 191+(a[x*4+0]+a[x*4+1]+a[x*4+2])/12;
+            dst[x*4+0] = gray;
+            dst[x*4+1] = gray;
+            dst[x*4+2] = gray;
+        }
+        dst[x*4+3] = 255;
+    }
+}
+
+// Compares rows [fromY, toY), which contain whole rows of cells
+static size_t compareRows(const ImageView& a, const ImageView& b, const Options& opts,
+        int fromY, int toY, Cell* cells, int cellsX, uint8_t* diffImage)
+{
+    const uint32_t tolerance = opts.toleranceB | opts.toleranceG << 8 | opts.toleranceR << 16;
+    std::vector<uint8_t> mask(a.width);
+    size_t diffCount{};
+    for (int y{fromY}; y < toY; ++y)
+    {
+        const int rowDiffCount = PixelConv::diffPixels(a.getRow(y), b.getRow(y), mask.data(), a.width, tolerance);
+        if (diffImage)
+            renderDiffRow(a.getRow(y), mask.data(), diffImage+(size_t)y*a.width*4, a.width);
+        if (rowDiffCount == 0)
+            continue;
+        diffCount += rowDiffCount;
+
+        Cell* cellRow = cells+(size_t)(y/opts.cellSize)*cellsX;
+        for (int x{}; x < a.width; ++x)
+        {
+            if (!mask[x])
+                continue;
+            Cell& cell = cellRow[x/opts.cellSize];
+            cell.minX = std::min(cell.minX, x);
+            cell.maxX = std::max(cell.maxX, x);
+            cell.minY = std::min(cell.minY, y);
+            cell.maxY = y;
+        }
+    }
+    return diffCount;
+}
+
+// Joins the non-empty cells that touch each other (also diagonally)
+static std::vector<WinGeometry> findRegions(std::vector<Cell>& cells, int cellsX, int cellsY)
+{
+    std::vector<WinGeometry> regions;
+    std::vector<int> stack;
+    for (int start{}; start < cellsX*cellsY; ++start)
+    {
+        if (cells[start].isEmpty())
+            continue;
+
+        Cell bounds;
+        stack.push_back(start);
+        while (!stack.empty())
+        {
+            const int index = stack.back();
+            stack.pop_back();
+            Cell& cell = cells[index];
+            if (cell.isEmpty())
+                continue; // Already visited
+            bounds.minX = std::min(bounds.minX, cell.minX);
+            bounds.minY = std::min(bounds.minY, cell.minY);
+            bounds.maxX = std::max(bounds.maxX, cell.maxX);
+            bounds.maxY = std::max(bounds.maxY, cell.maxY);
+            cell = Cell{};
+
+            const int cx = index%cellsX;
+            const int cy = index/cellsX;
+            for (int ny{std::max(cy-1, 0)}; ny <= std::min(cy+1, cellsY-1); ++ny)
+            {
+                for (int nx{std::max(cx-1, 0)}; nx <= std::min(cx+1, cellsX-1); ++nx)
+                {
+                    if (!cells[ny*cellsX+nx].isEmpty())
+                        stack.push_back(ny*cellsX+nx);
+                }
+            }
+        }
+        regions.push_back({bounds.minX, bounds.minY, bounds.maxX-bounds.minX+1, bounds.maxY-bounds.minY+1});
+    }
+
+    std::sort(regions.begin(), regions.end(), [](const WinGeometry& r1, const WinGeometry& r2){
+        return r1.y != r2.y ? r1.y < r2.y : r1.x < r2.x;
+    });
+    return regions;
+}
+
+Result compare(const ImageView& a, const ImageView& b, const Options& opts, std::vector<uint8_t>* diffImage)
+{
+    TRACE_SCOPE("compare");
+    if (a.width != b.width || a.height != b.height)
+    {
+        throw std::runtime_error{"The images have different sizes: "
+            +std::to_string(a.width)+"x"+std::to_string(a.height)+" and "
+            +std::to_string(b.width)+"x"+std::to_string(b.height)};
+    }
+    assert(opts.cellSize > 0);
+
+    const int cellsX = (a.width+opts.cellSize-1)/opts.cellSize;
+    const int cellsY = (a.height+opts.cellSize-1)/opts.cellSize;
+    std::vector<Cell> cells((size_t)cellsX*cellsY);
+    if (diffImage)
+        diffImage->resize((size_t)a.width*a.height*4);
+
+    // Stripes are made of whole cell rows, so the threads never write the same cell
+    const int threadCount = opts.threadCount > 0 ? opts.threadCount : std::max(1u, std::thread::hardware_concurrency());
+    const int stripeCount = std::min(threadCount, cellsY);
+    std::vector<size_t> diffCounts(stripeCount);
+    std::vector<std::exception_ptr> errors(stripeCount);
+    auto runStripe = [&](int i){
+        try
+        {
+            const int fromY = (int64_t)cellsY*i/stripeCount*opts.cellSize;
+            const int toY = std::min((int)((int64_t)cellsY*(i+1)/stripeCount*opts.cellSize), a.height);
+            diffCounts[i] = compareRows(a, b, opts, fromY, toY, cells.data(), cellsX,
+                    diffImage ? diffImage->data() : nullptr);
+        }
+        catch (...)
+        {
+            errors[i] = std::current_exception();
+        }
+    };
+    std::vector<std::thread> threads;
+    // If a thread can't be started, the calling thread does the stripes from there on
+    int inlineFrom = stripeCount;
+    for (int i{1}; i < stripeCount; ++i)
+    {
+        try
+        {
+            threads.emplace_back(runStripe, i);
+        }
+        catch (const std::system_error&)
+        {
+            inlineFrom = i;
+            break;
+        }
+    }
+    runStripe(0); // Use the calling thread too
+    for (int i{inlineFrom}; i < stripeCount; ++i)
+        runStripe(i);
+    for (auto& thread : threads)
+        thread.join();
+    for (const auto& error : errors)
+    {
+        if (error)
+            std::rethrow_exception(error);
+    }
+
+    Result result;
+    result.pixelCount = (size_t)a.width*a.height;
+    for (size_t count : diffCounts)
+        result.diffCount += count;
+    if (result.diffCount)
+        result.regions = findRegions(cells, cellsX, cellsY);
+    return result;
+}
+
+int compareAndReport(const ImageView& a, const ImageView& b, const Options& opts, const std::string& diffFilename)
+{
+    std::vector<uint8_t> diffImage;
+    const Result result = compare(a, b, opts, diffFilename.empty() ? nullptr : &diffImage);
+
+    if (!diffFilename.empty())
+    {
+        const ImageView diffView{diffImage.data(), a.width, a.height, a.width*4};
+        const Codec::Format format = Codec::getFormatFromFilename(diffFilename, Codec::Format::PNG);
+        writeBufferToFile(Codec::encode(diffView, format), diffFilename);
+    }
+
+    // Machine-readable: one summary line, then one line per region
+    std::cout << (result.diffCount ? "different: " : "identical: ") << result.diffCount
+        << " of " << result.pixelCount << " pixels differ (" << std::fixed << std::setprecision(4)
+        << result.diffCount*100.0/result.pixelCount << "%), " << result.regions.size() << " regions\n";
+    for (const WinGeometry& region : result.regions)
+        std::cout << "region " << region.x << ',' << region.y << ',' << region.w << ',' << region.h << '\n';
+    return result.diffCount ? 1 : 0;
+}
+
+bool parseTolerance(const std::string& str, Options* opts)
+{
+    int r{}, g{}, b{};
+    char end;
+    const int count = std::sscanf(str.c_str(), "%d,%d,%d%c", &r, &g, &b, &end);
+    if (count == 1)
+    {
+        g = r;
+        b = r;
+    }
+    else if (count != 3)
+    {
+        return false;
+    }
+    if (str.find_first_not_of("0123456789,") != std::string::npos
+     || r < 0 || r > 255 || g < 0 || g > 255 || b < 0 || b > 255)
+        return false;
+
+    opts->toleranceR = r;
+    opts->toleranceG = g;
+    opts->toleranceB = b;
+    return true;
+}
+
+} // namespace ImageDiff
@@ -0,0 +1,54 @@
+#pragma once
+
+#include "ImageView.h"
+#include "Screenshot.h"
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/*
+ * Pixel comparison of two BGRX images of the same size, for capture-based UI tests.
+ *
+ * Rows are compared with the SIMD kernel of PixelConv on multiple threads. The differing pixels
+ * are collected on a grid of cells, and the cells that touch each other are joined into
+ * regions, which are reported as their exact bounding boxes.
+ */
+namespace ImageDiff
+{
+
+struct Options
+{
+    // Largest difference of each channel that still counts as equal
+    uint8_t toleranceR{};
+    uint8_t toleranceG{};
+    uint8_t toleranceB{};
+    // Number of threads, 0 means one per CPU core
+    int threadCount{};
+    // Differences closer than about this many pixels end up in the same region
+    int cellSize{16};
+};
+
+struct Result
+{
+    size_t pixelCount{};
+    size_t diffCount{};
+    // Sorted by position, top to bottom
+    std::vector<WinGeometry> regions;
+};
+
+/*
+ * Throws if the sizes differ. If `diffImage` is not null, it receives a BGRX image of the same size
+ * (rows not padded): `a` faded out, with the differing pixels in red.
+ */
+Result compare(const ImageView& a, const ImageView& b, const Options& opts, std::vector<uint8_t>* diffImage=nullptr);
+
+/*
+ * Compares, writes the diff image to `diffFilename` if it is not empty and prints the result
+ * to stdout. Returns the exit code of `--compare`: 0 if the images match, 1 if not.
+ */
+int compareAndReport(const ImageView& a, const ImageView& b, const Options& opts, const std::string& diffFilename);
+
+// Parses "N" (all channels) or "R,G,B", returns false if invalid
+bool parseTolerance(const std::string& str, Options* opts);
+
+} // namespace ImageDiff
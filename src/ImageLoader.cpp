@@ -0,0 +1,304 @@
+#include "ImageLoader.h"
+#include "Trace.h"
+#include <png.h>
+#include <fstream>
+#include <stdexcept>
+#include <cstring>
+#include <cerrno>
+#include <cctype>
+
+#ifdef SHOT_HAVE_ZSTD
+#   include <zstd.h>
+#endif
+
+// Larger images are rejected instead of trying to allocate them
+#define MAX_IMAGE_SIZE 32768
+
+static uint32_t getU32LE(const uint8_t* in)
+{
+    return in[0] | in[1] << 8 | in[2] << 16 | (uint32_t)in[3] << 24;
+}
+
+static uint32_t getU32BE(const uint8_t* in)
+{
+    return (uint32_t)in[0] << 24 | in[1] << 16 | in[2] << 8 | in[3];
+}
+
+static bool startsWith(const std::vector<uint8_t>& file, const void* magic, size_t size)
+{
+    return file.size() >= size && std::memcmp(file.data(), magic, size) == 0;
+}
+
+LoadedImage::LoadedImage(const std::string& filename)
+    : m_filename{filename}
+{
+    TRACE_SCOPE("load_image");
+
+    std::ifstream stream{filename, std::ios_base::binary};
+    if (!stream)
+        throw std::runtime_error{"Failed to open \""+filename+"\": "+std::strerror(errno)};
+    const std::vector<uint8_t> file{std::istreambuf_iterator<char>{stream}, std::istreambuf_iterator<char>{}};
+    if (stream.bad())
+        throw std::runtime_error{"Failed to read \""+filename+"\": "+std::strerror(errno)};
+
+    const uint8_t zstdMagic[] = {0x28, 0xb5, 0x2f, 0xfd};
+    if (startsWith(file, "\x89PNG", 4))
+        decodePng(file);
+    else if (startsWith(file, "qoif", 4))
+        decodeQoi(file);
+    else if (startsWith(file, "P6", 2) || startsWith(file, "P7", 2))
+        decodePnm(file);
+    else if (startsWith(file, "BM", 2))
+        decodeBmp(file);
+    else if (startsWith(file, RAW_MAGIC, 8))
+        decodeRaw(file.data(), file.size());
+    else if (startsWith(file, zstdMagic, sizeof(zstdMagic)))
+        decodeZstd(file);
+    else
+        throwInvalid("unknown format");
+}
+
+void LoadedImage::throwInvalid(const std::string& what) const
+{
+    throw std::runtime_error{"Failed to load \""+m_filename+"\": "+what};
+}
+
+void LoadedImage::allocate(int width, int height)
+{
+    if (width <= 0 || height <= 0 || width > MAX_IMAGE_SIZE || height > MAX_IMAGE_SIZE)
+        throwInvalid("invalid size: "+std::to_string(width)+"x"+std::to_string(height));
+    m_width = width;
+    m_height = height;
+    m_data.resize((size_t)width*height*4);
+}
+
+void LoadedImage::decodePng(const std::vector<uint8_t>& file)
+{
+    png_image image{};
+    image.version = PNG_IMAGE_VERSION;
+    if (!png_image_begin_read_from_memory(&image, file.data(), file.size()))
+        throwInvalid(image.message);
+
+    // Same byte order as the captures, the alpha byte takes the place of X
+    image.format = PNG_FORMAT_BGRA;
+    if (image.width > MAX_IMAGE_SIZE || image.height > MAX_IMAGE_SIZE)
+    {
+        png_image_free(&image);
+        throwInvalid("image is too large");
+    }
+    allocate(image.width, image.height);
+    if (!png_image_finish_read(&image, nullptr, m_data.data(), m_width*4, nullptr))
+        throwInvalid(image.message);
+}
+
+void LoadedImage::decodeQoi(const std::vector<uint8_t>& file)
+{
+    if (file.size() < 14)
+        throwInvalid("truncated QOI header");
+    allocate(getU32BE(file.data()+4), getU32BE(file.data()+8));
+
+    // Pixels are kept as BGRA words, like in the encoder
+    uint32_t index[64]{};
+    uint32_t px = 0xff000000;
+    const uint8_t* p = file.data()+14;
+    const uint8_t* const end = file.data()+file.size();
+    const size_t pixelCount = (size_t)m_width*m_height;
+    int run{};
+    for (size_t i{}; i < pixelCount; ++i)
+    {
+        if (run > 0)
+        {
+            --run;
+        }
+        else
+        {
+            if (p >= end)
+                throwInvalid("truncated QOI data");
+            const uint8_t op = *p++;
+            uint8_t b = px, g = px >> 8, r = px >> 16, a = px >> 24;
+            if (op == 0xfe || op == 0xff) // RGB, RGBA
+            {
+                const int size = op == 0xfe ? 3 : 4;
+                if (end-p < size)
+                    throwInvalid("truncated QOI data");
+                r = p[0];
+                g = p[1];
+                b = p[2];
+                if (size == 4)
+                    a = p[3];
+                p += size;
+            }
+            else if ((op & 0xc0) == 0x00) // Index
+            {
+                px = index[op];
+                std::memcpy(m_data.data()+i*4, &px, 4);
+                continue;
+            }
+            else if ((op & 0xc0) == 0x40) // Diff
+            {
+                r += ((op >> 4) & 3)-2;
+                g += ((op >> 2) & 3)-2;
+                b += (op & 3)-2;
+            }
+            else if ((op & 0xc0) == 0x80) // Luma
+            {
+                if (p >= end)
+                    throwInvalid("truncated QOI data");
+                const int dg = (op & 0x3f)-32;
+                r += dg-8+(*p >> 4);
+                g += dg;
+                b += dg-8+(*p & 0xf);
+                ++p;
+            }
+            else // Run
+            {
+                run = op & 0x3f;
+            }
+            px = (uint32_t)a << 24 | r << 16 | g << 8 | b;
+            index[(r*3+g*5+b*7+a*11)%64] = px;
+        }
+        std::memcpy(m_data.data()+i*4, &px, 4);
+    }
+}
+
+void LoadedImage::decodePnm(const std::vector<uint8_t>& file)
+{
+    // The header is text, the pixels start after it
+    size_t pos = 2;
+    auto nextToken = [&](){
+        while (pos < file.size())
+        {
+            if (file[pos] == '#')
+            {
+                while (pos < file.size() && file[pos] != '\n')
+                    ++pos;
+            }
+            else if (std::isspace((unsigned char)file[pos]))
+            {
+                ++pos;
+            }
+            else
+            {
+                break;
+            }
+        }
+        std::string token;
+        while (pos < file.size() && !std::isspace((unsigned char)file[pos]))
+            token += file[pos++];
+        return token;
+    };
+    auto toInt = [&](const std::string& str){
+        if (str.empty() || str.size() > 9 || str.find_first_not_of("0123456789") != std::string::npos)
+            throwInvalid("invalid header");
+        return std::stoi(str);
+    };
+
+    int width{}, height{}, depth{3}, maxVal{};
+    if (file[1] == '6')
+    {
+        width = toInt(nextToken());
+        height = toInt(nextToken());
+        maxVal = toInt(nextToken());
+    }
+    else
+    {
+        while (true)
+        {
+            const std::string key = nextToken();
+            if (key == "ENDHDR")
+                break;
+            else if (key.empty())
+                throwInvalid("truncated header");
+            else if (key == "WIDTH")
+                width = toInt(nextToken());
+            else if (key == "HEIGHT")
+                height = toInt(nextToken());
+            else if (key == "DEPTH")
+                depth = toInt(nextToken());
+            else if (key == "MAXVAL")
+                maxVal = toInt(nextToken());
+            else
+                nextToken(); // TUPLTYPE
+        }
+    }
+    ++pos; // The single whitespace after the header
+    if (maxVal != 255 || (depth != 3 && depth != 4))
+        throwInvalid("only 8-bit RGB and RGBA images are supported");
+
+    allocate(width, height);
+    const size_t pixelCount = (size_t)width*height;
+    if (pos > file.size() || file.size()-pos < pixelCount*depth)
+        throwInvalid("truncated pixel data");
+    const uint8_t* src = file.data()+pos;
+    for (size_t i{}; i < pixelCount; ++i)
+    {
+        m_data[i*4+0] = src[i*depth+2];
+        m_data[i*4+1] = src[i*depth+1];
+        m_data[i*4+2] = src[i*depth+0];
+        m_data[i*4+3] = 255;
+    }
+}
+
+void LoadedImage::decodeBmp(const std::vector<uint8_t>& file)
+{
+    if (file.size() < 14+40)
+        throwInvalid("truncated BMP header");
+    const uint32_t dataOffs = getU32LE(file.data()+10);
+    const int width = getU32LE(file.data()+18);
+    const int height = getU32LE(file.data()+22);
+    const int bpp = file[28] | file[29] << 8;
+    const uint32_t compression = getU32LE(file.data()+30);
+    if ((bpp != 24 && bpp != 32) || compression != 0)
+        throwInvalid("only uncompressed 24 and 32-bit BMPs are supported");
+
+    // Negative height means the rows are stored top-down
+    const bool isBottomUp = height > 0;
+    allocate(width, isBottomUp ? height : -height);
+    const int bytesPerPixel = bpp/8;
+    const size_t rowLen = ((size_t)m_width*bytesPerPixel+3) & ~(size_t)3;
+    if (dataOffs > file.size() || (file.size()-dataOffs)/rowLen < (size_t)m_height)
+        throwInvalid("truncated pixel data");
+
+    for (int y{}; y < m_height; ++y)
+    {
+        const uint8_t* src = file.data()+dataOffs+(isBottomUp ? m_height-1-y : y)*rowLen;
+        uint8_t* dst = m_data.data()+(size_t)y*m_width*4;
+        for (int x{}; x < m_width; ++x)
+        {
+            dst[x*4+0] = src[x*bytesPerPixel+0];
+            dst[x*4+1] = src[x*bytesPerPixel+1];
+            dst[x*4+2] = src[x*bytesPerPixel+2];
+            dst[x*4+3] = 255;
+        }
+    }
+}
+
+void LoadedImage::decodeRaw(const uint8_t* file, size_t size)
+{
+    if (size < RAW_HEADER_SIZE || std::memcmp(file, RAW_MAGIC, 8) != 0)
+        throwInvalid("not a raw capture");
+    allocate(getU32LE(file+8), getU32LE(file+12));
+    if (size-RAW_HEADER_SIZE < m_data.size())
+        throwInvalid("truncated pixel data");
+    std::memcpy(m_data.data(), file+RAW_HEADER_SIZE, m_data.size());
+}
+
+void LoadedImage::decodeZstd(const std::vector<uint8_t>& file)
+{
+#ifdef SHOT_HAVE_ZSTD
+    // ZstdEncoder always stores the size
+    const unsigned long long rawSize = ZSTD_getFrameContentSize(file.data(), file.size());
+    if (rawSize == ZSTD_CONTENTSIZE_UNKNOWN || rawSize == ZSTD_CONTENTSIZE_ERROR
+     || rawSize > RAW_HEADER_SIZE+(unsigned long long)MAX_IMAGE_SIZE*MAX_IMAGE_SIZE*4)
+        throwInvalid("not a compressed raw capture");
+
+    std::vector<uint8_t> raw(rawSize);
+    const size_t ret = ZSTD_decompress(raw.data(), raw.size(), file.data(), file.size());
+    if (ZSTD_isError(ret))
+        throwInvalid(std::string("zstd: ")+ZSTD_getErrorName(ret));
+    decodeRaw(raw.data(), ret);
+#else
+    (void)file;
+    throwInvalid("zstd support is not compiled in");
+#endif
+}
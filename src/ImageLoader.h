@@ -0,0 +1,40 @@
+#pragma once
+
+#include "ImageView.h"
+#include <cstdint>
+#include <string>
+#include <vector>
+
+/*
+ * An image file decoded to BGRX, e.g. a reference image to compare captures with.
+ *
+ * Reads the formats `shot` writes, recognized by their content, not the extension:
+ * PNG, QOI, PPM, PAM, 24 and 32-bit BMP, raw captures and zstd compressed raw captures
+ * (if built with zstd).
+ */
+class LoadedImage
+{
+private:
+    std::string m_filename;
+    std::vector<uint8_t> m_data;
+    int m_width{};
+    int m_height{};
+
+    [[noreturn]] void throwInvalid(const std::string& what) const;
+    void allocate(int width, int height);
+
+    void decodePng(const std::vector<uint8_t>& file);
+    void decodeQoi(const std::vector<uint8_t>& file);
+    void decodePnm(const std::vector<uint8_t>& file);
+    void decodeBmp(const std::vector<uint8_t>& file);
+    void decodeRaw(const uint8_t* file, size_t size);
+    void decodeZstd(const std::vector<uint8_t>& file);
+
+public:
+    // Throws if the file cannot be read or decoded
+    LoadedImage(const std::string& filename);
+
+    inline int getWidth() const { return m_width; }
+    inline int getHeight() const { return m_height; }
+    inline ImageView getView() const { return {m_data.data(), m_width, m_height, m_width*4}; }
+};
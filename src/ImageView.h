@@ -0,0 +1,45 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <cstring>
+
+/*
+ * Header of raw BGRX dumps: 8 magic bytes, then the width and height as
+ * little endian 32-bit integers. The rows follow without padding.
+ */
+#define RAW_MAGIC "SHOTBGRX"
+#define RAW_HEADER_SIZE 16
+
+/*
+ * Non-owning view of a BGRX image (4 bytes per pixel, the alpha/padding byte is last).
+ * Rows are `bytesPerLine` bytes apart, which can be more than `width*4`.
+ */
+struct ImageView
+{
+    const uint8_t* data{};
+    int width{};
+    int height{};
+    int bytesPerLine{};
+
+    inline const uint8_t* getRow(int y) const
+    {
+        return data+(size_t)y*bytesPerLine;
+    }
+
+    // Returns a view of a sub-rectangle, sharing the data
+    inline ImageView getSubView(int x, int y, int w, int h) const
+    {
+        return {getRow(y)+x*4, w, h, bytesPerLine};
+    }
+};
+
+inline void fillRawHeader(int width, int height, uint8_t* header)
+{
+    std::memcpy(header, RAW_MAGIC, 8);
+    for (int i{}; i < 4; ++i)
+    {
+        header[8+i] = (uint32_t)width >> (i*8);
+        header[12+i] = (uint32_t)height >> (i*8);
+    }
+}
@@ -0,0 +1,136 @@
+#include "Output.h"
+#include "Trace.h"
+#include <fcntl.h>
+#include <unistd.h>
+#include <climits>
+#include <stdexcept>
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
+#include <ctime>
+#include <cstdlib>
+#include <iostream>
+
+OutputFile::OutputFile(const std::string& filename)
+    : m_filename{filename}, m_ownsFd{true}
+{
+    m_fd = open(filename.c_str(), O_WRONLY|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
+    if (m_fd == -1)
+        throwError();
+}
+
+OutputFile::OutputFile(int fd, const std::string& name)
+    : m_filename{name}, m_fd{fd}, m_ownsFd{false}
+{
+}
+
+void OutputFile::throwError() const
+{
+    throw std::runtime_error{"Failed to write to file: \""+m_filename+"\": "+std::strerror(errno)};
+}
+
+void OutputFile::write(const void* data, size_t size)
+{
+    const iovec iov{(void*)data, size};
+    writev(&iov, 1);
+}
+
+void OutputFile::writev(const iovec* iov, int count)
+{
+    std::vector<iovec> rest(iov, iov+count);
+    iovec* current = rest.data();
+    int left = count;
+    while (left > 0)
+    {
+        ssize_t ret = ::writev(m_fd, current, std::min(left, IOV_MAX));
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret < 0)
+            throwError();
+
+        // Skip the fully written buffers and advance in the partially written one
+        while (left > 0 && (size_t)ret >= current->iov_len)
+        {
+            ret -= current->iov_len;
+            ++current;
+            --left;
+        }
+        if (left > 0)
+        {
+            current->iov_base = (uint8_t*)current->iov_base+ret;
+            current->iov_len -= ret;
+        }
+    }
+}
+
+void OutputFile::sync()
+{
+    // Pipes and sockets can't be synced, there is nothing to do for them
+    if (fsync(m_fd) == -1 && errno != EINVAL)
+        throwError();
+    if (m_ownsFd)
+        syncParentDir(m_filename);
+}
+
+void OutputFile::close()
+{
+    const int fd = m_fd;
+    m_fd = -1;
+    if (m_ownsFd && ::close(fd) == -1)
+        throwError();
+}
+
+OutputFile::~OutputFile()
+{
+    if (m_fd != -1 && m_ownsFd)
+        ::close(m_fd);
+}
+
+void syncParentDir(const std::string& filename)
+{
+    const size_t slashPos = filename.rfind('/');
+    const std::string dirPath = slashPos == std::string::npos ? "." : slashPos == 0 ? "/" : filename.substr(0, slashPos);
+    const int dirFd = open(dirPath.c_str(), O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+    if (dirFd != -1)
+    {
+        fsync(dirFd);
+        ::close(dirFd);
+    }
+}
+
+void writeBufferToFile(const EncodedBuffer& buffer, const std::string& filename, bool sync)
+{
+    TRACE_SCOPE("write_file");
+    OutputFile file{filename};
+    file.write(buffer->data(), buffer->size());
+    if (sync)
+        file.sync();
+    file.close();
+}
+
+void writeBufferToFd(const EncodedBuffer& buffer, int fd, const std::string& name)
+{
+    TRACE_SCOPE("write_file");
+    OutputFile file{fd, name};
+    file.write(buffer->data(), buffer->size());
+    file.close();
+}
+
+std::string genDefaultFilename(const std::string& extension)
+{
+    std::string filename;
+    if (const char* homeDir = getenv("HOME"))
+    {
+        filename = std::string(homeDir)+"/Pictures/";
+    }
+    else
+    {
+        std::cerr << "WARN: Failed to get $HOME\n";
+    }
+
+    time_t time = std::time(nullptr);
+    tm* localTM = std::localtime(&time);
+    char buff[sizeof("0000-00-00-000000")]{};
+    std::strftime(buff, sizeof(buff), "%F-%H%M%S", localTM);
+    return filename+buff+"."+extension;
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <sys/uio.h>
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <vector>
+#include <memory>
+#include <functional>
+
+/*
+ * Encoded image data. It is shared by all the outputs (file, clipboard, stdout, ...),
+ * so an image is only encoded once.
+ */
+using EncodedBuffer = std::shared_ptr<const std::vector<uint8_t>>;
+
+// Called with consecutive pieces of an encoded file, by the encoders that stream their output
+using writeFun_t = std::function<void(const uint8_t* data, size_t size)>;
+
+/*
+ * File descriptor based output, writes everything it gets or throws.
+ */
+class OutputFile
+{
+private:
+    std::string m_filename;
+    int m_fd{-1};
+    bool m_ownsFd{};
+
+    [[noreturn]] void throwError() const;
+
+public:
+    // Creates or truncates `filename`
+    OutputFile(const std::string& filename);
+    // Writes to an already open file descriptor (e.g. stdout), which is not closed
+    OutputFile(int fd, const std::string& name);
+    OutputFile(const OutputFile&) = delete;
+    OutputFile& operator=(const OutputFile&) = delete;
+
+    void write(const void* data, size_t size);
+    void writev(const iovec* iov, int count);
+    // Returns after the data and the directory entry are durably stored
+    void sync();
+    void close();
+
+    ~OutputFile();
+};
+
+// Makes a newly created file's directory entry durable
+void syncParentDir(const std::string& filename);
+
+void writeBufferToFile(const EncodedBuffer& buffer, const std::string& filename, bool sync=false);
+void writeBufferToFd(const EncodedBuffer& buffer, int fd, const std::string& name);
+
+// ~/Pictures/<date and time>.<extension>
+std::string genDefaultFilename(const std::string& extension);
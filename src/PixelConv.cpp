@@ -0,0 +1,518 @@
+#include "PixelConv.h"
+#include <initializer_list>
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+#   define PIXCONV_X86 1
+#   include <immintrin.h>
+#endif
+
+namespace PixelConv
+{
+
+// Keys of the lanes of `hashPixels()`, each is advanced by `HASH_KEY_STEP` every 16 pixels
+static const uint64_t HASH_KEYS[HASH_LANE_COUNT] = {
+    0xbe4ba423396cfeb8ULL, 0x1cad21f72c81017cULL, 0xdb979083e96dd4deULL, 0x1f67b3b7a4a44072ULL,
+    0x78e5c0cc4ee679cbULL, 0x2172ffcc7dd05a82ULL, 0x8e2443f7744608b8ULL, 0x4c263a81e69035e0ULL,
+};
+#define HASH_KEY_STEP 0x9e3779b185ebca87ULL
+
+// --- Scalar ---
+
+static void bgrxToRgbScalar(const uint8_t* src, uint8_t* dst, int count)
+{
+    for (int i{}; i < count; ++i)
+    {
+        dst[i*3+0] = src[i*4+2];
+        dst[i*3+1] = src[i*4+1];
+        dst[i*3+2] = src[i*4+0];
+    }
+}
+
+static void bgrxToRgbaScalar(const uint8_t* src, uint8_t* dst, int count)
+{
+    for (int i{}; i < count; ++i)
+    {
+        dst[i*4+0] = src[i*4+2];
+        dst[i*4+1] = src[i*4+1];
+        dst[i*4+2] = src[i*4+0];
+        dst[i*4+3] = 255;
+    }
+}
+
+static void bgrxToBgrScalar(const uint8_t* src, uint8_t* dst, int count)
+{
+    for (int i{}; i < count; ++i)
+    {
+        dst[i*3+0] = src[i*4+0];
+        dst[i*3+1] = src[i*4+1];
+        dst[i*3+2] = src[i*4+2];
+    }
+}
+
+static void fillAlphaScalar(uint8_t* data, int count)
+{
+    for (int i{}; i < count; ++i)
+        data[i*4+3] = 255;
+}
+
+static void bgrxToBgraScalar(const uint8_t* src, uint8_t* dst, int count)
+{
+    for (int i{}; i < count; ++i)
+    {
+        uint32_t pxl;
+        std::memcpy(&pxl, src+i*4, 4);
+        pxl |= 0xff000000;
+        std::memcpy(dst+i*4, &pxl, 4);
+    }
+}
+
+/*
+ * Each lane gets the product of the low and high halves of its 8 bytes XOR its key,
+ * plus the 8 bytes of its neighbour lane, so a zero product doesn't lose the data.
+ * The SIMD versions do the same with `_mm_mul_epu32()`.
+ */
+static void hashPixelsScalar(const uint8_t* data, int count, uint64_t* acc, uint64_t blockIndex)
+{
+    for (int i{}; i+16 <= count; i += 16, ++blockIndex)
+    {
+        uint64_t words[HASH_LANE_COUNT];
+        std::memcpy(words, data+i*4, sizeof(words));
+        for (int j{}; j < HASH_LANE_COUNT; ++j)
+        {
+            const uint64_t mixed = words[j]^(HASH_KEYS[j]+blockIndex*HASH_KEY_STEP);
+            acc[j] += words[j^1]+(mixed & 0xffffffff)*(mixed >> 32);
+        }
+    }
+}
+
+static int diffPixelsScalar(const uint8_t* a, const uint8_t* b, uint8_t* mask, int count, uint32_t tolerance)
+{
+    int diffCount{};
+    for (int i{}; i < count; ++i)
+    {
+        bool isDiff = false;
+        for (int c{}; c < 3; ++c)
+        {
+            const int delta = a[i*4+c]-b[i*4+c];
+            isDiff |= (delta < 0 ? -delta : delta) > (int)(uint8_t)(tolerance >> (c*8));
+        }
+        mask[i] = isDiff;
+        diffCount += isDiff;
+    }
+    return diffCount;
+}
+
+// Spreads the low 8 bits of `bits` to 8 bytes of 0 or 1, bit 0 goes to the first byte
+static inline void storeMaskBits(uint8_t* mask, uint32_t bits, int count)
+{
+    const uint64_t spread = ((bits*0x0101010101010101ULL) & 0x8040201008040201ULL)+0x7f7f7f7f7f7f7f7fULL;
+    const uint64_t bytes = (spread >> 7) & 0x0101010101010101ULL;
+    std::memcpy(mask, &bytes, count);
+}
+
+#ifdef PIXCONV_X86
+
+// --- SSE2 ---
+// There is no byte shuffle in SSE2, so the 3 byte formats use the scalar code
+
+__attribute__((target("sse2")))
+static void bgrxToRgbaSSE2(const uint8_t* src, uint8_t* dst, int count)
+{
+    const __m128i maskG = _mm_set1_epi32(0x0000ff00);
+    const __m128i maskLow = _mm_set1_epi32(0x000000ff);
+    const __m128i alpha = _mm_set1_epi32(0xff000000);
+    int i{};
+    for (; i+4 <= count; i += 4)
+    {
+        const __m128i pxls = _mm_loadu_si128((const __m128i*)(src+i*4));
+        const __m128i g = _mm_and_si128(pxls, maskG);
+        const __m128i r = _mm_and_si128(_mm_srli_epi32(pxls, 16), maskLow);
+        const __m128i b = _mm_slli_epi32(_mm_and_si128(pxls, maskLow), 16);
+        const __m128i out = _mm_or_si128(_mm_or_si128(g, r), _mm_or_si128(b, alpha));
+        _mm_storeu_si128((__m128i*)(dst+i*4), out);
+    }
+    bgrxToRgbaScalar(src+i*4, dst+i*4, count-i);
+}
+
+__attribute__((target("sse2")))
+static void fillAlphaSSE2(uint8_t* data, int count)
+{
+    const __m128i alpha = _mm_set1_epi32(0xff000000);
+    int i{};
+    for (; i+4 <= count; i += 4)
+    {
+        __m128i* ptr = (__m128i*)(data+i*4);
+        _mm_storeu_si128(ptr, _mm_or_si128(_mm_loadu_si128(ptr), alpha));
+    }
+    fillAlphaScalar(data+i*4, count-i);
+}
+
+__attribute__((target("sse2")))
+static void bgrxToBgraSSE2(const uint8_t* src, uint8_t* dst, int count)
+{
+    const __m128i alpha = _mm_set1_epi32(0xff000000);
+    int i{};
+    for (; i+4 <= count; i += 4)
+    {
+        const __m128i pxls = _mm_loadu_si128((const __m128i*)(src+i*4));
+        _mm_storeu_si128((__m128i*)(dst+i*4), _mm_or_si128(pxls, alpha));
+    }
+    bgrxToBgraScalar(src+i*4, dst+i*4, count-i);
+}
+
+__attribute__((target("sse2")))
+static int diffPixelsSSE2(const uint8_t* a, const uint8_t* b, uint8_t* mask, int count, uint32_t tolerance)
+{
+    // The X bytes always match
+    const __m128i tol = _mm_set1_epi32(tolerance | 0xff000000);
+    const __m128i zero = _mm_setzero_si128();
+    int diffCount{};
+    int i{};
+    for (; i+4 <= count; i += 4)
+    {
+        const __m128i pxlsA = _mm_loadu_si128((const __m128i*)(a+i*4));
+        const __m128i pxlsB = _mm_loadu_si128((const __m128i*)(b+i*4));
+        const __m128i absDiff = _mm_or_si128(_mm_subs_epu8(pxlsA, pxlsB), _mm_subs_epu8(pxlsB, pxlsA));
+        // Non-zero bytes are over the tolerance
+        const __m128i over = _mm_subs_epu8(absDiff, tol);
+        const uint32_t bits = ~_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(over, zero))) & 0xf;
+        storeMaskBits(mask+i, bits, 4);
+        diffCount += __builtin_popcount(bits);
+    }
+    return diffCount+diffPixelsScalar(a+i*4, b+i*4, mask+i, count-i, tolerance);
+}
+
+__attribute__((target("sse2")))
+static void hashPixelsSSE2(const uint8_t* data, int count, uint64_t* acc, uint64_t blockIndex)
+{
+    // Two lanes per register
+    __m128i accs[4];
+    __m128i keys[4];
+    for (int k{}; k < 4; ++k)
+    {
+        accs[k] = _mm_loadu_si128((const __m128i*)(acc+k*2));
+        keys[k] = _mm_set_epi64x(HASH_KEYS[k*2+1]+blockIndex*HASH_KEY_STEP, HASH_KEYS[k*2]+blockIndex*HASH_KEY_STEP);
+    }
+    const __m128i step = _mm_set1_epi64x(HASH_KEY_STEP);
+
+    for (int i{}; i+16 <= count; i += 16)
+    {
+        for (int k{}; k < 4; ++k)
+        {
+            const __m128i words = _mm_loadu_si128((const __m128i*)(data+i*4+k*16));
+            const __m128i mixed = _mm_xor_si128(words, keys[k]);
+            // Multiplies the low 32 bits of each lane by the high 32 bits
+            const __m128i product = _mm_mul_epu32(mixed, _mm_shuffle_epi32(mixed, _MM_SHUFFLE(3, 3, 1, 1)));
+            const __m128i swapped = _mm_shuffle_epi32(words, _MM_SHUFFLE(1, 0, 3, 2));
+            accs[k] = _mm_add_epi64(accs[k], _mm_add_epi64(product, swapped));
+            keys[k] = _mm_add_epi64(keys[k], step);
+        }
+    }
+
+    for (int k{}; k < 4; ++k)
+        _mm_storeu_si128((__m128i*)(acc+k*2), accs[k]);
+}
+
+// --- SSSE3 ---
+
+__attribute__((target("ssse3")))
+static void shuffleTo3BytesSSSE3(const uint8_t* src, uint8_t* dst, int count, __m128i shufMask, bool isRgb)
+{
+    int i{};
+    // Each store writes 16 bytes of which 12 are used, so stop while there is room for that
+    for (; i+6 <= count; i += 4)
+    {
+        const __m128i pxls = _mm_loadu_si128((const __m128i*)(src+i*4));
+        _mm_storeu_si128((__m128i*)(dst+i*3), _mm_shuffle_epi8(pxls, shufMask));
+    }
+    if (isRgb)
+        bgrxToRgbScalar(src+i*4, dst+i*3, count-i);
+    else
+        bgrxToBgrScalar(src+i*4, dst+i*3, count-i);
+}
+
+__attribute__((target("ssse3")))
+static void bgrxToRgbSSSE3(const uint8_t* src, uint8_t* dst, int count)
+{
+    const __m128i mask = _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+    shuffleTo3BytesSSSE3(src, dst, count, mask, true);
+}
+
+__attribute__((target("ssse3")))
+static void bgrxToBgrSSSE3(const uint8_t* src, uint8_t* dst, int count)
+{
+    const __m128i mask = _mm_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+    shuffleTo3BytesSSSE3(src, dst, count, mask, false);
+}
+
+__attribute__((target("ssse3")))
+static void bgrxToRgbaSSSE3(const uint8_t* src, uint8_t* dst, int count)
+{
+    const __m128i mask = _mm_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+    const __m128i alpha = _mm_set1_epi32(0xff000000);
+    int i{};
+    for (; i+4 <= count; i += 4)
+    {
+        const __m128i pxls = _mm_loadu_si128((const __m128i*)(src+i*4));
+        _mm_storeu_si128((__m128i*)(dst+i*4), _mm_or_si128(_mm_shuffle_epi8(pxls, mask), alpha));
+    }
+    bgrxToRgbaScalar(src+i*4, dst+i*4, count-i);
+}
+
+// --- AVX2 ---
+
+__attribute__((target("avx2")))
+static void shuffleTo3BytesAVX2(const uint8_t* src, uint8_t* dst, int count, __m256i shufMask, bool isRgb)
+{
+    // Moves the 12 used bytes of the two lanes next to each other
+    const __m256i packIdx = _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7);
+    int i{};
+    // Each store writes 32 bytes of which 24 are used
+    for (; i+11 <= count; i += 8)
+    {
+        const __m256i pxls = _mm256_loadu_si256((const __m256i*)(src+i*4));
+        const __m256i shuffled = _mm256_shuffle_epi8(pxls, shufMask);
+        _mm256_storeu_si256((__m256i*)(dst+i*3), _mm256_permutevar8x32_epi32(shuffled, packIdx));
+    }
+    if (isRgb)
+        bgrxToRgbSSSE3(src+i*4, dst+i*3, count-i);
+    else
+        bgrxToBgrSSSE3(src+i*4, dst+i*3, count-i);
+}
+
+__attribute__((target("avx2")))
+static void bgrxToRgbAVX2(const uint8_t* src, uint8_t* dst, int count)
+{
+    const __m256i mask = _mm256_setr_epi8(
+            2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+            2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+    shuffleTo3BytesAVX2(src, dst, count, mask, true);
+}
+
+__attribute__((target("avx2")))
+static void bgrxToBgrAVX2(const uint8_t* src, uint8_t* dst, int count)
+{
+    const __m256i mask = _mm256_setr_epi8(
+            0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1,
+            0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+    shuffleTo3BytesAVX2(src, dst, count, mask, false);
+}
+
+__attribute__((target("avx2")))
+static void bgrxToRgbaAVX2(const uint8_t* src, uint8_t* dst, int count)
+{
+    const __m256i mask = _mm256_setr_epi8(
+            2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15,
+            2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+    const __m256i alpha = _mm256_set1_epi32(0xff000000);
+    int i{};
+    for (; i+8 <= count; i += 8)
+    {
+        const __m256i pxls = _mm256_loadu_si256((const __m256i*)(src+i*4));
+        _mm256_storeu_si256((__m256i*)(dst+i*4), _mm256_or_si256(_mm256_shuffle_epi8(pxls, mask), alpha));
+    }
+    bgrxToRgbaSSSE3(src+i*4, dst+i*4, count-i);
+}
+
+__attribute__((target("avx2")))
+static void fillAlphaAVX2(uint8_t* data, int count)
+{
+    const __m256i alpha = _mm256_set1_epi32(0xff000000);
+    int i{};
+    for (; i+8 <= count; i += 8)
+    {
+        __m256i* ptr = (__m256i*)(data+i*4);
+        _mm256_storeu_si256(ptr, _mm256_or_si256(_mm256_loadu_si256(ptr), alpha));
+    }
+    fillAlphaSSE2(data+i*4, count-i);
+}
+
+__attribute__((target("avx2")))
+static void bgrxToBgraAVX2(const uint8_t* src, uint8_t* dst, int count)
+{
+    const __m256i alpha = _mm256_set1_epi32(0xff000000);
+    int i{};
+    for (; i+8 <= count; i += 8)
+    {
+        const __m256i pxls = _mm256_loadu_si256((const __m256i*)(src+i*4));
+        _mm256_storeu_si256((__m256i*)(dst+i*4), _mm256_or_si256(pxls, alpha));
+    }
+    bgrxToBgraSSE2(src+i*4, dst+i*4, count-i);
+}
+
+__attribute__((target("avx2")))
+static int diffPixelsAVX2(const uint8_t* a, const uint8_t* b, uint8_t* mask, int count, uint32_t tolerance)
+{
+    const __m256i tol = _mm256_set1_epi32(tolerance | 0xff000000);
+    const __m256i zero = _mm256_setzero_si256();
+    int diffCount{};
+    int i{};
+    for (; i+8 <= count; i += 8)
+    {
+        const __m256i pxlsA = _mm256_loadu_si256((const __m256i*)(a+i*4));
+        const __m256i pxlsB = _mm256_loadu_si256((const __m256i*)(b+i*4));
+        const __m256i absDiff = _mm256_or_si256(_mm256_subs_epu8(pxlsA, pxlsB), _mm256_subs_epu8(pxlsB, pxlsA));
+        const __m256i over = _mm256_subs_epu8(absDiff, tol);
+        const uint32_t bits = ~_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpeq_epi32(over, zero))) & 0xff;
+        storeMaskBits(mask+i, bits, 8);
+        diffCount += __builtin_popcount(bits);
+    }
+    return diffCount+diffPixelsSSE2(a+i*4, b+i*4, mask+i, count-i, tolerance);
+}
+
+__attribute__((target("avx2")))
+static void hashPixelsAVX2(const uint8_t* data, int count, uint64_t* acc, uint64_t blockIndex)
+{
+    // Four lanes per register, the neighbours are swapped within the 128-bit halves like in SSE2
+    __m256i accs[2];
+    __m256i keys[2];
+    for (int k{}; k < 2; ++k)
+    {
+        accs[k] = _mm256_loadu_si256((const __m256i*)(acc+k*4));
+        keys[k] = _mm256_set_epi64x(
+                HASH_KEYS[k*4+3]+blockIndex*HASH_KEY_STEP, HASH_KEYS[k*4+2]+blockIndex*HASH_KEY_STEP,
+                HASH_KEYS[k*4+1]+blockIndex*HASH_KEY_STEP, HASH_KEYS[k*4+0]+blockIndex*HASH_KEY_STEP);
+    }
+    const __m256i step = _mm256_set1_epi64x(HASH_KEY_STEP);
+
+    for (int i{}; i+16 <= count; i += 16)
+    {
+        for (int k{}; k < 2; ++k)
+        {
+            const __m256i words = _mm256_loadu_si256((const __m256i*)(data+i*4+k*32));
+            const __m256i mixed = _mm256_xor_si256(words, keys[k]);
+            const __m256i product = _mm256_mul_epu32(mixed, _mm256_shuffle_epi32(mixed, _MM_SHUFFLE(3, 3, 1, 1)));
+            const __m256i swapped = _mm256_shuffle_epi32(words, _MM_SHUFFLE(1, 0, 3, 2));
+            accs[k] = _mm256_add_epi64(accs[k], _mm256_add_epi64(product, swapped));
+            keys[k] = _mm256_add_epi64(keys[k], step);
+        }
+    }
+
+    for (int k{}; k < 2; ++k)
+        _mm256_storeu_si256((__m256i*)(acc+k*4), accs[k]);
+}
+
+#endif // PIXCONV_X86
+
+// --- Dispatch ---
+
+struct Kernels
+{
+    Isa isa;
+    void (*bgrxToRgb)(const uint8_t*, uint8_t*, int);
+    void (*bgrxToRgba)(const uint8_t*, uint8_t*, int);
+    void (*bgrxToBgr)(const uint8_t*, uint8_t*, int);
+    void (*fillAlpha)(uint8_t*, int);
+    void (*bgrxToBgra)(const uint8_t*, uint8_t*, int);
+    int (*diffPixels)(const uint8_t*, const uint8_t*, uint8_t*, int, uint32_t);
+    void (*hashPixels)(const uint8_t*, int, uint64_t*, uint64_t);
+};
+
+static bool isSupported(Isa isa)
+{
+#ifdef PIXCONV_X86
+    switch (isa)
+    {
+    case Isa::Scalar: return true;
+    case Isa::SSE2:   return __builtin_cpu_supports("sse2");
+    case Isa::SSSE3:  return __builtin_cpu_supports("ssse3");
+    case Isa::AVX2:   return __builtin_cpu_supports("avx2");
+    }
+    return false;
+#else
+    return isa == Isa::Scalar;
+#endif
+}
+
+static Kernels getKernelsFor(Isa isa)
+{
+    switch (isa)
+    {
+#ifdef PIXCONV_X86
+    case Isa::AVX2:
+        return {isa, bgrxToRgbAVX2, bgrxToRgbaAVX2, bgrxToBgrAVX2, fillAlphaAVX2, bgrxToBgraAVX2, diffPixelsAVX2, hashPixelsAVX2};
+    case Isa::SSSE3:
+        return {isa, bgrxToRgbSSSE3, bgrxToRgbaSSSE3, bgrxToBgrSSSE3, fillAlphaSSE2, bgrxToBgraSSE2, diffPixelsSSE2, hashPixelsSSE2};
+    case Isa::SSE2:
+        return {isa, bgrxToRgbScalar, bgrxToRgbaSSE2, bgrxToBgrScalar, fillAlphaSSE2, bgrxToBgraSSE2, diffPixelsSSE2, hashPixelsSSE2};
+#endif
+    default:
+        return {Isa::Scalar, bgrxToRgbScalar, bgrxToRgbaScalar, bgrxToBgrScalar, fillAlphaScalar, bgrxToBgraScalar, diffPixelsScalar, hashPixelsScalar};
+    }
+}
+
+static Kernels& getKernels()
+{
+    static Kernels kernels = [](){
+        for (Isa isa : {Isa::AVX2, Isa::SSSE3, Isa::SSE2})
+        {
+            if (isSupported(isa))
+                return getKernelsFor(isa);
+        }
+        return getKernelsFor(Isa::Scalar);
+    }();
+    return kernels;
+}
+
+void bgrxToRgb(const uint8_t* src, uint8_t* dst, int count)
+{
+    getKernels().bgrxToRgb(src, dst, count);
+}
+
+void bgrxToRgba(const uint8_t* src, uint8_t* dst, int count)
+{
+    getKernels().bgrxToRgba(src, dst, count);
+}
+
+void bgrxToBgr(const uint8_t* src, uint8_t* dst, int count)
+{
+    getKernels().bgrxToBgr(src, dst, count);
+}
+
+void fillAlpha(uint8_t* data, int count)
+{
+    getKernels().fillAlpha(data, count);
+}
+
+void bgrxToBgra(const uint8_t* src, uint8_t* dst, int count)
+{
+    getKernels().bgrxToBgra(src, dst, count);
+}
+
+int diffPixels(const uint8_t* a, const uint8_t* b, uint8_t* mask, int count, uint32_t tolerance)
+{
+    return getKernels().diffPixels(a, b, mask, count, tolerance);
+}
+
+void hashPixels(const uint8_t* data, int count, uint64_t* acc, uint64_t blockIndex)
+{
+    getKernels().hashPixels(data, count, acc, blockIndex);
+}
+
+Isa getIsa()
+{
+    return getKernels().isa;
+}
+
+const char* getIsaName(Isa isa)
+{
+    switch (isa)
+    {
+    case Isa::Scalar: return "scalar";
+    case Isa::SSE2:   return "SSE2";
+    case Isa::SSSE3:  return "SSSE3";
+    case Isa::AVX2:   return "AVX2";
+    }
+    return "?";
+}
+
+bool setIsa(Isa isa)
+{
+    if (!isSupported(isa))
+        return false;
+    getKernels() = getKernelsFor(isa);
+    return true;
+}
+
+} // namespace PixelConv
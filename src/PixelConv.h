@@ -0,0 +1,53 @@
+#pragma once
+
+#include <cstdint>
+
+/*
+ * Pixel format conversion, comparison and hashing kernels.
+ *
+ * The source is always BGRX (the format of the screenshots), `count` is the number of pixels.
+ * An SSE2, SSSE3 or AVX2 implementation is chosen at runtime depending on the CPU,
+ * with a scalar fallback.
+ */
+namespace PixelConv
+{
+
+enum class Isa
+{
+    Scalar,
+    SSE2,
+    SSSE3,
+    AVX2,
+};
+
+// BGRX -> RGB, 3 bytes per pixel
+void bgrxToRgb(const uint8_t* src, uint8_t* dst, int count);
+// BGRX -> RGBA with alpha set to 255
+void bgrxToRgba(const uint8_t* src, uint8_t* dst, int count);
+// BGRX -> BGR, 3 bytes per pixel
+void bgrxToBgr(const uint8_t* src, uint8_t* dst, int count);
+// Sets the X byte of BGRX pixels to 255 in place
+void fillAlpha(uint8_t* data, int count);
+// BGRX -> BGRA with alpha set to 255: a copy that also does `fillAlpha()`
+void bgrxToBgra(const uint8_t* src, uint8_t* dst, int count);
+/*
+ * Compares two rows of BGRX pixels. A pixel differs if any of its B, G or R bytes differs by more
+ * than the corresponding byte of `tolerance` (a BGRX value, X is ignored).
+ * Sets `mask[i]` to 1 for differing pixels and 0 for the others, returns the number of differing pixels.
+ */
+int diffPixels(const uint8_t* a, const uint8_t* b, uint8_t* mask, int count, uint32_t tolerance);
+
+constexpr int HASH_LANE_COUNT = 8;
+/*
+ * Adds pixels to the `HASH_LANE_COUNT` accumulators of a hash in `acc`, 16 pixels at a time,
+ * the last `count%16` pixels are not read. `blockIndex` is the index of the first 16 pixels
+ * in the hashed image, so moving pixels changes the hash. Every ISA gives the same result.
+ */
+void hashPixels(const uint8_t* data, int count, uint64_t* acc, uint64_t blockIndex);
+
+Isa getIsa();
+const char* getIsaName(Isa isa);
+// Returns false if the CPU does not support `isa`. Used by the benchmarks.
+bool setIsa(Isa isa);
+
+} // namespace PixelConv
@@ -0,0 +1,358 @@
+#include "PngEncoder.h"
+#include "Trace.h"
+#include "PixelConv.h"
+#include <zlib.h>
+#include <thread>
+#include <stdexcept>
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
+#include <exception>
+#include <system_error>
+#include <cassert>
+
+#define PNG_BPP 3 // RGB
+
+static constexpr uint8_t pngSignature[] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+
+static void putU32BE(uint8_t* dst, uint32_t val)
+{
+    dst[0] = val >> 24;
+    dst[1] = val >> 16;
+    dst[2] = val >> 8;
+    dst[3] = val;
+}
+
+static void writeChunk(const writeFun_t& write, const char* type, const uint8_t* data, uint32_t size)
+{
+    uint8_t header[8];
+    putU32BE(header, size);
+    std::memcpy(header+4, type, 4);
+    uint32_t crc = crc32(0, header+4, 4);
+    if (size)
+        crc = crc32(crc, data, size);
+    uint8_t footer[4];
+    putU32BE(footer, crc);
+
+    write(header, sizeof(header));
+    write(data, size);
+    write(footer, sizeof(footer));
+}
+
+static inline uint8_t paethPredictor(int a, int b, int c)
+{
+    const int p = a+b-c;
+    const int pa = std::abs(p-a);
+    const int pb = std::abs(p-b);
+    const int pc = std::abs(p-c);
+    if (pa <= pb && pa <= pc)
+        return a;
+    if (pb <= pc)
+        return b;
+    return c;
+}
+
+/*
+ * Filters `cur` into `dst` (without the filter type byte).
+ * `prev` is the unfiltered previous row, or a row of zeros for the first row of the image.
+ */
+static void filterRow(PngEncoder::Filter filter, const uint8_t* cur, const uint8_t* prev, uint8_t* dst, int rowLen)
+{
+    switch (filter)
+    {
+    case PngEncoder::Filter::NoFilter:
+        std::memcpy(dst, cur, rowLen);
+        break;
+
+    case PngEncoder::Filter::Sub:
+        std::memcpy(dst, cur, PNG_BPP);
+        for (int i{PNG_BPP}; i < rowLen; ++i)
+            dst[i] = cur[i]-cur[i-PNG_BPP];
+        break;
+
+    case PngEncoder::Filter::Up:
+        for (int i{}; i < rowLen; ++i)
+            dst[i] = cur[i]-prev[i];
+        break;
+
+    case PngEncoder::Filter::Average:
+        for (int i{}; i < PNG_BPP; ++i)
+            dst[i] = cur[i]-(prev[i]>>1);
+        for (int i{PNG_BPP}; i < rowLen; ++i)
+            dst[i] = cur[i]-((cur[i-PNG_BPP]+prev[i])>>1);
+        break;
+
+    case PngEncoder::Filter::Paeth:
+        for (int i{}; i < PNG_BPP; ++i)
+            dst[i] = cur[i]-prev[i];
+        for (int i{PNG_BPP}; i < rowLen; ++i)
+            dst[i] = cur[i]-paethPredictor(cur[i-PNG_BPP], prev[i], prev[i-PNG_BPP]);
+        break;
+
+    case PngEncoder::Filter::Adaptive:
+        assert(false); // Handled by the caller
+        break;
+    }
+}
+
+// Sum of the filtered bytes as signed values, the heuristic libpng uses to choose a filter
+static uint64_t filteredRowCost(const uint8_t* row, int rowLen)
+{
+    uint64_t sum{};
+    for (int i{}; i < rowLen; ++i)
+        sum += std::abs((int)(int8_t)row[i]);
+    return sum;
+}
+
+static void deflateChecked(z_stream* stream, int flush, std::vector<uint8_t>* out)
+{
+    do
+    {
+        if (out->capacity()-out->size() < 4096)
+            out->reserve(std::max<size_t>(out->capacity()*2, 64*1024));
+        const size_t oldSize = out->size();
+        out->resize(out->capacity());
+        stream->next_out = out->data()+oldSize;
+        stream->avail_out = out->size()-oldSize;
+
+        const int ret = deflate(stream, flush);
+        out->resize(out->size()-stream->avail_out);
+        if (ret == Z_STREAM_ERROR)
+            throw std::runtime_error{"Failed to compress image data"};
+        if (ret == Z_STREAM_END)
+            break;
+    } while (stream->avail_out == 0 || stream->avail_in != 0);
+}
+
+PngEncoder::PngEncoder()
+    : PngEncoder{Options{}}
+{
+}
+
+PngEncoder::PngEncoder(const Options& opts)
+    : m_opts{opts}
+{
+    assert(m_opts.compLevel >= 0 && m_opts.compLevel <= 9);
+    if (m_opts.threadCount <= 0)
+        m_opts.threadCount = std::max(1u, std::thread::hardware_concurrency());
+}
+
+void PngEncoder::encodeStripe(const ImageView& img, Stripe* stripe, bool isFirst, bool isLast) const
+{
+    TRACE_SCOPE("png_stripe");
+
+    const int rowLen = img.width*PNG_BPP;
+
+    stripe->compressed.clear();
+    if (isFirst)
+    {
+        // zlib header: deflate with 32K window, level hint as libpng writes it
+        const uint8_t cmf = 0x78;
+        const int compLevel = m_opts.compLevel;
+        uint8_t flg = (compLevel < 2 ? 0 : compLevel < 6 ? 1 : compLevel == 6 ? 2 : 3) << 6;
+        flg += 31-((cmf*256+flg)%31);
+        stripe->compressed.push_back(cmf);
+        stripe->compressed.push_back(flg);
+    }
+
+    z_stream stream{};
+    int ret = deflateInit2(&stream, m_opts.compLevel, Z_DEFLATED, -15 /* raw deflate */, 8,
+            m_opts.filter == Filter::NoFilter ? Z_DEFAULT_STRATEGY : Z_FILTERED);
+    if (ret != Z_OK)
+        throw std::runtime_error{"Failed to initialize zlib"};
+
+    std::vector<uint8_t> prevRow(rowLen);
+    std::vector<uint8_t> curRow(rowLen);
+    // Filter type byte + filtered row, one for each filter when choosing adaptively
+    const int candidateCount = m_opts.filter == Filter::Adaptive ? 5 : 1;
+    std::vector<uint8_t> filtered((rowLen+1)*candidateCount);
+
+    // The first row of a stripe is filtered against the last row of the previous one
+    if (stripe->fromY > 0)
+        PixelConv::bgrxToRgb(img.getRow(stripe->fromY-1), prevRow.data(), img.width);
+
+    uint32_t adler = adler32(0, nullptr, 0);
+    for (int y{stripe->fromY}; y < stripe->toY; ++y)
+    {
+        PixelConv::bgrxToRgb(img.getRow(y), curRow.data(), img.width);
+
+        uint8_t* outRow = filtered.data();
+        if (m_opts.filter == Filter::Adaptive)
+        {
+            uint64_t bestCost = UINT64_MAX;
+            for (int i{}; i < candidateCount; ++i)
+            {
+                uint8_t* candidate = filtered.data()+i*(rowLen+1);
+                candidate[0] = i;
+                filterRow((Filter)i, curRow.data(), prevRow.data(), candidate+1, rowLen);
+                const uint64_t cost = filteredRowCost(candidate+1, rowLen);
+                if (cost < bestCost)
+                {
+                    bestCost = cost;
+                    outRow = candidate;
+                }
+            }
+        }
+        else
+        {
+            outRow[0] = (uint8_t)m_opts.filter;
+            filterRow(m_opts.filter, curRow.data(), prevRow.data(), outRow+1, rowLen);
+        }
+
+        adler = adler32(adler, outRow, rowLen+1);
+        stream.next_in = outRow;
+        stream.avail_in = rowLen+1;
+        deflateChecked(&stream, Z_NO_FLUSH, &stripe->compressed);
+
+        std::swap(prevRow, curRow);
+    }
+
+    // The last stripe terminates the deflate stream, the others end on a byte boundary
+    // so the next stripe's stream can be appended to them
+    deflateChecked(&stream, isLast ? Z_FINISH : Z_SYNC_FLUSH, &stripe->compressed);
+    deflateEnd(&stream);
+
+    stripe->adler = adler;
+    stripe->crc = crc32(crc32(0, (const uint8_t*)"IDAT", 4), stripe->compressed.data(), stripe->compressed.size());
+}
+
+void PngEncoder::encode(const ImageView& img, const writeFun_t& write)
+{
+    assert(img.data);
+    assert(img.width > 0 && img.height > 0);
+
+    // --- Write header ---
+
+    write(pngSignature, sizeof(pngSignature));
+
+    uint8_t ihdr[13]{};
+    putU32BE(ihdr+0, img.width);
+    putU32BE(ihdr+4, img.height);
+    ihdr[8] = 8; // Bit depth
+    ihdr[9] = 2; // Color type: RGB
+    ihdr[10] = 0; // Compression method: deflate
+    ihdr[11] = 0; // Filter method: adaptive
+    ihdr[12] = 0; // Interlace method: none
+    writeChunk(write, "IHDR", ihdr, sizeof(ihdr));
+
+    const int stripeCount = m_opts.stripeHeight > 0
+        ? (img.height+m_opts.stripeHeight-1)/m_opts.stripeHeight
+        : std::min(m_opts.threadCount, img.height);
+    auto getStripeY = [&](int i){
+        if (m_opts.stripeHeight > 0)
+            return std::min(i*m_opts.stripeHeight, img.height);
+        return (int)((int64_t)img.height*i/stripeCount);
+    };
+
+    // Stripes are encoded in batches of `threadCount`, each batch is written before the next one
+    const int batchSize = std::min(m_opts.threadCount, stripeCount);
+    m_stripes.resize(batchSize);
+    uint32_t adler = adler32(0, nullptr, 0);
+    for (int first{}; first < stripeCount; first += batchSize)
+    {
+        const int count = std::min(batchSize, stripeCount-first);
+        const bool isLastBatch = first+count == stripeCount;
+
+        // --- Encode stripes ---
+
+        for (int i{}; i < count; ++i)
+        {
+            m_stripes[i].fromY = getStripeY(first+i);
+            m_stripes[i].toY = getStripeY(first+i+1);
+        }
+
+        std::vector<std::thread> threads;
+        threads.reserve(count-1);
+        std::vector<std::exception_ptr> errors(count);
+        auto runStripe = [&](int i){
+            try
+            {
+                encodeStripe(img, &m_stripes[i], first+i == 0, isLastBatch && i == count-1);
+            }
+            catch (...)
+            {
+                errors[i] = std::current_exception();
+            }
+        };
+        // If a thread can't be started, the calling thread does the stripes from there on
+        int inlineFrom = count;
+        for (int i{1}; i < count; ++i)
+        {
+            try
+            {
+                threads.emplace_back(runStripe, i);
+            }
+            catch (const std::system_error&)
+            {
+                inlineFrom = i;
+                break;
+            }
+        }
+        runStripe(0); // Use the calling thread too
+        for (int i{inlineFrom}; i < count; ++i)
+            runStripe(i);
+        for (auto& thread : threads)
+            thread.join();
+        for (const auto& error : errors)
+        {
+            if (error)
+                std::rethrow_exception(error);
+        }
+
+        // --- Combine checksums ---
+
+        for (int i{}; i < count; ++i)
+        {
+            const z_off_t len = (z_off_t)(m_stripes[i].toY-m_stripes[i].fromY)*(img.width*PNG_BPP+1);
+            adler = adler32_combine(adler, m_stripes[i].adler, len);
+        }
+        if (isLastBatch)
+        {
+            // Append the zlib trailer to the last chunk and update its CRC
+            Stripe& last = m_stripes[count-1];
+            uint8_t trailer[4];
+            putU32BE(trailer, adler);
+            last.compressed.insert(last.compressed.end(), trailer, trailer+4);
+            last.crc = crc32_combine(last.crc, crc32(0, trailer, 4), 4);
+        }
+
+        // --- Write chunks ---
+
+        for (int i{}; i < count; ++i)
+        {
+            const Stripe& stripe = m_stripes[i];
+            assert(stripe.compressed.size() < INT32_MAX);
+            uint8_t header[8];
+            putU32BE(header, stripe.compressed.size());
+            std::memcpy(header+4, "IDAT", 4);
+            uint8_t footer[4];
+            putU32BE(footer, stripe.crc);
+
+            write(header, sizeof(header));
+            write(stripe.compressed.data(), stripe.compressed.size());
+            write(footer, sizeof(footer));
+        }
+    }
+
+    writeChunk(write, "IEND", nullptr, 0);
+}
+
+EncodedBuffer PngEncoder::encodeToBuffer(const ImageView& img)
+{
+    auto buffer = std::make_shared<std::vector<uint8_t>>();
+    encode(img, [&buffer](const uint8_t* data, size_t size){
+        buffer->insert(buffer->end(), data, data+size);
+    });
+    return buffer;
+}
+
+void PngEncoder::encodeToFile(const ImageView& img, const std::string& filename, bool sync)
+{
+    OutputFile file{filename};
+    encode(img, [&file](const uint8_t* data, size_t size){
+        file.write(data, size);
+    });
+    if (sync)
+        file.sync();
+    file.close();
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include "ImageView.h"
+#include "Output.h"
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <vector>
+
+/*
+ * Multi-threaded PNG encoder.
+ *
+ * The image is split into horizontal stripes, each stripe is filtered and deflated
+ * on its own thread as an independent raw deflate stream ending with a sync flush.
+ * The streams are then joined into one zlib stream (one IDAT chunk per stripe),
+ * the Adler-32 checksums of the stripes are combined into the zlib trailer.
+ *
+ * With `Options::stripeHeight` set, the stripes are encoded `threadCount` at a time and
+ * written out before the next ones are started, so memory use does not grow with the image.
+ */
+class PngEncoder
+{
+public:
+    enum class Filter
+    {
+        NoFilter,
+        Sub,
+        Up,
+        Average,
+        Paeth,
+        Adaptive, // Choose the best filter for each row, like libpng does
+    };
+
+    struct Options
+    {
+        // zlib compression level (0-9)
+        int compLevel{6};
+        Filter filter{Filter::Adaptive};
+        // Number of stripes encoded in parallel, 0 means one per CPU core
+        int threadCount{};
+        // Rows per stripe, 0 means one stripe per thread.
+        // Every stripe starts a new deflate stream, so small stripes compress worse.
+        int stripeHeight{};
+    };
+
+private:
+    struct Stripe
+    {
+        int fromY{};
+        int toY{};
+        // Compressed data, including the zlib header for the first stripe
+        std::vector<uint8_t> compressed;
+        uint32_t adler{};
+        uint32_t crc{};
+    };
+
+    Options m_opts;
+    // The stripes being encoded at the same time.
+    // Kept between `encode()` calls to avoid reallocating the buffers.
+    std::vector<Stripe> m_stripes;
+
+    void encodeStripe(const ImageView& img, Stripe* stripe, bool isFirst, bool isLast) const;
+
+public:
+    PngEncoder();
+    PngEncoder(const Options& opts);
+
+    inline const Options& getOptions() const { return m_opts; }
+
+    // Writes each batch of stripes as soon as it is encoded
+    void encode(const ImageView& img, const writeFun_t& write);
+    EncodedBuffer encodeToBuffer(const ImageView& img);
+    // If `sync` is true, returns only after the file is durably stored
+    void encodeToFile(const ImageView& img, const std::string& filename, bool sync=false);
+};
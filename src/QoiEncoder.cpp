@@ -0,0 +1,160 @@
+#include "QoiEncoder.h"
+#include "FramePool.h"
+#include <vector>
+#include <memory>
+#include <cstdint>
+#include <cstring>
+
+#define QOI_OP_INDEX 0x00
+#define QOI_OP_DIFF  0x40
+#define QOI_OP_LUMA  0x80
+#define QOI_OP_RUN   0xc0
+#define QOI_OP_RGB   0xfe
+
+#define QOI_HEADER_SIZE 14
+#define QOI_MAX_RUN 62
+
+// The streaming encoder writes when this much is buffered
+#define QOI_STREAM_CHUNK_SIZE (256*1024)
+
+static const uint8_t qoiEndMarker[8] = {0, 0, 0, 0, 0, 0, 0, 1};
+
+static inline void putU32BE(uint8_t* out, uint32_t val)
+{
+    out[0] = val >> 24;
+    out[1] = val >> 16;
+    out[2] = val >> 8;
+    out[3] = val;
+}
+
+// Carried from row to row, runs can continue on the next row
+struct QoiState
+{
+    uint32_t index[64]{};
+    uint32_t prev{0xff000000};
+    int run{};
+};
+
+static uint8_t* writeQoiHeader(const ImageView& img, uint8_t* p)
+{
+    std::memcpy(p, "qoif", 4);
+    putU32BE(p+4, img.width);
+    putU32BE(p+8, img.height);
+    p[12] = 3; // Channels
+    p[13] = 0; // sRGB with linear alpha
+    return p+QOI_HEADER_SIZE;
+}
+
+// Writes at most `width*4+1` bytes (the run of the previous row ends here), returns the end of the written data
+static uint8_t* encodeQoiRow(const uint8_t* row, int width, QoiState* state, uint8_t* p)
+{
+    // Pixels are compared as BGRX words with X forced to 255, which is the alpha of the stream
+    uint32_t* index = state->index;
+    uint32_t prev = state->prev;
+    int run = state->run;
+    for (int x{}; x < width; ++x)
+    {
+        uint32_t px;
+        std::memcpy(&px, row+x*4, 4);
+        px |= 0xff000000;
+
+        if (px == prev)
+        {
+            if (++run == QOI_MAX_RUN)
+            {
+                *p++ = QOI_OP_RUN | (run-1);
+                run = 0;
+            }
+            continue;
+        }
+        if (run)
+        {
+            *p++ = QOI_OP_RUN | (run-1);
+            run = 0;
+        }
+
+        const uint8_t b = px;
+        const uint8_t g = px >> 8;
+        const uint8_t r = px >> 16;
+        const int hash = (r*3+g*5+b*7+255*11)%64;
+        if (index[hash] == px)
+        {
+            *p++ = QOI_OP_INDEX | hash;
+        }
+        else
+        {
+            index[hash] = px;
+
+            const int8_t dr = r-(uint8_t)(prev >> 16);
+            const int8_t dg = g-(uint8_t)(prev >> 8);
+            const int8_t db = b-(uint8_t)prev;
+            const int8_t drDg = dr-dg;
+            const int8_t dbDg = db-dg;
+            if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 && db <= 1)
+            {
+                *p++ = QOI_OP_DIFF | (dr+2) << 4 | (dg+2) << 2 | (db+2);
+            }
+            else if (dg >= -32 && dg <= 31 && drDg >= -8 && drDg <= 7 && dbDg >= -8 && dbDg <= 7)
+            {
+                *p++ = QOI_OP_LUMA | (dg+32);
+                *p++ = (drDg+8) << 4 | (dbDg+8);
+            }
+            else
+            {
+                *p++ = QOI_OP_RGB;
+                *p++ = r;
+                *p++ = g;
+                *p++ = b;
+            }
+        }
+        prev = px;
+    }
+    state->prev = prev;
+    state->run = run;
+    return p;
+}
+
+// Ends the pending run and writes the end marker
+static uint8_t* finishQoi(const QoiState& state, uint8_t* p)
+{
+    if (state.run)
+        *p++ = QOI_OP_RUN | (state.run-1);
+    std::memcpy(p, qoiEndMarker, sizeof(qoiEndMarker));
+    return p+sizeof(qoiEndMarker);
+}
+
+EncodedBuffer encodeQoi(const ImageView& img)
+{
+    // Worst case is a QOI_OP_RGB for every pixel.
+    // Reused between frames, only the encoded part is copied out.
+    PooledBuffer buff{FramePool::getDefault().acquire(QOI_HEADER_SIZE+(size_t)img.width*img.height*4+sizeof(qoiEndMarker))};
+    uint8_t* p = writeQoiHeader(img, buff.get());
+
+    QoiState state;
+    for (int y{}; y < img.height; ++y)
+        p = encodeQoiRow(img.getRow(y), img.width, &state, p);
+    p = finishQoi(state, p);
+
+    return std::make_shared<const std::vector<uint8_t>>(buff.get(), p);
+}
+
+void encodeQoi(const ImageView& img, const writeFun_t& write)
+{
+    // Room for the worst case of one more row after the threshold is reached, and the end
+    const size_t rowMaxSize = (size_t)img.width*4+1;
+    std::unique_ptr<uint8_t[]> buff{new uint8_t[QOI_STREAM_CHUNK_SIZE+rowMaxSize+1+sizeof(qoiEndMarker)]};
+    uint8_t* p = writeQoiHeader(img, buff.get());
+
+    QoiState state;
+    for (int y{}; y < img.height; ++y)
+    {
+        p = encodeQoiRow(img.getRow(y), img.width, &state, p);
+        if ((size_t)(p-buff.get()) >= QOI_STREAM_CHUNK_SIZE)
+        {
+            write(buff.get(), p-buff.get());
+            p = buff.get();
+        }
+    }
+    p = finishQoi(state, p);
+    write(buff.get(), p-buff.get());
+}
@@ -0,0 +1,15 @@
+#pragma once
+
+#include "ImageView.h"
+#include "Output.h"
+
+/*
+ * QOI ("Quite OK Image") encoder, see https://qoiformat.org/qoi-specification.pdf
+ *
+ * Lossless like PNG, but a single pass over the pixels with no entropy coding,
+ * so it is many times faster to encode at a somewhat larger size.
+ * The image is written with 3 channels, as the captures have no alpha.
+ */
+EncodedBuffer encodeQoi(const ImageView& img);
+// Calls `write` with consecutive pieces of the file, buffering at most a few hundred KiB
+void encodeQoi(const ImageView& img, const writeFun_t& write);
@@ -0,0 +1,208 @@
+#include "Recorder.h"
+#include "ImageConv.h"
+#include "Output.h"
+#include "Trace.h"
+#include <signal.h>
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+#include <filesystem>
+#include <ctime>
+#include <vector>
+#include <algorithm>
+#include <stdexcept>
+#include <cstring>
+
+// Bands of changed rows closer than this are fetched with one request
+#define ROW_BAND_MERGE_GAP 16
+
+static volatile sig_atomic_t s_stopRequested = 0;
+
+static void stopSignalHandler(int)
+{
+    s_stopRequested = 1;
+}
+
+/*
+ * Sleeps until `time`, returns early when SIGINT or SIGTERM arrives.
+ * `std::this_thread::sleep_until()` can't be used, it continues sleeping after a signal handler ran.
+ */
+static void sleepUntil(Recorder::clock_t::time_point time)
+{
+    // `steady_clock` is CLOCK_MONOTONIC on Linux
+    const auto sinceEpoch = time.time_since_epoch();
+    const auto secs = std::chrono::duration_cast<std::chrono::seconds>(sinceEpoch);
+    const timespec ts{(time_t)secs.count(), (long)std::chrono::duration_cast<std::chrono::nanoseconds>(sinceEpoch-secs).count()};
+    while (!s_stopRequested && clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, nullptr) == EINTR)
+        ; // Interrupted by another signal
+}
+
+static bool isFrameStorePath(const std::string& path)
+{
+    const size_t extLen = std::strlen(FRAME_STORE_EXTENSION);
+    return path.size() > extLen && path.compare(path.size()-extLen, extLen, FRAME_STORE_EXTENSION) == 0;
+}
+
+Recorder::Recorder(Display* disp, const Options& opts)
+    : m_disp{disp}, m_rootWin{XDefaultRootWindow(disp)}, m_opts{opts}
+{
+    // Before anything is created, the destructor doesn't run if this throws
+    if (!isFrameStorePath(m_opts.outputDir))
+        Codec::checkLevel(m_opts.format, m_opts.codecOpts.level);
+
+    int damageErrorBase;
+    if (!XDamageQueryExtension(m_disp, &m_damageEventBase, &damageErrorBase))
+        throw std::runtime_error{"The X server does not support the DAMAGE extension"};
+    int fixesEventBase, fixesErrorBase;
+    if (!XFixesQueryExtension(m_disp, &fixesEventBase, &fixesErrorBase))
+        throw std::runtime_error{"The X server does not support the XFIXES extension"};
+
+    m_frame = std::make_unique<ShmImage>(m_disp, m_opts.area.w, m_opts.area.h);
+
+    // One event when the damage becomes non-empty, the area is queried when a frame is due
+    m_damage = XDamageCreate(m_disp, m_rootWin, XDamageReportNonEmpty);
+    m_region = XFixesCreateRegion(m_disp, nullptr, 0);
+
+    const std::string& path = m_opts.outputDir;
+    if (isFrameStorePath(path))
+        m_store = std::make_unique<FrameStoreWriter>(path, m_opts.area.w, m_opts.area.h, FrameStoreWriter::Options{});
+    else
+        std::filesystem::create_directories(path);
+}
+
+bool Recorder::updateFrame()
+{
+    TRACE_SCOPE("update_frame");
+
+    bool isDamaged = false;
+    while (XPending(m_disp))
+    {
+        XEvent event;
+        XNextEvent(m_disp, &event);
+        if (event.type == m_damageEventBase+XDamageNotify)
+            isDamaged = true;
+    }
+    if (!isDamaged)
+        return false;
+
+    // Take the damage collected so far and reset it
+    XDamageSubtract(m_disp, m_damage, None, m_region);
+    int rectCount{};
+    XRectangle* rects = XFixesFetchRegion(m_disp, m_region, &rectCount);
+
+    // Row ranges [from, to) relative to the area
+    const WinGeometry& area = m_opts.area;
+    std::vector<std::pair<int, int>> bands;
+    for (int i{}; i < rectCount; ++i)
+    {
+        const XRectangle& rect = rects[i];
+        if (rect.x >= area.x+area.w || rect.x+rect.width <= area.x)
+            continue;
+        const int from = std::max<int>(rect.y, area.y)-area.y;
+        const int to = std::min<int>(rect.y+rect.height, area.y+area.h)-area.y;
+        if (to > from)
+            bands.emplace_back(from, to);
+    }
+    if (rects)
+        XFree(rects);
+    if (bands.empty())
+        return false;
+
+    std::sort(bands.begin(), bands.end());
+    std::vector<std::pair<int, int>> merged{bands[0]};
+    for (size_t i{1}; i < bands.size(); ++i)
+    {
+        if (bands[i].first <= merged.back().second+ROW_BAND_MERGE_GAP)
+            merged.back().second = std::max(merged.back().second, bands[i].second);
+        else
+            merged.push_back(bands[i]);
+    }
+
+    for (const auto& band : merged)
+    {
+        m_frame->captureRows(m_rootWin, area.x, area.y, band.first, band.second-band.first);
+        ImageConv::fillAlpha(m_frame->getData()+(size_t)band.first*m_frame->getBytesPerLine(),
+                area.w, band.second-band.first, m_frame->getBytesPerLine());
+    }
+    return true;
+}
+
+void Recorder::writeFrame(int slot)
+{
+    const ImageView view{m_frame->getData(), m_frame->getWidth(), m_frame->getHeight(), m_frame->getBytesPerLine()};
+    if (m_store)
+    {
+        m_store->addFrame(view, slot);
+        ++m_writtenCount;
+        return;
+    }
+
+    const EncodedBuffer encoded = Codec::encode(view, m_opts.format, m_opts.codecOpts);
+
+    std::ostringstream filename;
+    filename << m_opts.outputDir << '/' << std::setw(6) << std::setfill('0') << slot
+        << '.' << Codec::getFormatExtension(m_opts.format);
+    writeBufferToFile(encoded, filename.str());
+    ++m_writtenCount;
+}
+
+void Recorder::run()
+{
+    // The flag is checked when `sleepUntil()` is interrupted, and after each frame
+    struct sigaction action{};
+    action.sa_handler = stopSignalHandler;
+    sigaction(SIGINT, &action, nullptr);
+    sigaction(SIGTERM, &action, nullptr);
+
+    const clock_t::duration frameInterval = std::chrono::duration_cast<clock_t::duration>(
+            std::chrono::duration<double>(1.0/m_opts.fps));
+    const clock_t::time_point startTime = clock_t::now();
+    const clock_t::time_point endTime = startTime+std::chrono::duration_cast<clock_t::duration>(
+            std::chrono::duration<double>(m_opts.durationSecs));
+
+    // The first frame is a full capture, the damage since then is tracked
+    XDamageSubtract(m_disp, m_damage, None, None);
+    m_frame->capture(m_rootWin, m_opts.area.x, m_opts.area.y);
+    ImageConv::fillAlpha(m_frame->getData(), m_frame->getWidth(), m_frame->getHeight(), m_frame->getBytesPerLine());
+    writeFrame(0);
+
+    std::cerr << "Recording " << m_opts.area.w << 'x' << m_opts.area.h << " at " << m_opts.fps
+        << " fps to \"" << m_opts.outputDir << "\", press Ctrl+C to stop\n";
+
+    int slot = 1;
+    while (!s_stopRequested)
+    {
+        const clock_t::time_point slotTime = startTime+slot*frameInterval;
+        if (m_opts.durationSecs > 0 && slotTime >= endTime)
+            break;
+        sleepUntil(slotTime);
+        if (s_stopRequested)
+            break;
+
+        if (updateFrame())
+            writeFrame(slot);
+        else
+            ++m_unchangedCount;
+
+        // If this frame took too long, continue with the current slot
+        const int nextSlot = (clock_t::now()-startTime)/frameInterval+1;
+        if (nextSlot > slot+1)
+            m_droppedCount += nextSlot-(slot+1);
+        slot = std::max(slot+1, nextSlot);
+    }
+
+    const double secs = std::chrono::duration<double>(clock_t::now()-startTime).count();
+    std::cerr << "Recorded " << secs << " s: " << m_writtenCount << " frames written, "
+        << m_unchangedCount << " unchanged, " << m_droppedCount << " dropped\n";
+    if (m_store)
+    {
+        std::cerr << "Frame store: " << m_store->getKeyframeCount() << " keyframes, "
+            << m_store->getStoredTileCount() << " tiles, " << m_store->getFileSize() << " bytes\n";
+    }
+}
+
+Recorder::~Recorder()
+{
+    XFixesDestroyRegion(m_disp, m_region);
+    XDamageDestroy(m_disp, m_damage);
+}
@@ -0,0 +1,76 @@
+#pragma once
+
+#include "Screenshot.h"
+#include "ShmImage.h"
+#include "Codec.h"
+#include "FrameStore.h"
+#include <X11/Xlib.h>
+#include <X11/extensions/Xfixes.h>
+#include <X11/extensions/Xdamage.h>
+#include <string>
+#include <memory>
+#include <chrono>
+
+/*
+ * Continuous capture of an area of the screen at a fixed frame rate.
+ *
+ * The area is captured once into a shared memory frame that is kept for the whole recording.
+ * After that, XDamage reports which parts of the screen changed, and only the rows containing
+ * them are fetched into the frame. If nothing changed since the last frame, the frame is skipped.
+ *
+ * Each frame is written to the output directory as `NNNNNN.EXT`, where NNNNNN is the index
+ * of the frame time slot (time*fps), so skipped frames leave gaps in the numbering and
+ * mean "same as the previous frame".
+ *
+ * If the output path ends with FRAME_STORE_EXTENSION, the frames are written to a single
+ * FrameStore file instead, with the slot index as the frame id.
+ */
+class Recorder
+{
+public:
+    using clock_t = std::chrono::steady_clock;
+
+    struct Options
+    {
+        WinGeometry area;
+        double fps{30};
+        // 0 means until SIGINT or SIGTERM
+        double durationSecs{};
+        std::string outputDir;
+        Codec::Format format{Codec::Format::QOI};
+        // Not used by frame stores
+        Codec::Options codecOpts;
+    };
+
+private:
+    Display* m_disp{};
+    Window m_rootWin{};
+    Options m_opts;
+    std::unique_ptr<ShmImage> m_frame;
+    // Set if recording to a frame store
+    std::unique_ptr<FrameStoreWriter> m_store;
+
+    int m_damageEventBase{};
+    Damage m_damage{};
+    // Receives the damaged area
+    XserverRegion m_region{};
+
+    int m_writtenCount{};
+    int m_unchangedCount{};
+    // Slots missed because capturing and writing took longer than a frame
+    int m_droppedCount{};
+
+    // Fetches the changed rows into the frame, returns false if nothing changed
+    bool updateFrame();
+    void writeFrame(int slot);
+
+public:
+    // `opts.area` must be inside the screen
+    Recorder(Display* disp, const Options& opts);
+    Recorder(const Recorder&) = delete;
+    Recorder& operator=(const Recorder&) = delete;
+
+    void run();
+
+    ~Recorder();
+};
@@ -1,204 +1,268 @@
 #include "Screenshot.h"
+#include "ImageConv.h"
+#include "Clipboard.h"
+#include "Output.h"
+#include "Trace.h"
+#include "FramePool.h"
 #include <iostream>
-#include <libpng/png.h>
-#include <sys/shm.h>
-#include <sys/ipc.h>
-#include <fstream>
+#include <vector>
 #include <errno.h>
 #include <cstring>
 #include <cassert>
+#include <algorithm>
+#include <stdexcept>
 #include <memory.h>
 
-extern bool g_isDisplayOpen;
-
 Screenshot::Screenshot(Display* disp)
 {
-    Screen* screen = XDefaultScreenOfDisplay(disp);
-    const int screeni = XDefaultScreen(disp);
-
-    const Window win = XRootWindowOfScreen(screen);
+    const Window win = XDefaultRootWindow(disp);
 
     // Get root window info
     XWindowAttributes attrs{};
     Status rets = XGetWindowAttributes(disp, win, &attrs);
     assert(rets);
+    (void)rets;
 
-    XShmSegmentInfo* shmInfo = new XShmSegmentInfo{};
-
-    XImage* img = XShmCreateImage(
-            disp, // Display
-            DefaultVisual(disp, screeni), // Visual (display format)
-            DefaultDepthOfScreen(screen), // Depth
-            ZPixmap, // Format
-            nullptr, // Data
-            shmInfo, // shminfo
-            attrs.width, // width
-            attrs.height // height
-    );
-
-    // Create a shared memory buffer
-    shmInfo->shmid = shmget(IPC_PRIVATE, img->bytes_per_line*img->height, IPC_CREAT|0777);
-    img->data = (char*)shmat(shmInfo->shmid, nullptr, 0);
-    shmInfo->shmaddr = img->data;
-    shmInfo->readOnly = false;
-
-    // Bind the buffer
-    Bool retb = XShmAttach(disp, shmInfo);
-    assert(retb);
-
-    // Copy the image from the root window to the image buffer
-    retb = XShmGetImage(disp, win, img, 0, 0, AllPlanes);
-    assert(retb);
-
-    m_width = img->width;
-    m_height = img->height;
-    m_bytesPerLine = img->bytes_per_line;
-    m_data = new uint8_t[m_bytesPerLine*m_height];
-    std::memcpy(m_data, img->data, m_bytesPerLine*m_height);
-
-    for (int i{}; i < m_width*m_height; ++i)
-    {
-        // Set alpha to 255
-        m_data[i*BYTES_PER_PIXEL+3] = 255;
-    }
-
-    // Unbind the shared buffer
-    XShmDetach(disp, shmInfo);
-    shmdt(shmInfo->shmaddr);
-    // Delete the shared buffer
-    shmctl(shmInfo->shmid, IPC_RMID, 0);
-    delete shmInfo;
+    ShmImage* img = new ShmImage{disp, attrs.width, attrs.height};
+    img->capture(win, 0, 0);
+    initFromShmImage(img, nullptr);
 }
 
-void Screenshot::writeToPPMFile(const std::string& filename) const
+WinGeometry clipToRootWin(Display* disp, const WinGeometry& geom)
 {
-    assert(m_data);
+    XWindowAttributes attrs{};
+    Status rets = XGetWindowAttributes(disp, XDefaultRootWindow(disp), &attrs);
+    assert(rets);
+    (void)rets;
 
-    std::fstream file;
-    file.open(filename, std::ios_base::out|std::ios_base::binary);
-    if (!file.is_open())
+    const int x1 = std::max(geom.x, 0);
+    const int y1 = std::max(geom.y, 0);
+    const int x2 = std::min(geom.x+geom.w, attrs.width);
+    const int y2 = std::min(geom.y+geom.h, attrs.height);
+    if (x2 <= x1 || y2 <= y1)
     {
-        throw std::runtime_error{"Failed to write to file: \""+filename+"\": "+std::strerror(errno)};
+        throw std::runtime_error{"Capture area is outside of the screen"};
     }
+    return {x1, y1, x2-x1, y2-y1};
+}
 
-    // Magic bytes
-    file.write("P6\n", 3);
+Screenshot::Screenshot(Display* disp, const WinGeometry& geom)
+{
+    const WinGeometry clipped = clipToRootWin(disp, geom);
+
+    // Only transfer the needed area from the server
+    ShmImage* img = new ShmImage{disp, clipped.w, clipped.h};
+    img->capture(XDefaultRootWindow(disp), clipped.x, clipped.y);
+    initFromShmImage(img, nullptr);
+}
+
+Screenshot::Screenshot(Display* disp, ShmPool* pool)
+{
+    ShmImage* img = pool->acquire();
+    img->capture(XDefaultRootWindow(disp), 0, 0);
+    initFromShmImage(img, pool);
+}
+
+Screenshot::Screenshot(Display* disp, ShmPool* pool, const WinGeometry& geom)
+{
+    const WinGeometry clipped = clipToRootWin(disp, geom);
 
-    const std::string widthStr = std::to_string(m_width) + "\n";
-    file.write(widthStr.c_str(), widthStr.length());
+    ShmImage* img = pool->acquire();
+    assert(clipped.w <= img->getMaxWidth() && clipped.h <= img->getMaxHeight());
+    img->capture(XDefaultRootWindow(disp), clipped.x, clipped.y, clipped.w, clipped.h);
+    initFromShmImage(img, pool);
+}
 
-    const std::string heightStr = std::to_string(m_height) + "\n";
-    file.write(heightStr.c_str(), heightStr.length());
+void Screenshot::initFromShmImage(ShmImage* img, ShmPool* pool)
+{
+    TRACE_SCOPE("alpha_fill");
+
+    // Set alpha to 255
+    ImageConv::fillAlpha(img->getData(), img->getWidth(), img->getHeight(), img->getBytesPerLine());
+
+    // Keep the shared buffer, it is freed in `destroy()`
+    m_shmImage = img;
+    m_pool = pool;
+    m_data = img->getData();
+    m_width = img->getWidth();
+    m_height = img->getHeight();
+    m_bytesPerLine = img->getBytesPerLine();
+}
 
-    // Max component value
-    file.write("255\n", 4);
+// Size of the buffer rows are converted into before writing them out
+#define WRITE_CHUNK_SIZE (1024*1024)
 
-    for (int i{}; i < getPixelCount(); ++i)
+/*
+ * Writes `header` followed by the rows of `img` converted to `format`.
+ * Many rows are converted at once with `ImageConv::convert()` and written with a single call.
+ */
+static void writeConvertedImage(const std::string& filename, const std::string& header,
+        const ImageView& img, ImageConv::Format format, bool sync)
+{
+    TRACE_SCOPE("write_file");
+    OutputFile file{filename};
+    file.write(header.data(), header.size());
+
+    const size_t rowLen = (size_t)img.width*ImageConv::getBytesPerPixel(format);
+    const int rowsPerChunk = std::max<int>(1, WRITE_CHUNK_SIZE/rowLen);
+    std::vector<uint8_t> chunk(rowsPerChunk*rowLen);
+    for (int y{}; y < img.height; y += rowsPerChunk)
     {
-        const Screenshot::Pixel pxl = getPixel(i);
-        file.put(pxl.r);
-        file.put(pxl.g);
-        file.put(pxl.b);
+        const int rowCount = std::min(rowsPerChunk, img.height-y);
+        ImageConv::convert(img.getSubView(0, y, img.width, rowCount), chunk.data(), rowLen, format);
+        file.write(chunk.data(), rowCount*rowLen);
     }
+    if (sync)
+        file.sync();
     file.close();
 }
 
-void Screenshot::writeToPNGFile(const std::string& filename) const
+void Screenshot::writeToPPMFile(const std::string& filename, bool sync) const
 {
-    // --- Init ---
+    assert(m_data);
 
-    FILE* fp = fopen(filename.c_str(), "wb");
-    assert(fp);
+    writeConvertedImage(filename, Codec::getPpmHeader(m_width, m_height), getView(), ImageConv::Format::RGB, sync);
+}
 
-    png_structp pngPtr = png_create_write_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr);
-    assert(pngPtr);
+void Screenshot::writeToPAMFile(const std::string& filename, bool sync) const
+{
+    assert(m_data);
 
-    png_infop infoPtr = png_create_info_struct(pngPtr);
-    assert(infoPtr);
+    writeConvertedImage(filename, Codec::getPamHeader(m_width, m_height), getView(), ImageConv::Format::RGBA, sync);
+}
 
-    int ret = setjmp(png_jmpbuf(pngPtr));
-    assert(ret == 0);
+void Screenshot::writeToRawFile(const std::string& filename, bool sync) const
+{
+    assert(m_data);
 
-    png_init_io(pngPtr, fp);
+    uint8_t header[RAW_HEADER_SIZE]{};
+    fillRawHeader(m_width, m_height, header);
 
-    // --- Write header ---
+    // No conversion, the rows are written straight from the capture buffer
+    const size_t rowLen = (size_t)m_width*BYTES_PER_PIXEL;
+    std::vector<iovec> iov;
+    iov.push_back({header, sizeof(header)});
+    if (rowLen == (size_t)m_bytesPerLine)
+    {
+        iov.push_back({m_data, rowLen*m_height});
+    }
+    else
+    {
+        for (int y{}; y < m_height; ++y)
+            iov.push_back({m_data+(size_t)y*m_bytesPerLine, rowLen});
+    }
 
-    ret = setjmp(png_jmpbuf(pngPtr));
-    assert(ret == 0);
+    TRACE_SCOPE("write_file");
+    OutputFile file{filename};
+    file.writev(iov.data(), iov.size());
+    if (sync)
+        file.sync();
+    file.close();
+}
 
-    png_set_IHDR(pngPtr, infoPtr, m_width, m_height, 8,
-            PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_BASE,
-            PNG_FILTER_TYPE_BASE);
+void Screenshot::writeToPNGFile(const std::string& filename, const PngEncoder::Options& opts, bool sync) const
+{
+    assert(m_data);
 
-    png_write_info(pngPtr, infoPtr);
+    TRACE_SCOPE("encode");
+    PngEncoder encoder{opts};
+    encoder.encodeToFile(getView(), filename, sync);
+}
 
-    // --- Write data ---
+void Screenshot::writeToFile(const std::string& filename, Codec::Format format, const Codec::Options& opts, bool sync) const
+{
+    assert(m_data);
 
-    ret = setjmp(png_jmpbuf(pngPtr));
-    assert(ret == 0);
-    uint8_t* row = new uint8_t[m_width*3];
-    for (int y{}; y < m_height; ++y)
+    // The uncompressed formats are streamed to the file without building the whole output in memory
+    switch (format)
     {
-        // Copy data to temporary buffer without alpha and fix byte order
-        for (int x{}; x < m_width; ++x)
-        {
-            row[x*3+0] = m_data[y*m_bytesPerLine+x*4+2];
-            row[x*3+1] = m_data[y*m_bytesPerLine+x*4+1];
-            row[x*3+2] = m_data[y*m_bytesPerLine+x*4+0];
-        }
-        png_write_row(pngPtr, row);
+    case Codec::Format::PPM: writeToPPMFile(filename, sync); break;
+    case Codec::Format::PAM: writeToPAMFile(filename, sync); break;
+    case Codec::Format::Raw: writeToRawFile(filename, sync); break;
+    default: writeBufferToFile(encode(format, opts), filename, sync); break;
     }
-    delete[] row;
-
-    // --- End write ---
+}
 
-    ret = setjmp(png_jmpbuf(pngPtr));
-    assert(ret == 0);
-    png_write_end(pngPtr, infoPtr);
+EncodedBuffer Screenshot::encode(Codec::Format format, const Codec::Options& opts) const
+{
+    assert(m_data);
 
-    fclose(fp);
+    TRACE_SCOPE("encode");
+    return Codec::encode(getView(), format, opts);
 }
 
-void Screenshot::copyToClipboard() const
+void Screenshot::copyToClipboard(PendingClipboardPng* pendingPng) const
 {
     assert(m_data);
-    // TODO: Find a better way
 
-    // Write to a temporary file and use xclip to copy the file data to clipboard
-    writeToPNGFile("/tmp/sshot_img.png");
-    std::system("xclip -selection clipboard -t image/png /tmp/sshot_img.png");
+    TRACE_SCOPE("clipboard_fork");
+    ClipboardOwner::serveInBackground(getView(), pendingPng);
+}
+
+void Screenshot::putImage(Drawable drawable, GC gc) const
+{
+    // The segment holds the whole capture, a cropped or compacted image is not in it
+    assert(m_shmImage && m_data == m_shmImage->getData());
+
+    m_shmImage->put(drawable, gc, 0, 0);
 }
 
 void Screenshot::crop(int fromX, int fromY, int width, int height)
 {
+    assert(fromX >= 0);
+    assert(fromY >= 0);
     assert(width > 0);
     assert(height > 0);
     assert(fromX + width <= m_width);
     assert(fromY + height <= m_height);
+    TRACE_SCOPE("crop");
 
-    const int bytesPerLine = width*BYTES_PER_PIXEL;
-    uint8_t* buff = new uint8_t[height*bytesPerLine]{};
-    std::memset(buff, 100, height*bytesPerLine);
+    // Just narrow the view, the rows keep their original stride
+    m_data += (size_t)fromY*m_bytesPerLine+fromX*BYTES_PER_PIXEL;
+    m_width = width;
+    m_height = height;
+}
 
-    for (int yoffs{}; yoffs < height; ++yoffs)
-    {
-        std::memcpy(
-                buff+yoffs*bytesPerLine,
-                m_data+(fromY+yoffs)*m_bytesPerLine+fromX*BYTES_PER_PIXEL,
-                width*BYTES_PER_PIXEL);
-    }
+void Screenshot::compact()
+{
+    assert(m_data);
+
+    const int bytesPerLine = m_width*BYTES_PER_PIXEL;
+    if (bytesPerLine == m_bytesPerLine && !m_shmImage)
+        return; // Already tight and not shared
 
-    delete[] m_data;
+    TRACE_SCOPE("compact");
+    uint8_t* buff = FramePool::getDefault().acquire((size_t)m_height*bytesPerLine);
+    ImageConv::convert(getView(), buff, bytesPerLine, ImageConv::Format::BGRX);
+
+    freeData();
+    m_buffer = buff;
     m_data = buff;
-    m_width = width;
-    m_height = height;
     m_bytesPerLine = bytesPerLine;
 }
 
-void Screenshot::destroy()
+void Screenshot::freeData()
 {
-    delete[] m_data;
+    if (m_shmImage)
+    {
+        if (m_pool)
+            m_pool->release(m_shmImage);
+        else
+            delete m_shmImage;
+        m_shmImage = nullptr;
+        m_pool = nullptr;
+    }
+    else
+    {
+        FramePool::getDefault().release(m_buffer);
+    }
+    m_buffer = nullptr;
     m_data = nullptr;
+}
+
+void Screenshot::destroy()
+{
+    freeData();
     m_width = 0;
     m_height = 0;
     m_bytesPerLine = 0;
@@ -1,26 +1,62 @@
 #pragma once
 
 #include <X11/Xlib.h>
-#include <X11/extensions/XShm.h>
+#include "ShmImage.h"
+#include "ImageView.h"
+#include "PngEncoder.h"
+#include "Codec.h"
 #include <cstdint>
 #include <string>
 
 #define BYTES_PER_PIXEL 4
 
+struct WinGeometry
+{
+    int x{};
+    int y{};
+    int w{};
+    int h{};
+};
+
+// Throws if nothing is left of `geom` inside the root window
+WinGeometry clipToRootWin(Display* disp, const WinGeometry& geom);
+
+class PendingClipboardPng;
+
 class Screenshot
 {
 private:
+    // First pixel of the image. After cropping this points into the middle of the
+    // buffer and rows are `m_bytesPerLine` apart, not `m_width*BYTES_PER_PIXEL`.
     uint8_t* m_data{};
     int m_width{};
     int m_height{};
     int m_bytesPerLine{};
 
+    // Set when the data is a buffer from `FramePool::getDefault()` owned by this object
+    uint8_t* m_buffer{};
+    // Set when `m_data` points into a shared memory image.
+    // The image is owned by this object, or by `m_pool` if that is set.
+    ShmImage* m_shmImage{};
+    ShmPool* m_pool{};
+
+    void initFromShmImage(ShmImage* img, ShmPool* pool);
+    void freeData();
+
 public:
     Screenshot(Display* disp);
+    // Captures only the area `geom` of the root window, clipped to the screen
+    Screenshot(Display* disp, const WinGeometry& geom);
+    // Captures into an image borrowed from `pool`, it is given back in `destroy()`
+    Screenshot(Display* disp, ShmPool* pool);
+    Screenshot(Display* disp, ShmPool* pool, const WinGeometry& geom);
+    Screenshot(const Screenshot&) = delete;
+    Screenshot& operator=(const Screenshot&) = delete;
 
     inline int getWidth() const { return m_width; }
     inline int getHeight() const { return m_height; }
     inline int getPixelCount() const { return m_width*m_height; }
+    inline int getBytesPerLine() const { return m_bytesPerLine; }
 
     struct Pixel
     {
@@ -31,10 +67,11 @@ public:
 
     inline Pixel getPixel(int index) const
     {
+        const uint8_t* pxl = m_data + (index / m_width) * m_bytesPerLine + (index % m_width) * BYTES_PER_PIXEL;
         return {
-            (uint8_t)m_data[index * BYTES_PER_PIXEL + 2], // R
-            (uint8_t)m_data[index * BYTES_PER_PIXEL + 1], // G
-            (uint8_t)m_data[index * BYTES_PER_PIXEL + 0], // B
+            pxl[2], // R
+            pxl[1], // G
+            pxl[0], // B
         };
     }
 
@@ -43,11 +80,32 @@ public:
         return m_data;
     }
 
+    inline ImageView getView() const
+    {
+        return {m_data, m_width, m_height, m_bytesPerLine};
+    }
+
+    // Draws the uncropped capture to `drawable` at (0, 0) straight from the shared memory segment
+    void putImage(Drawable drawable, GC gc) const;
+
+    // Narrows the image to a sub-rectangle without copying, see `compact()`
     void crop(int fromX, int fromY, int width, int height);
+    // Copies the pixels to a tightly packed, page-aligned buffer owned by this object, see FramePool
+    void compact();
 
-    void writeToPPMFile(const std::string& filename) const;
-    void writeToPNGFile(const std::string& filename) const;
-    void copyToClipboard() const;
+    // If `sync` is true, the writers return only after the file is durably stored
+    void writeToPPMFile(const std::string& filename, bool sync=false) const;
+    // PAM (P7) with RGB_ALPHA tuples
+    void writeToPAMFile(const std::string& filename, bool sync=false) const;
+    // Raw BGRX pixels with a small header, see `RAW_MAGIC`
+    void writeToRawFile(const std::string& filename, bool sync=false) const;
+    void writeToPNGFile(const std::string& filename, const PngEncoder::Options& opts={}, bool sync=false) const;
+    void writeToFile(const std::string& filename, Codec::Format format, const Codec::Options& opts={}, bool sync=false) const;
+    // Encodes to memory, the result can be passed to multiple outputs
+    EncodedBuffer encode(Codec::Format format, const Codec::Options& opts={}) const;
+    // Starts a background process owning the clipboard, must be called when no other threads are running.
+    // The PNG encoded afterwards can be passed to it through `pendingPng`.
+    void copyToClipboard(PendingClipboardPng* pendingPng=nullptr) const;
 
     void destroy();
     ~Screenshot();
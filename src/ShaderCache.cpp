@@ -0,0 +1,172 @@
+#include "ShaderCache.h"
+#include "Output.h"
+#include <unistd.h>
+#include <iostream>
+#include <fstream>
+#include <filesystem>
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+#include <stdexcept>
+
+namespace ShaderCache
+{
+
+#define CACHE_MAGIC "SHOTPRG1"
+#define CACHE_MAGIC_SIZE 8
+
+/*
+ * File layout, integers are native endian (the binary only works on this machine anyway):
+ *   magic (8 bytes) | binary format (u32) | key size (u32) | key | program binary
+ */
+
+static bool isSupported()
+{
+    if (!GLEW_ARB_get_program_binary)
+        return false;
+    GLint formatCount{};
+    glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formatCount);
+    return formatCount > 0;
+}
+
+static std::string getGlString(GLenum name)
+{
+    const char* str = (const char*)glGetString(name);
+    return str ? str : "";
+}
+
+// The driver and the sources, stored in the file to rule out hash collisions
+static std::string getKey(const char* vertSource, const char* fragSource)
+{
+    std::string key = getGlString(GL_VENDOR)+'\n'+getGlString(GL_RENDERER)+'\n'+getGlString(GL_VERSION)+'\n';
+    key += vertSource;
+    key += '\0';
+    key += fragSource;
+    return key;
+}
+
+// FNV-1a
+static uint64_t hashKey(const std::string& key)
+{
+    uint64_t hash = 0xcbf29ce484222325;
+    for (const char c : key)
+    {
+        hash ^= (uint8_t)c;
+        hash *= 0x100000001b3;
+    }
+    return hash;
+}
+
+// Empty if there is no home directory
+static std::string getCacheDir()
+{
+    if (const char* cacheHome = getenv("XDG_CACHE_HOME"); cacheHome && *cacheHome)
+        return std::string(cacheHome)+"/shot/shaders";
+    if (const char* homeDir = getenv("HOME"))
+        return std::string(homeDir)+"/.cache/shot/shaders";
+    return "";
+}
+
+static std::string getCacheFilename(const std::string& key)
+{
+    const std::string dir = getCacheDir();
+    if (dir.empty())
+        return "";
+    char name[sizeof("0123456789abcdef.bin")]{};
+    std::snprintf(name, sizeof(name), "%016llx.bin", (unsigned long long)hashKey(key));
+    return dir+"/"+name;
+}
+
+GLuint loadProgram(const char* vertSource, const char* fragSource)
+{
+    if (!isSupported())
+        return 0;
+    const std::string key = getKey(vertSource, fragSource);
+    const std::string filename = getCacheFilename(key);
+    if (filename.empty())
+        return 0;
+
+    std::ifstream stream{filename, std::ios_base::binary};
+    if (!stream)
+        return 0; // Not cached yet
+    const std::vector<char> data{std::istreambuf_iterator<char>{stream}, std::istreambuf_iterator<char>{}};
+
+    const size_t headerSize = CACHE_MAGIC_SIZE+4+4;
+    if (data.size() < headerSize || std::memcmp(data.data(), CACHE_MAGIC, CACHE_MAGIC_SIZE) != 0)
+        return 0;
+    uint32_t format{};
+    uint32_t keySize{};
+    std::memcpy(&format, data.data()+CACHE_MAGIC_SIZE, 4);
+    std::memcpy(&keySize, data.data()+CACHE_MAGIC_SIZE+4, 4);
+    if (keySize != key.size() || data.size() <= headerSize+keySize
+     || std::memcmp(data.data()+headerSize, key.data(), keySize) != 0)
+        return 0;
+
+    const GLuint prog = glCreateProgram();
+    glProgramBinary(prog, format, data.data()+headerSize+keySize, data.size()-headerSize-keySize);
+    GLint linkStat{};
+    glGetProgramiv(prog, GL_LINK_STATUS, &linkStat);
+    if (linkStat != GL_TRUE)
+    {
+        // E.g. the driver changed without changing its version string, the entry is overwritten
+        glDeleteProgram(prog);
+        return 0;
+    }
+    return prog;
+}
+
+void prepareProgram(GLuint prog)
+{
+    if (isSupported())
+        glProgramParameteri(prog, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+}
+
+void storeProgram(GLuint prog, const char* vertSource, const char* fragSource)
+{
+    if (!isSupported())
+        return;
+    const std::string key = getKey(vertSource, fragSource);
+    const std::string filename = getCacheFilename(key);
+    if (filename.empty())
+        return;
+
+    GLint binarySize{};
+    glGetProgramiv(prog, GL_PROGRAM_BINARY_LENGTH, &binarySize);
+    if (binarySize <= 0)
+        return;
+    std::vector<uint8_t> binary(binarySize);
+    GLenum format{};
+    glGetProgramBinary(prog, binarySize, &binarySize, &format, binary.data());
+    if (binarySize <= 0)
+        return;
+
+    // Written to a temporary file first, so concurrent launches never read half an entry
+    const std::string tempFilename = filename+".tmp"+std::to_string(getpid());
+    try
+    {
+        std::error_code error;
+        std::filesystem::create_directories(getCacheDir(), error);
+        if (error)
+            throw std::runtime_error{"Failed to create \""+getCacheDir()+"\": "+error.message()};
+
+        const uint32_t header[2] = {(uint32_t)format, (uint32_t)key.size()};
+        OutputFile file{tempFilename};
+        file.write(CACHE_MAGIC, CACHE_MAGIC_SIZE);
+        file.write(header, sizeof(header));
+        file.write(key.data(), key.size());
+        file.write(binary.data(), binarySize);
+        file.close();
+        if (std::rename(tempFilename.c_str(), filename.c_str()) == -1)
+            throw std::runtime_error{"Failed to rename \""+tempFilename+"\": "+std::strerror(errno)};
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << "WARN: Failed to cache shader program: " << e.what() << '\n';
+        std::remove(tempFilename.c_str());
+    }
+}
+
+} // namespace ShaderCache
@@ -0,0 +1,22 @@
+#pragma once
+
+#include <GL/glew.h>
+
+/*
+ * On-disk cache of linked shader programs (ARB_get_program_binary), in `$XDG_CACHE_HOME/shot/shaders`.
+ *
+ * Entries are keyed by the GL vendor, renderer and version strings and by the shader sources,
+ * so a driver update or a changed shader misses the cache. The driver can still reject a binary,
+ * then `loadProgram()` returns 0 and the caller has to compile from source.
+ * Failures are never fatal, the cache is just skipped.
+ */
+namespace ShaderCache
+{
+
+// Needs a current GL context. Returns 0 if the program is not cached or the binary is rejected.
+GLuint loadProgram(const char* vertSource, const char* fragSource);
+// Must be called before linking a program that is passed to `storeProgram()`
+void prepareProgram(GLuint prog);
+void storeProgram(GLuint prog, const char* vertSource, const char* fragSource);
+
+} // namespace ShaderCache
@@ -0,0 +1,157 @@
+#include "ShmImage.h"
+#include "Trace.h"
+#include <X11/Xutil.h>
+#include <sys/shm.h>
+#include <sys/ipc.h>
+#include <stdexcept>
+#include <cstring>
+#include <cerrno>
+#include <cassert>
+
+extern bool g_isDisplayOpen;
+
+ShmImage::ShmImage(Display* disp, int width, int height)
+    : m_disp{disp}, m_maxWidth{width}, m_maxHeight{height}
+{
+    TRACE_SCOPE("shm_setup");
+
+    Screen* screen = XDefaultScreenOfDisplay(disp);
+    const int screeni = XDefaultScreen(disp);
+
+    m_img = XShmCreateImage(
+            disp, // Display
+            DefaultVisual(disp, screeni), // Visual (display format)
+            DefaultDepthOfScreen(screen), // Depth
+            ZPixmap, // Format
+            nullptr, // Data
+            &m_shmInfo, // shminfo
+            width, // width
+            height // height
+    );
+    assert(m_img);
+
+    // Create a shared memory buffer
+    m_shmInfo.shmid = shmget(IPC_PRIVATE, m_img->bytes_per_line*m_img->height, IPC_CREAT|0600);
+    if (m_shmInfo.shmid == -1)
+    {
+        XDestroyImage(m_img);
+        throw std::runtime_error{std::string("Failed to create shared memory segment: ")+std::strerror(errno)};
+    }
+    void* const shmAddr = shmat(m_shmInfo.shmid, nullptr, 0);
+    if (shmAddr == (void*)-1)
+    {
+        const int err = errno;
+        shmctl(m_shmInfo.shmid, IPC_RMID, 0);
+        XDestroyImage(m_img);
+        throw std::runtime_error{std::string("Failed to attach shared memory segment: ")+std::strerror(err)};
+    }
+    m_img->data = (char*)shmAddr;
+    m_shmInfo.shmaddr = m_img->data;
+    m_shmInfo.readOnly = false;
+
+    // Bind the buffer
+    Bool retb = XShmAttach(disp, &m_shmInfo);
+    assert(retb);
+    (void)retb;
+
+    // Wait for the server to attach the segment.
+    // The segment is freed when the last process detaches it,
+    // so mark it for deletion now to avoid leaking it if we crash.
+    XSync(disp, false);
+    shmctl(m_shmInfo.shmid, IPC_RMID, 0);
+}
+
+void ShmImage::capture(Window win, int x, int y, int width, int height)
+{
+    assert(width > 0 && height > 0);
+    assert(width <= m_maxWidth && height <= m_maxHeight);
+    TRACE_SCOPE("capture");
+
+    // The server writes the rows tightly packed (padded to the scanline pad),
+    // so the image header has to describe the smaller area
+    m_img->width = width;
+    m_img->height = height;
+    m_img->bytes_per_line = (m_img->bits_per_pixel*width+m_img->bitmap_pad-1)/m_img->bitmap_pad*m_img->bitmap_pad/8;
+
+    // Copy the image from the window to the image buffer
+    Bool retb = XShmGetImage(m_disp, win, m_img, x, y, AllPlanes);
+    assert(retb);
+    (void)retb;
+}
+
+void ShmImage::captureRows(Window win, int x, int y, int fromRow, int rowCount)
+{
+    assert(fromRow >= 0 && rowCount > 0 && fromRow+rowCount <= m_img->height);
+    TRACE_SCOPE("capture_rows");
+
+    // The server writes to the offset of `data` in the segment, so point it to the first row.
+    // Full rows have the same stride as the whole image, so they land in the right place.
+    char* const data = m_img->data;
+    const int height = m_img->height;
+    m_img->data += (size_t)fromRow*m_img->bytes_per_line;
+    m_img->height = rowCount;
+    Bool retb = XShmGetImage(m_disp, win, m_img, x, y+fromRow, AllPlanes);
+    m_img->data = data;
+    m_img->height = height;
+    assert(retb);
+    (void)retb;
+}
+
+void ShmImage::put(Drawable drawable, GC gc, int x, int y) const
+{
+    TRACE_SCOPE("shm_put");
+    Bool retb = XShmPutImage(m_disp, drawable, gc, m_img, 0, 0, x, y, m_img->width, m_img->height, false);
+    assert(retb);
+    (void)retb;
+}
+
+void ShmImage::capture(Window win, int x, int y)
+{
+    capture(win, x, y, m_maxWidth, m_maxHeight);
+}
+
+ShmImage::~ShmImage()
+{
+    // If the display is already closed, the server has already detached the segment
+    if (g_isDisplayOpen)
+        XShmDetach(m_disp, &m_shmInfo);
+    XDestroyImage(m_img); // Does not free the shared data
+    shmdt(m_shmInfo.shmaddr);
+}
+
+//------------------------------------------------------------
+
+ShmPool::ShmPool(Display* disp, int width, int height, int count)
+{
+    assert(count > 0);
+    for (int i{}; i < count; ++i)
+    {
+        m_images.push_back(std::make_unique<ShmImage>(disp, width, height));
+        m_freeImages.push_back(m_images.back().get());
+    }
+}
+
+ShmImage* ShmPool::acquire()
+{
+    std::unique_lock<std::mutex> lock{m_mutex};
+    m_cond.wait(lock, [this](){ return !m_freeImages.empty(); });
+    ShmImage* img = m_freeImages.back();
+    m_freeImages.pop_back();
+    return img;
+}
+
+void ShmPool::release(ShmImage* img)
+{
+    {
+        std::lock_guard<std::mutex> lock{m_mutex};
+        m_freeImages.push_back(img);
+    }
+    // Wakes `waitForAll()` too
+    m_cond.notify_all();
+}
+
+void ShmPool::waitForAll()
+{
+    std::unique_lock<std::mutex> lock{m_mutex};
+    m_cond.wait(lock, [this](){ return m_freeImages.size() == m_images.size(); });
+}
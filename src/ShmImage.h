@@ -0,0 +1,73 @@
+#pragma once
+
+#include <X11/Xlib.h>
+#include <X11/extensions/XShm.h>
+#include <cstdint>
+#include <vector>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+
+/*
+ * An XImage backed by a shared memory segment attached to the X server.
+ * The server writes captured pixels directly into it.
+ */
+class ShmImage
+{
+private:
+    Display* m_disp{};
+    XShmSegmentInfo m_shmInfo{};
+    XImage* m_img{};
+    // Size the segment was created for
+    int m_maxWidth{};
+    int m_maxHeight{};
+
+public:
+    ShmImage(Display* disp, int width, int height);
+    ShmImage(const ShmImage&) = delete;
+    ShmImage& operator=(const ShmImage&) = delete;
+
+    // Copies the area of `win` starting at (x, y) into the image, using the full size of the segment
+    void capture(Window win, int x, int y);
+    // Copies only a `width`x`height` area, the image is resized to that size
+    void capture(Window win, int x, int y, int width, int height);
+    /*
+     * Updates rows [`fromRow`, `fromRow+rowCount`) of the image from the area of `win` at (x, y)
+     * (where the whole image was captured from), leaving the other rows untouched.
+     */
+    void captureRows(Window win, int x, int y, int fromRow, int rowCount);
+    // Draws the image to `drawable` at (x, y), which must have the depth of the root window
+    void put(Drawable drawable, GC gc, int x, int y) const;
+
+    inline int getWidth() const { return m_img->width; }
+    inline int getHeight() const { return m_img->height; }
+    inline int getBytesPerLine() const { return m_img->bytes_per_line; }
+    inline uint8_t* getData() { return (uint8_t*)m_img->data; }
+    inline int getMaxWidth() const { return m_maxWidth; }
+    inline int getMaxHeight() const { return m_maxHeight; }
+
+    ~ShmImage();
+};
+
+/*
+ * A small set of pre-attached shared memory images of the same size, used by long-running
+ * capture loops to avoid creating and attaching a segment for each capture.
+ */
+class ShmPool
+{
+private:
+    std::vector<std::unique_ptr<ShmImage>> m_images;
+    std::vector<ShmImage*> m_freeImages;
+    std::mutex m_mutex;
+    std::condition_variable m_cond;
+
+public:
+    ShmPool(Display* disp, int width, int height, int count);
+
+    // Blocks until an image is available
+    ShmImage* acquire();
+    // Can be called from any thread
+    void release(ShmImage* img);
+    // Blocks until all the images are released
+    void waitForAll();
+};
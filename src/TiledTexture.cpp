@@ -0,0 +1,137 @@
+#include "TiledTexture.h"
+#include "Trace.h"
+#include <chrono>
+#include <algorithm>
+#include <cstring>
+#include <cassert>
+
+TiledTexture::TiledTexture(const ImageView& img, GLuint vertCoordAttrib, GLuint texCoordAttrib, const Options& opts)
+    : m_img{img}, m_opts{opts}
+{
+    assert(img.width > 0 && img.height > 0);
+
+    GLint maxTexSize{};
+    glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxTexSize);
+    if (maxTexSize > 0)
+        m_opts.tileSize = std::min(m_opts.tileSize, (int)maxTexSize);
+
+    std::vector<float> verts;
+    for (int y{}; y < img.height; y += m_opts.tileSize)
+    {
+        for (int x{}; x < img.width; x += m_opts.tileSize)
+        {
+            Tile tile{x, y, std::min(m_opts.tileSize, img.width-x), std::min(m_opts.tileSize, img.height-y)};
+            glGenTextures(1, &tile.tex);
+            glBindTexture(GL_TEXTURE_2D, tile.tex);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
+            m_tiles.push_back(tile);
+
+            // Pixel coordinates to NDC, the first row of the image is at the top
+            const float x1 = float(tile.x)/img.width*2-1;
+            const float x2 = float(tile.x+tile.w)/img.width*2-1;
+            const float y1 = 1-float(tile.y)/img.height*2;
+            const float y2 = 1-float(tile.y+tile.h)/img.height*2;
+            const float tileVerts[] = {
+                x1, y2, 0, /**/ 0, 1, // Bottom left
+                x1, y1, 0, /**/ 0, 0, // Top left
+                x2, y2, 0, /**/ 1, 1, // Bottom right
+                x2, y1, 0, /**/ 1, 0, // Top right
+            };
+            verts.insert(verts.end(), std::begin(tileVerts), std::end(tileVerts));
+        }
+    }
+
+    glGenVertexArrays(1, &m_vao);
+    glBindVertexArray(m_vao);
+    glGenBuffers(1, &m_vbo);
+    glBindBuffer(GL_ARRAY_BUFFER, m_vbo);
+    glBufferData(GL_ARRAY_BUFFER, verts.size()*sizeof(float), verts.data(), GL_STATIC_DRAW);
+    glVertexAttribPointer(vertCoordAttrib, 3, GL_FLOAT, false, sizeof(float)*5, (void*)0);
+    glEnableVertexAttribArray(vertCoordAttrib);
+    glVertexAttribPointer(texCoordAttrib, 2, GL_FLOAT, false, sizeof(float)*5, (void*)(sizeof(float)*3));
+    glEnableVertexAttribArray(texCoordAttrib);
+
+    if (m_opts.usePbo)
+        glGenBuffers(2, m_pbos);
+}
+
+void TiledTexture::uploadTile(Tile* tile)
+{
+    const ImageView src = m_img.getSubView(tile->x, tile->y, tile->w, tile->h);
+    glBindTexture(GL_TEXTURE_2D, tile->tex);
+    if (m_opts.usePbo)
+    {
+        const size_t rowLen = (size_t)tile->w*4;
+        const size_t size = rowLen*tile->h;
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, m_pbos[m_uploadedCount%2]);
+        // Orphans the previous storage if the GPU still reads it
+        glBufferData(GL_PIXEL_UNPACK_BUFFER, size, nullptr, GL_STREAM_DRAW);
+        uint8_t* dst = (uint8_t*)glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, size,
+                GL_MAP_WRITE_BIT|GL_MAP_INVALIDATE_BUFFER_BIT);
+        if (dst)
+        {
+            for (int y{}; y < tile->h; ++y)
+                std::memcpy(dst+y*rowLen, src.getRow(y), rowLen);
+            glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+            // Returns without waiting, the pixels are read from the buffer object
+            glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, tile->w, tile->h, 0, GL_BGRA, GL_UNSIGNED_BYTE, nullptr);
+            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+            return;
+        }
+        // Mapping failed, upload from client memory instead
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    }
+
+    // Rows of the screenshot can be padded
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, src.bytesPerLine/4);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, tile->w, tile->h, 0, GL_BGRA, GL_UNSIGNED_BYTE, src.data);
+    glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+}
+
+bool TiledTexture::uploadSome(double budgetMs)
+{
+    if (isComplete())
+        return false;
+
+    TRACE_SCOPE("texture_upload");
+    const auto start = std::chrono::steady_clock::now();
+    do
+    {
+        uploadTile(&m_tiles[m_uploadedCount]);
+        ++m_uploadedCount;
+    }
+    while (!isComplete()
+        && std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now()-start).count() < budgetMs);
+    return !isComplete();
+}
+
+void TiledTexture::uploadAll()
+{
+    while (uploadSome(1e9))
+        ;
+}
+
+void TiledTexture::draw() const
+{
+    glActiveTexture(GL_TEXTURE0);
+    glBindVertexArray(m_vao);
+    for (int i{}; i < m_uploadedCount; ++i)
+    {
+        glBindTexture(GL_TEXTURE_2D, m_tiles[i].tex);
+        glDrawArrays(GL_TRIANGLE_STRIP, i*4, 4);
+    }
+}
+
+TiledTexture::~TiledTexture()
+{
+    for (const Tile& tile : m_tiles)
+        glDeleteTextures(1, &tile.tex);
+    if (m_opts.usePbo)
+        glDeleteBuffers(2, m_pbos);
+    glDeleteBuffers(1, &m_vbo);
+    glDeleteVertexArrays(1, &m_vao);
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include "ImageView.h"
+#include <GL/glew.h>
+#include <vector>
+
+/*
+ * The screenshot shown by the overlay, as a grid of textures.
+ *
+ * One texture would have to fit in GL_MAX_TEXTURE_SIZE, which large virtual desktops do not,
+ * and uploading it in one call delays the first frame. The tiles are uploaded a few at a time
+ * with `uploadSome()`, and `draw()` draws the ones that are already uploaded.
+ * The overlay is drawn 1:1, so the textures have no mipmaps.
+ *
+ * Needs a current GL context and the image must stay valid until all the tiles are uploaded.
+ */
+class TiledTexture
+{
+public:
+    struct Options
+    {
+        // Limited to GL_MAX_TEXTURE_SIZE
+        int tileSize{1024};
+        // Upload through pixel buffer objects, so the driver copies to the GPU asynchronously
+        bool usePbo{true};
+    };
+
+private:
+    struct Tile
+    {
+        int x{};
+        int y{};
+        int w{};
+        int h{};
+        GLuint tex{};
+    };
+
+    ImageView m_img;
+    Options m_opts;
+    std::vector<Tile> m_tiles;
+    int m_uploadedCount{};
+
+    GLuint m_vao{};
+    // 4 vertices per tile, drawn as triangle strips
+    GLuint m_vbo{};
+    // Used in turns, so filling one does not wait for the upload from the other
+    GLuint m_pbos[2]{};
+
+    void uploadTile(Tile* tile);
+
+public:
+    TiledTexture(const ImageView& img, GLuint vertCoordAttrib, GLuint texCoordAttrib, const Options& opts);
+    TiledTexture(const TiledTexture&) = delete;
+    TiledTexture& operator=(const TiledTexture&) = delete;
+
+    // Uploads tiles until about `budgetMs` elapsed (at least one), returns false when all are uploaded
+    bool uploadSome(double budgetMs);
+    void uploadAll();
+    inline bool isComplete() const { return m_uploadedCount == (int)m_tiles.size(); }
+
+    // Draws the uploaded tiles with the bound shader program, which samples texture unit 0
+    void draw() const;
+
+    ~TiledTexture();
+};
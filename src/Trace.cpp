@@ -0,0 +1,125 @@
+#include "Trace.h"
+#include "Output.h"
+#include <sys/resource.h>
+#include <vector>
+#include <algorithm>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <sstream>
+#include <iomanip>
+#include <cstring>
+
+namespace Trace
+{
+
+struct Phase
+{
+    const char* name;
+    clock_t::time_point start;
+    clock_t::time_point end;
+    int threadIndex;
+    // Sampled when the phase ended
+    long peakRssKb;
+};
+
+// Caps the memory used by long-running modes (daemon, recording), about 4 MiB of phases
+#define MAX_PHASE_COUNT 100000
+
+static bool s_isEnabled = false;
+static clock_t::time_point s_startTime;
+static std::mutex s_mutex;
+// The first `MAX_PHASE_COUNT` phases, for the Chrome trace
+static std::vector<Phase> s_phases;
+static long s_droppedPhaseCount{};
+// Summed duration in milliseconds by phase name, in the order they first finished
+static std::vector<std::pair<const char*, double>> s_totals;
+// Small numbers are easier to read in the trace viewer than thread ids
+static std::map<std::thread::id, int> s_threadIndices;
+
+void enable()
+{
+    s_startTime = clock_t::now();
+    s_phases.reserve(256);
+    s_isEnabled = true;
+}
+
+bool isEnabled()
+{
+    return s_isEnabled;
+}
+
+void addPhase(const char* name, clock_t::time_point start, clock_t::time_point end)
+{
+    const long peakRssKb = getPeakRssKb();
+
+    const double ms = std::chrono::duration<double, std::milli>(end-start).count();
+
+    std::lock_guard<std::mutex> lock{s_mutex};
+    auto totalIt = std::find_if(s_totals.begin(), s_totals.end(), [&](const auto& entry){
+        return std::strcmp(entry.first, name) == 0;
+    });
+    if (totalIt == s_totals.end())
+        s_totals.emplace_back(name, ms);
+    else
+        totalIt->second += ms;
+
+    if (s_phases.size() >= MAX_PHASE_COUNT)
+    {
+        ++s_droppedPhaseCount;
+        return;
+    }
+    auto it = s_threadIndices.emplace(std::this_thread::get_id(), s_threadIndices.size()).first;
+    s_phases.push_back({name, start, end, it->second, peakRssKb});
+}
+
+long getPeakRssKb()
+{
+    rusage usage{};
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+static double toUs(clock_t::time_point time)
+{
+    return std::chrono::duration<double, std::micro>(time-s_startTime).count();
+}
+
+void writeChromeTrace(const std::string& filename)
+{
+    std::lock_guard<std::mutex> lock{s_mutex};
+
+    std::ostringstream ss;
+    ss << std::fixed << std::setprecision(3) << "{\"traceEvents\":[\n";
+    for (size_t i{}; i < s_phases.size(); ++i)
+    {
+        const Phase& phase = s_phases[i];
+        // A complete event for the phase and a counter event for the memory usage
+        ss << "{\"name\":\"" << phase.name << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << phase.threadIndex
+            << ",\"ts\":" << toUs(phase.start) << ",\"dur\":" << toUs(phase.end)-toUs(phase.start) << "},\n"
+            << "{\"name\":\"peak_rss\",\"ph\":\"C\",\"pid\":1,\"ts\":" << toUs(phase.end)
+            << ",\"args\":{\"KiB\":" << phase.peakRssKb << "}}"
+            << (i+1 < s_phases.size() ? ",\n" : "\n");
+    }
+    ss << "],\"displayTimeUnit\":\"ms\",\"otherData\":{\"dropped_phases\":" << s_droppedPhaseCount << "}}\n";
+
+    const std::string str = ss.str();
+    OutputFile file{filename};
+    file.write(str.data(), str.size());
+    file.close();
+}
+
+std::string getSummary()
+{
+    std::lock_guard<std::mutex> lock{s_mutex};
+
+    std::ostringstream ss;
+    ss << std::fixed << std::setprecision(3)
+        << "total_ms=" << std::chrono::duration<double, std::milli>(clock_t::now()-s_startTime).count();
+    for (const auto& entry : s_totals)
+        ss << ' ' << entry.first << '=' << entry.second;
+    ss << " peak_rss_kb=" << getPeakRssKb();
+    return ss.str();
+}
+
+} // namespace Trace
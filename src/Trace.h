@@ -0,0 +1,73 @@
+#pragma once
+
+#include <string>
+#include <chrono>
+
+/*
+ * Lightweight phase timing.
+ *
+ * Phases are recorded with `TRACE_SCOPE("name")` (the name must be a string literal).
+ * Nothing is recorded until `Trace::enable()` is called, so the disabled cost is one branch.
+ * The recorded phases can be written as a Chrome trace-event JSON file (chrome://tracing,
+ * Perfetto) or as a one-line summary. The trace keeps a limited number of phases (the later ones
+ * are counted in `otherData.dropped_phases`), the summary includes all of them.
+ */
+namespace Trace
+{
+
+using clock_t = std::chrono::steady_clock;
+
+// Must be called before starting any threads that record phases
+void enable();
+bool isEnabled();
+
+void addPhase(const char* name, clock_t::time_point start, clock_t::time_point end);
+
+// Records the time from its construction until `end()` or its destruction
+class Scope
+{
+private:
+    const char* m_name;
+    clock_t::time_point m_start;
+    bool m_hasEnded{};
+
+public:
+    explicit Scope(const char* name)
+        : m_name{name}
+    {
+        if (isEnabled())
+            m_start = clock_t::now();
+    }
+    Scope(const Scope&) = delete;
+    Scope& operator=(const Scope&) = delete;
+
+    // For phases that don't match a C++ scope
+    void end()
+    {
+        if (isEnabled() && !m_hasEnded)
+            addPhase(m_name, m_start, clock_t::now());
+        m_hasEnded = true;
+    }
+
+    ~Scope()
+    {
+        end();
+    }
+};
+
+// Peak resident set size of the process so far, in KiB
+long getPeakRssKb();
+
+// Throws on failure
+void writeChromeTrace(const std::string& filename);
+/*
+ * Space separated `key=value` pairs: `total_ms`, the summed duration of each
+ * phase in milliseconds (in the order they first finished) and `peak_rss_kb`.
+ */
+std::string getSummary();
+
+} // namespace Trace
+
+#define TRACE_CONCAT_(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_(a, b)
+#define TRACE_SCOPE(name) Trace::Scope TRACE_CONCAT(traceScope_, __LINE__){name}
@@ -0,0 +1,79 @@
+#include "WinUtils.h"
+#include <X11/extensions/Xrandr.h>
+#include <iostream>
+#include <stdexcept>
+#include <cassert>
+
+using uint = unsigned int;
+
+Window getToplevelWin(Display* disp, Window win)
+{
+    while (true)
+    {
+        Window rootWin;
+        Window parentWin;
+        Window* children;
+        uint childCount;
+        if (XQueryTree(disp, win, &rootWin, &parentWin, &children, &childCount) == 0)
+        {
+            std::cerr << "Failed to get top level window\n";
+            throw std::runtime_error{"Failed to get top level window"};
+        }
+
+        if (children)
+            XFree(children);
+
+        // If this is the root or this is a top-level window
+        if (win == rootWin || parentWin == rootWin)
+            return win;
+        else
+            win = parentWin; // Go to the next parent
+    }
+}
+
+WinGeometry getFocusedWinGeom(Display* disp)
+{
+    WinGeometry out;
+
+    Window win;
+    int focusState;
+    XGetInputFocus(disp, &win, &focusState);
+    // No window has the focus (e.g. no window manager), XQueryTree would fail with BadWindow
+    if (win == PointerRoot || win == None)
+        return {};
+    try
+    {
+        win = getToplevelWin(disp, win);
+    }
+    catch (...)
+    {
+        return {};
+    }
+
+    XWindowAttributes attrs;
+    XGetWindowAttributes(disp, win, &attrs);
+    assert(attrs.width > 1 && attrs.height > 1);
+    out.x = attrs.x;
+    out.y = attrs.y;
+    out.w = attrs.width;
+    out.h = attrs.height;
+
+    return out;
+}
+
+std::vector<MonitorInfo> getMonitors(Display* disp)
+{
+    int monCount;
+    XRRMonitorInfo* monInfoArr = XRRGetMonitors(disp, XDefaultRootWindow(disp), false, &monCount);
+
+    std::vector<MonitorInfo> out;
+    for (int i{}; i < monCount; ++i)
+    {
+        char* name = XGetAtomName(disp, monInfoArr[i].name);
+        out.push_back({name ? name : "", {monInfoArr[i].x, monInfoArr[i].y, monInfoArr[i].width, monInfoArr[i].height}});
+        XFree(name);
+    }
+
+    XRRFreeMonitors(monInfoArr);
+    return out;
+}
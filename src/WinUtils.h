@@ -0,0 +1,19 @@
+#pragma once
+
+#include "Screenshot.h"
+#include <X11/Xlib.h>
+#include <string>
+#include <vector>
+
+struct MonitorInfo
+{
+    std::string name;
+    WinGeometry geom;
+};
+
+// Returns the top-level ancestor of `win` (a child of the root), throws on failure
+Window getToplevelWin(Display* disp, Window win);
+// Geometry of the top-level window that has the input focus, all zero on failure
+WinGeometry getFocusedWinGeom(Display* disp);
+// Monitors in XRandR order
+std::vector<MonitorInfo> getMonitors(Display* disp);
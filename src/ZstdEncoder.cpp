@@ -0,0 +1,137 @@
+#include "ZstdEncoder.h"
+#include "FramePool.h"
+#include <vector>
+#include <memory>
+#include <string>
+#include <stdexcept>
+#include <cstdint>
+#include <functional>
+
+#ifdef SHOT_HAVE_ZSTD
+#   include <zstd.h>
+
+static void checkZstdError(size_t ret, const char* what)
+{
+    if (ZSTD_isError(ret))
+        throw std::runtime_error{std::string("zstd: ")+what+": "+ZSTD_getErrorName(ret)};
+}
+#endif
+
+ZstdEncoder::ZstdEncoder()
+    : ZstdEncoder{Options{}}
+{
+}
+
+ZstdEncoder::ZstdEncoder(const Options& opts)
+    : m_opts{opts}
+{
+#ifdef SHOT_HAVE_ZSTD
+    m_cctx = ZSTD_createCCtx();
+    if (!m_cctx)
+        throw std::runtime_error{"zstd: Failed to create context"};
+
+    checkZstdError(ZSTD_CCtx_setParameter(m_cctx, ZSTD_c_compressionLevel, m_opts.compLevel), "Invalid level");
+    checkZstdError(ZSTD_CCtx_setParameter(m_cctx, ZSTD_c_checksumFlag, 1), "Failed to enable checksum");
+    if (m_opts.threadCount > 0)
+    {
+        // Fails if libzstd was built without threading, then it just compresses on this thread
+        ZSTD_CCtx_setParameter(m_cctx, ZSTD_c_nbWorkers, m_opts.threadCount);
+    }
+#endif
+}
+
+#ifdef SHOT_HAVE_ZSTD
+/*
+ * Compresses the raw frame of `img` into `outBuf`. When it is full, `flush` is called, which
+ * has to make room in it. If `flush` is empty, `outBuf` must be large enough for the whole frame.
+ */
+static void compressRawFrame(ZSTD_CCtx* cctx, const ImageView& img, ZSTD_outBuffer* outBuf,
+        const std::function<void()>& flush)
+{
+    const size_t rowLen = (size_t)img.width*4;
+    const size_t srcSize = RAW_HEADER_SIZE+rowLen*img.height;
+
+    ZSTD_CCtx_reset(cctx, ZSTD_reset_session_only);
+    // Makes the decompressed size part of the frame header
+    checkZstdError(ZSTD_CCtx_setPledgedSrcSize(cctx, srcSize), "Failed to set size");
+
+    uint8_t header[RAW_HEADER_SIZE]{};
+    fillRawHeader(img.width, img.height, header);
+    auto feed = [&](const void* data, size_t size, ZSTD_EndDirective mode){
+        ZSTD_inBuffer inBuf{data, size, 0};
+        size_t remaining;
+        do
+        {
+            remaining = ZSTD_compressStream2(cctx, outBuf, &inBuf, mode);
+            checkZstdError(remaining, "Compression failed");
+            if (outBuf->pos == outBuf->size && flush)
+                flush();
+        }
+        while (mode == ZSTD_e_end ? remaining != 0 : inBuf.pos < inBuf.size);
+    };
+
+    feed(header, sizeof(header), ZSTD_e_continue);
+    if (rowLen == (size_t)img.bytesPerLine)
+    {
+        feed(img.data, rowLen*img.height, ZSTD_e_end);
+    }
+    else
+    {
+        // Cropped view, skip the rest of the rows
+        for (int y{}; y < img.height; ++y)
+            feed(img.getRow(y), rowLen, ZSTD_e_continue);
+        feed(nullptr, 0, ZSTD_e_end);
+    }
+}
+#endif
+
+EncodedBuffer ZstdEncoder::encodeToBuffer(const ImageView& img)
+{
+#ifdef SHOT_HAVE_ZSTD
+    // Reused between frames, only the compressed part is copied out
+    const size_t bound = ZSTD_compressBound(RAW_HEADER_SIZE+(size_t)img.width*4*img.height);
+    PooledBuffer buff{FramePool::getDefault().acquire(bound)};
+    ZSTD_outBuffer outBuf{buff.get(), bound, 0};
+    compressRawFrame(m_cctx, img, &outBuf, nullptr);
+
+    return std::make_shared<const std::vector<uint8_t>>(buff.get(), buff.get()+outBuf.pos);
+#else
+    (void)img;
+    throw std::runtime_error{"zstd support is not compiled in"};
+#endif
+}
+
+void ZstdEncoder::encode(const ImageView& img, const writeFun_t& write)
+{
+#ifdef SHOT_HAVE_ZSTD
+    std::vector<uint8_t> buff(ZSTD_CStreamOutSize());
+    ZSTD_outBuffer outBuf{buff.data(), buff.size(), 0};
+    auto flush = [&](){
+        write(buff.data(), outBuf.pos);
+        outBuf.pos = 0;
+    };
+    compressRawFrame(m_cctx, img, &outBuf, flush);
+    if (outBuf.pos)
+        flush();
+#else
+    (void)img;
+    (void)write;
+    throw std::runtime_error{"zstd support is not compiled in"};
+#endif
+}
+
+ZstdEncoder::~ZstdEncoder()
+{
+#ifdef SHOT_HAVE_ZSTD
+    ZSTD_freeCCtx(m_cctx);
+#endif
+}
+
+bool ZstdEncoder::isAvailable()
+{
+#ifdef SHOT_HAVE_ZSTD
+    return true;
+#else
+    return false;
+#endif
+}
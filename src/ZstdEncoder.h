@@ -0,0 +1,45 @@
+#pragma once
+
+#include "ImageView.h"
+#include "Output.h"
+
+struct ZSTD_CCtx_s;
+
+/*
+ * Writes raw frames (see `RAW_MAGIC`) compressed into a single zstd frame,
+ * so `zstd -d` gives back a plain raw dump.
+ *
+ * Only available if the program was built with zstd (`SHOT_HAVE_ZSTD`).
+ */
+class ZstdEncoder
+{
+public:
+    struct Options
+    {
+        // zstd compression level (1-19), fast levels are the interesting ones here
+        int compLevel{3};
+        // Number of zstd worker threads, 0 means compressing on the calling thread
+        int threadCount{};
+    };
+
+private:
+    Options m_opts;
+    // Kept between `encode()` and `encodeToBuffer()` calls to avoid reallocating the compressor state
+    ZSTD_CCtx_s* m_cctx{};
+
+public:
+    ZstdEncoder();
+    ZstdEncoder(const Options& opts);
+    ZstdEncoder(const ZstdEncoder&) = delete;
+    ZstdEncoder& operator=(const ZstdEncoder&) = delete;
+
+    inline const Options& getOptions() const { return m_opts; }
+
+    EncodedBuffer encodeToBuffer(const ImageView& img);
+    // Calls `write` with pieces of the compressed frame as they are produced
+    void encode(const ImageView& img, const writeFun_t& write);
+
+    ~ZstdEncoder();
+
+    static bool isAvailable();
+};
@@ -1,16 +1,29 @@
 #include <X11/Xlib.h>
 #include <X11/Xutil.h>
 #include <X11/cursorfont.h>
-#include <X11/extensions/Xrandr.h>
 #include <GL/glew.h>
 #include <GL/gl.h>
 #include <GL/glx.h>
 #include <iostream>
 #include <string>
-#include <ctime>
 #include <cassert>
 #include <cstdlib>
+#include <cstdio>
+#include <cctype>
+#include <chrono>
+#include <filesystem>
+#include <memory>
 #include "Screenshot.h"
+#include "Clipboard.h"
+#include "CaptureDaemon.h"
+#include "WinUtils.h"
+#include "Headless.h"
+#include "FrameStore.h"
+#include "ImageLoader.h"
+#include "ImageDiff.h"
+#include "TiledTexture.h"
+#include "ShaderCache.h"
+#include "Trace.h"
 #include "utils.h"
 
 using uint = unsigned int;
@@ -23,15 +36,6 @@ bool g_isDisplayOpen = false;
 
 //typedef GLXContext (*glXCreateContextAttribsARBProc)(Display*, GLXFBConfig, GLXContext, Bool, const int*);
 
-static std::string genFilenamePref()
-{
-    time_t time = std::time(nullptr);
-    tm* localTM = std::localtime(&time);
-    char buff[sizeof("0000-00-00-000000")]{};
-    std::strftime(buff, sizeof(buff), "%F-%H%M%S", localTM);
-    return buff;
-}
-
 static int xErrHandler(Display* disp, XErrorEvent* event)
 {
     char buff[1024]{};
@@ -48,6 +52,9 @@ static int xErrHandler(Display* disp, XErrorEvent* event)
 #define SEL_VERT_ATTRIB_VERT_COORD 0
 #define SEL_VERT_ATTRIB_REL_COORD 1
 
+// Time spent uploading the overlay texture tiles per frame
+#define TEX_UPLOAD_BUDGET_MS 4
+
 static constexpr const char* imgVertShaderSrc = "\
 #version 130                                  \n\
                                               \n\
@@ -144,12 +151,20 @@ static uint createShader(bool isVert, const char* source)
 
 static uint createShaderProg(const char* vertSource, const char* fragSource)
 {
+    {
+        TRACE_SCOPE("shader_cache_load");
+        if (const uint prog = ShaderCache::loadProgram(vertSource, fragSource))
+            return prog;
+    }
+
+    Trace::Scope compileScope{"shader_compile"};
     uint vertShader = createShader(true, vertSource);
     uint fragShader = createShader(false, fragSource);
     uint prog = glCreateProgram();
     assert(prog);
     glAttachShader(prog, vertShader);
     glAttachShader(prog, fragShader);
+    ShaderCache::prepareProgram(prog);
     glLinkProgram(prog);
 
     int linkStat{};
@@ -164,85 +179,21 @@ static uint createShaderProg(const char* vertSource, const char* fragSource)
         delete[] buff;
         std::exit(1);
     }
+    compileScope.end();
 
+    TRACE_SCOPE("shader_cache_store");
+    ShaderCache::storeProgram(prog, vertSource, fragSource);
     return prog;
 }
 
-struct WinGeometry
-{
-    int x{};
-    int y{};
-    int w{};
-    int h{};
-};
-
-static Window getToplevelWin(Display* disp, Window win)
-{
-    while (true)
-    {
-        Window rootWin;
-        Window parentWin;
-        Window* children;
-        uint childCount;
-        if (XQueryTree(disp, win, &rootWin, &parentWin, &children, &childCount) == 0)
-        {
-            std::cerr << "Failed to get top level window\n";
-            notifShow("Screenshot Error", "Failed to get top level window");
-            throw std::runtime_error{"Failed to get top level window"};
-        }
-
-        if (children)
-            XFree(children);
-
-        // If this is the root or this is a top-level window
-        if (win == rootWin || parentWin == rootWin)
-            return win;
-        else
-            win = parentWin; // Go to the next parent
-    }
-}
-
-WinGeometry getFocusedWinGeom(Display* disp)
-{
-    WinGeometry out;
-
-    Window win;
-    int focusState;
-    XGetInputFocus(disp, &win, &focusState);
-    try
-    {
-        win = getToplevelWin(disp, win);
-    }
-    catch (...)
-    {
-        return {};
-    }
-
-    XWindowAttributes attrs;
-    XGetWindowAttributes(disp, win, &attrs);
-    assert(attrs.width > 1 && attrs.height > 1);
-    out.x = attrs.x;
-    out.y = attrs.y;
-    out.w = attrs.width;
-    out.h = attrs.height;
-
-    return out;
-}
-
 WinGeometry getCurrentMonitorGeom(Display* disp)
 {
-    WinGeometry out;
-
-    const Window rootWin = XDefaultRootWindow(disp);
-    int monCount;
-    XRRMonitorInfo* monInfoArr = XRRGetMonitors(disp, rootWin, false, &monCount);
-    std::cout << "There are " << monCount << " monitors\n";
-    for (int i{}; i < monCount; ++i)
+    const std::vector<MonitorInfo> monitors = getMonitors(disp);
+    std::cout << "There are " << monitors.size() << " monitors\n";
+    for (const MonitorInfo& mon : monitors)
     {
-        char* name = XGetAtomName(disp, monInfoArr[i].name);
-        std::cout << '\t' << name << ": (w=" << monInfoArr[i].width << ", h=" << monInfoArr[i].height << ") "
-            "@ (" << monInfoArr[i].x << ", " << monInfoArr[i].y << ")\n";
-        XFree(name);
+        std::cout << '\t' << mon.name << ": (w=" << mon.geom.w << ", h=" << mon.geom.h << ") "
+            "@ (" << mon.geom.x << ", " << mon.geom.y << ")\n";
     }
 
     int cursX, cursY;
@@ -251,20 +202,16 @@ WinGeometry getCurrentMonitorGeom(Display* disp)
         Window childWin;
         int winX, winY;
         uint btnMask;
-        XQueryPointer(disp, rootWin, &rootRet, &childWin, &cursX, &cursY, &winX, &winY, &btnMask);
+        XQueryPointer(disp, XDefaultRootWindow(disp), &rootRet, &childWin, &cursX, &cursY, &winX, &winY, &btnMask);
     }
     std::cout << "Pointer is at " << cursX << ", " << cursY << '\n';
 
     // Index of monitor where the cursor is
     int cursMonI = -1;
-    for (int i{}; i < monCount; ++i)
+    for (size_t i{}; i < monitors.size(); ++i)
     {
-        const int mx1 = monInfoArr[i].x;
-        const int my1 = monInfoArr[i].y;
-        const int mx2 = mx1 + monInfoArr[i].width;
-        const int my2 = my1 + monInfoArr[i].height;
-
-        if (cursX >= mx1 && cursX <= mx2 && cursY >= my1 && cursY <= my2)
+        const WinGeometry& geom = monitors[i].geom;
+        if (cursX >= geom.x && cursX <= geom.x+geom.w && cursY >= geom.y && cursY <= geom.y+geom.h)
         {
             cursMonI = i;
             break;
@@ -278,14 +225,26 @@ WinGeometry getCurrentMonitorGeom(Display* disp)
     }
 
     std::cout << "Pointer is on monitor " << cursMonI << '\n';
+    return monitors[cursMonI].geom;
+}
 
-    out.x = monInfoArr[cursMonI].x;
-    out.y = monInfoArr[cursMonI].y;
-    out.w = monInfoArr[cursMonI].width;
-    out.h = monInfoArr[cursMonI].height;
-
-    XRRFreeMonitors(monInfoArr);
-    return out;
+static void finishTrace(const std::string& traceFilename, bool printSummary)
+{
+    if (!traceFilename.empty())
+    {
+        try
+        {
+            Trace::writeChromeTrace(traceFilename);
+            std::cerr << "Wrote trace to \"" << traceFilename << "\"\n";
+        }
+        catch (const std::exception& e)
+        {
+            std::cerr << "ERR: " << e.what() << '\n';
+        }
+    }
+    // To stderr, stdout can be the image
+    if (printSummary)
+        std::cerr << "shot-trace " << Trace::getSummary() << '\n';
 }
 
 enum class ScreenshotType
@@ -295,15 +254,348 @@ enum class ScreenshotType
     CurrentScreen,
 };
 
-int main()
+static int extractFrame(const std::string& filename, int index, const std::string& output, const Codec::Options& codecOpts)
 {
-    notifInit("Screenshot");
+    try
+    {
+        FrameStoreReader reader{filename};
+        if (index < 0 || index >= reader.getFrameCount())
+        {
+            throw std::runtime_error{"Invalid frame index: "+std::to_string(index)
+                +", there are "+std::to_string(reader.getFrameCount())+" frames"};
+        }
+        const ImageView frame = reader.readFrame(index);
+        const Codec::Format format = Codec::getFormatFromFilename(output, Codec::Format::PNG);
+        writeBufferToFile(Codec::encode(frame, format, codecOpts), output);
+        std::cerr << "Saved frame " << index << " (id " << reader.getFrameId(index) << ") to \"" << output << "\"\n";
+        return 0;
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << "ERR: " << e.what() << '\n';
+        return 1;
+    }
+}
+
+static int compareFiles(const std::string& filenameA, const std::string& filenameB,
+        const ImageDiff::Options& opts, const std::string& diffFilename)
+{
+    try
+    {
+        const LoadedImage imageA{filenameA};
+        const LoadedImage imageB{filenameB};
+        return ImageDiff::compareAndReport(imageA.getView(), imageB.getView(), opts, diffFilename);
+    }
+    catch (const std::exception& e)
+    {
+        std::cerr << "ERR: " << e.what() << '\n';
+        return 2;
+    }
+}
+
+static void printUsage(const char* progName)
+{
+    std::cout << "Usage: " << progName << " [OPTION...]\n"
+        "  --daemon         Run as a capture daemon listening on a UNIX socket\n"
+        "  --client FILE    Ask a running daemon to capture the screen to FILE\n"
+        "  --socket PATH    Socket path of the daemon (default: " << CaptureDaemon::getDefaultSocketPath() << ")\n"
+        "  --format FORMAT  Format of the saved screenshot: png (default), qoi, zstd, ppm, pam, bmp or raw.\n"
+        "                   The daemon chooses it by the extension of the file.\n"
+        "  --level N        Compression level: 0-9 for png (default: 6), 1-19 for zstd (default: 3).\n"
+        "                   The other formats have no levels.\n"
+        "  --threads N      Number of encoder threads (default: 0, one per CPU core)\n"
+        "  --extract FILE.frames N OUTPUT\n"
+        "                   Save frame N (0-based) of a frame store written by --record to OUTPUT\n"
+        "  --verbose        Print the pointer and button events of the selection overlay\n"
+        "  --help           Show this help\n"
+        "\n"
+        "Comparing images (exit code: 0 if they match, 1 if they differ, 2 on errors):\n"
+        "  --compare A B    Compare two image files\n"
+        "  --compare-live REF\n"
+        "                   Compare a capture (of the area selected below) with the image file REF\n"
+        "  --tolerance N|R,G,B\n"
+        "                   Largest difference of a channel that still counts as equal (default: 0)\n"
+        "  --diff FILE      Save an image with the differing pixels in red\n"
+        "\n"
+        "Headless capture, without the selection overlay:\n"
+        "  --window         Capture the focused window\n"
+        "  --monitor N      Capture the Nth monitor (0-based)\n"
+        "  --rect X,Y,W,H   Capture a rectangle of the screen\n"
+        "  --all-monitors   Capture the screen once and save each monitor to its own file,\n"
+        "                   named like the output file with the monitor name appended\n"
+        "  --output FILE    Save to FILE (the format comes from the extension), or write to stdout if FILE is -\n"
+        "  --output-fd N    Write to the open file descriptor N, like stdout with --output -\n"
+        "  --timings        Print the latency of each step to stderr\n"
+        "  --record DIR     Record the screen (or the area selected above) to DIR, one file per changed frame.\n"
+        "                   The format is qoi unless --format is given.\n"
+        "  --fps N          Frame rate of the recording (default: 30)\n"
+        "  --duration SECS  Stop recording after SECS seconds (default: until Ctrl+C)\n"
+        "\n"
+        "Instrumentation:\n"
+        "  --trace FILE     Write the duration of each phase as Chrome trace-event JSON\n"
+        "  --trace-summary  Print the duration of each phase and the peak RSS to stderr in one line\n";
+}
+
+int main(int argc, char** argv)
+{
+    HeadlessOptions headlessOpts;
+    headlessOpts.startTime = std::chrono::steady_clock::now();
+    bool isHeadless = false;
+
+    bool runAsDaemon = false;
+    std::string traceFilename;
+    bool printTraceSummary = false;
+    bool isVerbose = false;
+    std::string clientFilename;
+    std::string extractFilename;
+    int extractIndex{};
+    std::string extractOutput;
+    std::string compareFilenameA;
+    std::string compareFilenameB;
+    std::string socketPath = CaptureDaemon::getDefaultSocketPath();
+    Codec::Format format = Codec::Format::PNG;
+    Codec::Options codecOpts;
+    for (int i{1}; i < argc; ++i)
+    {
+        const std::string arg = argv[i];
+        if (arg == "--daemon")
+        {
+            runAsDaemon = true;
+        }
+        else if (arg == "--client" && i+1 < argc)
+        {
+            clientFilename = argv[++i];
+        }
+        else if (arg == "--socket" && i+1 < argc)
+        {
+            socketPath = argv[++i];
+        }
+        else if (arg == "--format" && i+1 < argc)
+        {
+            if (!Codec::parseFormat(argv[++i], &format))
+            {
+                std::cerr << "Invalid format: \"" << argv[i] << "\"\n";
+                return 1;
+            }
+            if (!Codec::isFormatAvailable(format))
+            {
+                std::cerr << "Format not available in this build: \"" << argv[i] << "\"\n";
+                return 1;
+            }
+            headlessOpts.hasFormat = true;
+        }
+        else if (arg == "--level" && i+1 < argc)
+        {
+            codecOpts.level = std::atoi(argv[++i]);
+            if (!std::isdigit((unsigned char)argv[i][0]))
+            {
+                std::cerr << "Invalid compression level: \"" << argv[i] << "\"\n";
+                return 1;
+            }
+        }
+        else if (arg == "--threads" && i+1 < argc)
+        {
+            codecOpts.threadCount = std::atoi(argv[++i]);
+            if (!std::isdigit((unsigned char)argv[i][0]))
+            {
+                std::cerr << "Invalid thread count: \"" << argv[i] << "\"\n";
+                return 1;
+            }
+        }
+        else if (arg == "--window")
+        {
+            headlessOpts.target = HeadlessOptions::Target::FocusedWindow;
+            isHeadless = true;
+        }
+        else if (arg == "--monitor" && i+1 < argc)
+        {
+            headlessOpts.target = HeadlessOptions::Target::Monitor;
+            headlessOpts.monitorIndex = std::atoi(argv[++i]);
+            isHeadless = true;
+        }
+        else if (arg == "--all-monitors")
+        {
+            headlessOpts.target = HeadlessOptions::Target::AllMonitors;
+            isHeadless = true;
+        }
+        else if (arg == "--rect" && i+1 < argc)
+        {
+            WinGeometry& rect = headlessOpts.rect;
+            if (std::sscanf(argv[++i], "%d,%d,%d,%d", &rect.x, &rect.y, &rect.w, &rect.h) != 4
+             || rect.w <= 0 || rect.h <= 0)
+            {
+                std::cerr << "Invalid rectangle: \"" << argv[i] << "\", expected X,Y,W,H\n";
+                return 1;
+            }
+            headlessOpts.target = HeadlessOptions::Target::Rect;
+            isHeadless = true;
+        }
+        else if (arg == "--output" && i+1 < argc)
+        {
+            headlessOpts.output = argv[++i];
+            isHeadless = true;
+        }
+        else if (arg == "--output-fd" && i+1 < argc)
+        {
+            headlessOpts.outputFd = std::atoi(argv[++i]);
+            if (headlessOpts.outputFd < 0 || !std::isdigit((unsigned char)argv[i][0]))
+            {
+                std::cerr << "Invalid file descriptor: \"" << argv[i] << "\"\n";
+                return 1;
+            }
+            isHeadless = true;
+        }
+        else if (arg == "--record" && i+1 < argc)
+        {
+            headlessOpts.recordDir = argv[++i];
+            isHeadless = true;
+        }
+        else if (arg == "--fps" && i+1 < argc)
+        {
+            headlessOpts.fps = std::atof(argv[++i]);
+            if (headlessOpts.fps <= 0)
+            {
+                std::cerr << "Invalid frame rate: \"" << argv[i] << "\"\n";
+                return 1;
+            }
+        }
+        else if (arg == "--duration" && i+1 < argc)
+        {
+            headlessOpts.durationSecs = std::atof(argv[++i]);
+        }
+        else if (arg == "--trace" && i+1 < argc)
+        {
+            traceFilename = argv[++i];
+        }
+        else if (arg == "--trace-summary")
+        {
+            printTraceSummary = true;
+        }
+        else if (arg == "--timings")
+        {
+            headlessOpts.printTimings = true;
+            isHeadless = true;
+        }
+        else if (arg == "--extract" && i+3 < argc)
+        {
+            extractFilename = argv[++i];
+            extractIndex = std::atoi(argv[++i]);
+            extractOutput = argv[++i];
+        }
+        else if (arg == "--compare" && i+2 < argc)
+        {
+            compareFilenameA = argv[++i];
+            compareFilenameB = argv[++i];
+        }
+        else if (arg == "--compare-live" && i+1 < argc)
+        {
+            headlessOpts.compareWith = argv[++i];
+            isHeadless = true;
+        }
+        else if (arg == "--tolerance" && i+1 < argc)
+        {
+            if (!ImageDiff::parseTolerance(argv[++i], &headlessOpts.diffOpts))
+            {
+                std::cerr << "Invalid tolerance: \"" << argv[i] << "\", expected N or R,G,B (0-255)\n";
+                return 2;
+            }
+        }
+        else if (arg == "--diff" && i+1 < argc)
+        {
+            headlessOpts.diffOutput = argv[++i];
+        }
+        else if (arg == "--verbose")
+        {
+            isVerbose = true;
+        }
+        else if (arg == "--help")
+        {
+            printUsage(argv[0]);
+            return 0;
+        }
+        else
+        {
+            std::cerr << "Invalid argument: \"" << arg << "\"\n";
+            printUsage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (!clientFilename.empty())
+    {
+        try
+        {
+            // The daemon has a different working directory
+            const std::string request = "capture "+std::filesystem::absolute(clientFilename).lexically_normal().string();
+            const std::string reply = CaptureDaemon::sendRequest(socketPath, request);
+            std::cout << reply << '\n';
+            return reply.rfind("ok", 0) == 0 ? 0 : 1;
+        }
+        catch (const std::exception& e)
+        {
+            std::cerr << "ERR: " << e.what() << '\n';
+            return 1;
+        }
+    }
+
+    if (!extractFilename.empty())
+        return extractFrame(extractFilename, extractIndex, extractOutput, codecOpts);
+    if (!compareFilenameA.empty())
+        return compareFiles(compareFilenameA, compareFilenameB, headlessOpts.diffOpts, headlessOpts.diffOutput);
+
+    if (!traceFilename.empty() || printTraceSummary)
+        Trace::enable();
 
     XSetErrorHandler(&xErrHandler);
 
+    // Straight from capture to file, no GLX
+    if (isHeadless)
+    {
+        headlessOpts.format = format;
+        headlessOpts.codecOpts = codecOpts;
+        const int ret = runHeadless(headlessOpts);
+        finishTrace(traceFilename, printTraceSummary);
+        return ret;
+    }
+
+    // Not after the selection, it would be lost. The daemon checks it for each capture.
+    if (!runAsDaemon)
+    {
+        try
+        {
+            Codec::checkLevel(format, codecOpts.level);
+        }
+        catch (const std::exception& e)
+        {
+            std::cerr << "ERR: " << e.what() << '\n';
+            return 1;
+        }
+    }
+
+    Trace::Scope displayOpenScope{"display_open"};
     Display* disp = XOpenDisplay(nullptr);
     assert(disp);
     g_isDisplayOpen = true;
+    displayOpenScope.end();
+
+    if (runAsDaemon)
+    {
+        int ret = 0;
+        try
+        {
+            CaptureDaemon daemon{disp, socketPath, codecOpts};
+            daemon.run();
+        }
+        catch (const std::exception& e)
+        {
+            std::cerr << "ERR: " << e.what() << '\n';
+            ret = 1;
+        }
+        XCloseDisplay(disp);
+        g_isDisplayOpen = false;
+        notifUninit();
+        return ret;
+    }
 
     Screenshot sshot{disp};
 
@@ -314,15 +606,59 @@ int main()
     XWindowAttributes attrs{};
     Status rets = XGetWindowAttributes(disp, rootWin, &attrs);
     assert(rets);
+
+    Cursor curs = XCreateFontCursor(disp, XC_crosshair);
+    const long overlayEventMask = ButtonPressMask|ButtonReleaseMask|KeyPressMask|KeyReleaseMask|PointerMotionMask|ExposureMask;
+    auto grabInput = [&](Window win){
+        // Moves the grab if this client already has it
+        XGrabKeyboard(disp, win, false, GrabModeAsync, GrabModeAsync, CurrentTime);
+        XGrabPointer(disp, win, false, ButtonMotionMask|ButtonPressMask|ButtonReleaseMask, GrabModeAsync, GrabModeAsync, win, curs, CurrentTime);
+    };
+
+    /*
+     * Show the frozen frame right away, in a plain window with the visual of the root window.
+     * GL takes over when the whole image is uploaded, input is handled from now on.
+     */
+    Trace::Scope previewScope{"overlay_preview"};
+    XSetWindowAttributes previewAttrs{};
+    previewAttrs.event_mask = overlayEventMask;
+    previewAttrs.override_redirect = true;
+    previewAttrs.save_under = true;
+    previewAttrs.background_pixmap = None;
+    Window previewWin = XCreateWindow(
+            disp,
+            rootWin,
+            0, 0,
+            attrs.width, attrs.height,
+            0,
+            CopyFromParent,
+            InputOutput,
+            CopyFromParent,
+            CWBackPixmap|CWEventMask|CWOverrideRedirect|CWSaveUnder,
+            &previewAttrs
+    );
+    XMapWindow(disp, previewWin);
+    grabInput(previewWin);
+    XDefineCursor(disp, previewWin, curs);
+    GC previewGc = XCreateGC(disp, previewWin, 0, nullptr);
+    sshot.putImage(previewWin, previewGc);
+    // Wait until the server has drawn it, so the measured time is real
+    XSync(disp, false);
+    previewScope.end();
+    if (Trace::isEnabled())
+        Trace::addPhase("launch_to_first_pixel", headlessOpts.startTime, Trace::clock_t::now());
+
     std::cout << "Root window size is: " << attrs.width << "x" << attrs.height << '\n';
 
     WinGeometry focusedWinGeom = getFocusedWinGeom(disp);
     std::cout << "Focused window geometry: (x=" << focusedWinGeom.x << ", y="
         << focusedWinGeom.y << ") (w=" << focusedWinGeom.w << ", h=" << focusedWinGeom.h << ")\n";
 
+    const Trace::clock_t::time_point glxSetupStart = Trace::clock_t::now();
+    Trace::Scope glxSetupScope{"glx_setup"};
     XSetWindowAttributes winAttrs{};
     winAttrs.border_pixel = 0;
-    winAttrs.event_mask = ButtonPressMask|ButtonReleaseMask|KeyPressMask|KeyReleaseMask|PointerMotionMask|ExposureMask|ClientMessage;
+    winAttrs.event_mask = overlayEventMask;
     winAttrs.override_redirect = true;
     winAttrs.save_under = true;
     static constexpr int visAttrs[] = {
@@ -336,8 +672,6 @@ int main()
     assert(visInf);
     winAttrs.colormap = XCreateColormap(disp, rootWin, visInf->visual, AllocNone);
 
-    Cursor curs = XCreateFontCursor(disp, XC_crosshair);
-
     Window glxWin = XCreateWindow(
             disp,
             rootWin,
@@ -350,10 +684,7 @@ int main()
             CWColormap|CWEventMask|CWOverrideRedirect|CWSaveUnder,
             &winAttrs
     );
-    XMapWindow(disp, glxWin);
-    XGrabKeyboard(disp, glxWin, false, GrabModeAsync, GrabModeAsync, CurrentTime);
-    XGrabPointer(disp, glxWin, false, ButtonMotionMask|ButtonPressMask|ButtonReleaseMask, GrabModeAsync, GrabModeAsync, glxWin, curs, CurrentTime);
-
+    // Mapped when the first frame is ready, the preview is shown until then
     XDefineCursor(disp, glxWin, curs);
 
     GLXContext glxCont = glXCreateContext(disp, visInf, nullptr, GL_TRUE);
@@ -369,10 +700,7 @@ int main()
 
 
     glViewport(0, 0, attrs.width, attrs.height);
-
-    glClearColor(1.0f, 1.0f, 1.0f, 1.0f);
-    glClear(GL_COLOR_BUFFER_BIT);
-    glXSwapBuffers(disp, glxWin);
+    glxSetupScope.end();
 
     // Set window name and class
     XClassHint* hints = XAllocClassHint();
@@ -389,33 +717,9 @@ int main()
 
     uint imgShader = createShaderProg(imgVertShaderSrc, imgFragShaderSrc);
 
-    const float imgVertCoords[] = {
-        -1, -1, 0, /**/ 0, 1, // 0 - Top left
-        -1,  1, 0, /**/ 0, 0, // 1 - Bottom left
-         1, -1, 0, /**/ 1, 1, // 2 - Top right
-         1,  1, 0, /**/ 1, 0, // 3 - Bottom right
-    };
     const int vertIndices[] = {
         1, 0, 2, 1, 3, 2
     };
-    uint imgVao{};
-    glGenVertexArrays(1, &imgVao);
-    glBindVertexArray(imgVao);
-
-    uint imgVbo{};
-    glGenBuffers(1, &imgVbo);
-    glBindBuffer(GL_ARRAY_BUFFER, imgVbo);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(imgVertCoords), imgVertCoords, GL_STATIC_DRAW);
-
-    uint imgEbo{};
-    glGenBuffers(1, &imgEbo);
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, imgEbo);
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(vertIndices), vertIndices, GL_STATIC_DRAW);
-
-    glVertexAttribPointer(IMG_VERT_ATTRIB_VERT_COORD, 3, GL_FLOAT, false, sizeof(float)*5, (void*)0);
-    glEnableVertexAttribArray(IMG_VERT_ATTRIB_VERT_COORD);
-    glVertexAttribPointer(IMG_VERT_ATTRIB_TEX_COORD, 2, GL_FLOAT, false, sizeof(float)*5, (void*)(sizeof(float)*3));
-    glEnableVertexAttribArray(IMG_VERT_ATTRIB_TEX_COORD);
 
     //------------------------------------------------------------
 
@@ -449,13 +753,10 @@ int main()
 
     //------------------------------------------------------------
 
-    uint tex{};
-    glGenTextures(1, &tex);
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(GL_TEXTURE_2D, tex);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, sshot.getWidth(), sshot.getHeight(), 0, GL_BGRA, GL_UNSIGNED_BYTE, sshot.getDataPtr());
-    glGenerateMipmap(GL_TEXTURE_2D);
-
+    // The tiles are uploaded while the overlay is already running, see the render loop
+    auto imgTex = std::make_unique<TiledTexture>(sshot.getView(),
+            IMG_VERT_ATTRIB_VERT_COORD, IMG_VERT_ATTRIB_TEX_COORD, TiledTexture::Options{});
+    glUseProgram(imgShader);
     glUniform1i(glGetUniformLocation(imgShader, "tex"), 0);
 
     glEnable(GL_TEXTURE_2D);
@@ -473,10 +774,13 @@ int main()
     int selStartY{};
     bool done = false;
     bool cancelled = false;
+    // Nothing is drawn until something changes on the screen
+    bool needsRedraw = true;
     while (!done)
     {
         XEvent event{};
-        while (XPending(disp)) // While there are events in the queue
+        // Handles the queued events, and blocks in `XNextEvent()` while there is nothing to draw
+        while (!done && (XPending(disp) || (!needsRedraw && imgTex->isComplete())))
         {
             XNextEvent(disp, &event);
             switch (event.type)
@@ -518,17 +822,29 @@ int main()
                     }
                     break;
 
+                case Expose:
+                    needsRedraw = true;
+                    break;
+
                 case MotionNotify:
                 {
-                    std::cout << "Moved pointer to: " << event.xmotion.x << ", " << event.xmotion.y << '\n';
+                    // Only the last one of the consecutive motion events matters
+                    XEvent next;
+                    while (XPending(disp) && (XPeekEvent(disp, &next), next.type == MotionNotify))
+                        XNextEvent(disp, &event);
+
+                    if (isVerbose)
+                        std::cout << "Moved pointer to: " << event.xmotion.x << ", " << event.xmotion.y << '\n';
                     mouseX = event.xmotion.x;
                     mouseY = event.xmotion.y;
+                    needsRedraw |= isDragging;
                     break;
                 }
 
                 case ButtonPress:
                 {
-                    std::cout << "Pressed mouse button: " << event.xbutton.button << '\n';
+                    if (isVerbose)
+                        std::cout << "Pressed mouse button: " << event.xbutton.button << '\n';
                     if (event.xbutton.button == 1)
                     {
                         isDragging = true;
@@ -536,26 +852,41 @@ int main()
                         mouseY = event.xmotion.y;
                         selStartX = mouseX;
                         selStartY = mouseY;
+                        needsRedraw = true;
                     }
                     break;
                 }
 
                 case ButtonRelease:
                 {
-                    std::cout << "Released mouse button: " << event.xbutton.button << '\n';
+                    if (isVerbose)
+                        std::cout << "Released mouse button: " << event.xbutton.button << '\n';
                     if (event.xbutton.button == 1)
                         isDragging = false;
                     break;
                 }
             }
         }
+        if (done)
+            break;
+
+        if (previewWin)
+        {
+            // A few tiles per iteration, so input is still handled
+            if (imgTex->uploadSome(TEX_UPLOAD_BUDGET_MS))
+                continue;
+
+            XMapWindow(disp, glxWin);
+            grabInput(glxWin);
+        }
+
+        TRACE_SCOPE("overlay_frame");
 
         glClearColor(0.8f, 0.8f, 0.2f, 1.0f);
         glClear(GL_COLOR_BUFFER_BIT);
 
         glUseProgram(imgShader);
-        glBindVertexArray(imgVao);
-        glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, nullptr);
+        imgTex->draw();
 
 
         glUseProgram(selectionShader);
@@ -580,8 +911,37 @@ int main()
         glDrawElements(GL_TRIANGLES, 6, GL_UNSIGNED_INT, nullptr);
 
         glXSwapBuffers(disp, glxWin);
+        needsRedraw = false;
+        if (previewWin)
+        {
+            // The GL window covers it now
+            XDestroyWindow(disp, previewWin);
+            previewWin = 0;
+            if (Trace::isEnabled())
+                Trace::addPhase("overlay_first_frame", glxSetupStart, Trace::clock_t::now());
+        }
     }
 
+    // Give the screen back to the user before saving, which can take a while for large PNGs
+    Trace::Scope teardownScope{"overlay_teardown"};
+    imgTex.reset();
+    glDeleteProgram(imgShader);
+    glDeleteBuffers(1, &selectionVbo);
+    glDeleteBuffers(1, &selectionEbo);
+    glDeleteVertexArrays(1, &selectionVao);
+    glDeleteProgram(selectionShader);
+    glXMakeCurrent(disp, None, nullptr);
+    glXDestroyContext(disp, glxCont);
+    XUngrabKeyboard(disp, CurrentTime);
+    XUngrabPointer(disp, CurrentTime);
+    XDestroyWindow(disp, glxWin);
+    if (previewWin)
+        XDestroyWindow(disp, previewWin);
+    XFreeGC(disp, previewGc);
+    XFreeCursor(disp, curs);
+    XFlush(disp);
+    teardownScope.end();
+
     if (!cancelled)
     {
         bool didSelectionCropping = false;
@@ -616,53 +976,68 @@ int main()
             sshot.crop(geom.x, geom.y, geom.w, geom.h);
         }
 
-        { // Write to file
-            std::string filename;
-            if (const char* homeDir = getenv("HOME"))
+        const std::string filename = genDefaultFilename(Codec::getFormatExtension(format));
+
+        std::string notifTitle;
+        if (sshotType == ScreenshotType::FocusedWindow)
+            notifTitle = "Created screenshot of focused window";
+        else if (sshotType == ScreenshotType::CurrentScreen)
+            notifTitle = "Created screenshot of current screen";
+        else if (sshotType == ScreenshotType::CroppedOrFull && didSelectionCropping)
+            notifTitle = "Created screenshot of selected area";
+        else if (sshotType == ScreenshotType::CroppedOrFull)
+            notifTitle = "Created screenshot of all screens";
+
+        // Forks the clipboard holder process, so do it before the first notification starts GLib's threads
+        PendingClipboardPng clipboardPng;
+        try
+        {
+            sshot.copyToClipboard(format == Codec::Format::PNG ? &clipboardPng : nullptr);
+            std::cout << "Copied screenshot to clipboard\n";
+        }
+        catch (const std::exception& e)
+        {
+            std::cerr << "ERR: " << e.what() << '\n';
+            notifShow("Screenshot Error", e.what());
+        }
+
+        try
+        {
+            // Encode once, the same data goes to the file and (if it is a PNG) to the clipboard.
+            // The PNG is encoded in stripes on all the cores.
+            const EncodedBuffer encoded = sshot.encode(format, codecOpts);
+            try
             {
-                filename = std::string(homeDir)+"/Pictures/";
+                if (format == Codec::Format::PNG)
+                    clipboardPng.provide(*encoded);
             }
-            else
+            catch (const std::exception& e)
             {
-                std::cerr << "WARN: Failed to get $HOME\n";
+                // The clipboard process encodes it again if it is pasted
+                std::cerr << "WARN: " << e.what() << '\n';
             }
-            filename += genFilenamePref()+".png";
+            clipboardPng.close();
 
-            sshot.writeToPNGFile(filename);
+            // Only notify when the file is really on the disk
+            writeBufferToFile(encoded, filename, true);
             std::cout << "Saved screenshot to \""+filename+"\"\n";
-
-            if (sshotType == ScreenshotType::FocusedWindow)
-                notifShow("Created screenshot of focused window", "Saved screenshot to \""+filename+"\"");
-            else if (sshotType == ScreenshotType::CurrentScreen)
-                notifShow("Created screenshot of current screen", "Saved screenshot to \""+filename+"\"");
-            else if (sshotType == ScreenshotType::CroppedOrFull && didSelectionCropping)
-                notifShow("Created screenshot of selected area",  "Saved screenshot to \""+filename+"\"");
-            else if (sshotType == ScreenshotType::CroppedOrFull)
-                notifShow("Created screenshot of all screens",    "Saved screenshot to \""+filename+"\"");
+            notifShow(notifTitle, "Saved screenshot to \""+filename+"\"");
+        }
+        catch (const std::exception& e)
+        {
+            std::cerr << "ERR: " << e.what() << '\n';
+            notifShow("Screenshot Error", e.what());
         }
-
-        sshot.copyToClipboard();
-        std::cout << "Copied screenshot to clipboard\n";
     }
     else
     {
         std::cout << "Cancelled\n";
     }
 
-    glDeleteBuffers(1, &imgVbo);
-    glDeleteBuffers(1, &imgEbo);
-    glDeleteVertexArrays(1, &imgVao);
-    glDeleteProgram(imgShader);
-    glDeleteBuffers(1, &selectionVbo);
-    glDeleteBuffers(1, &selectionEbo);
-    glDeleteVertexArrays(1, &selectionVao);
-    glDeleteProgram(selectionShader);
     sshot.destroy();
-    XUngrabKeyboard(disp, CurrentTime);
-    XUngrabPointer(disp, CurrentTime);
     XCloseDisplay(disp);
-    XFreeCursor(disp, curs);
     g_isDisplayOpen = false;
     notifUninit();
+    finishTrace(traceFilename, printTraceSummary);
     return 0;
 }
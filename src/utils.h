@@ -4,14 +4,17 @@
 #include <libnotify/notify.h>
 
 #define NOTIF_TIMEOUT 5000
+#define NOTIF_APP_NAME "Screenshot"
 
-inline void notifInit(const std::string& appName)
-{
-    notify_init(appName.c_str());
-}
-
+/*
+ * libnotify is initialized by the first notification. GLib can start helper threads then,
+ * so the clipboard holder process is forked before the first notification is shown.
+ */
 inline void notifShow(const std::string& title, const std::string& msg)
 {
+    if (!notify_is_initted())
+        notify_init(NOTIF_APP_NAME);
+
     NotifyNotification* notif = notify_notification_new(title.c_str(), msg.c_str(), nullptr);
     notify_notification_set_timeout(notif, NOTIF_TIMEOUT);
     notify_notification_show(notif, nullptr);
@@ -19,5 +22,6 @@ inline void notifShow(const std::string& title, const std::string& msg)
 
 inline void notifUninit()
 {
-    notify_uninit();
+    if (notify_is_initted())
+        notify_uninit();
 }